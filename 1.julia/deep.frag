@@ -0,0 +1,70 @@
+#version 330
+
+// Deep zoom version of julia.frag.
+//
+// Past a zoom of about 1e5 the pixels are closer to each other than what a
+// float can tell apart, and the picture turns to blocks. Here every pixel z
+// is written as the reference orbit Z (the orbit of the center, computed with
+// more digits on the CPU) plus a small difference d:
+//
+//   z_n = Z_n + d_n
+//   z_(n+1) = z_n^2 + c = Z_n^2 + c + 2*Z_n*d_n + d_n^2
+//   d_(n+1) = 2*Z_n*d_n + d_n^2 = (2*Z_n + d_n)*d_n
+//
+// c cancels out, and d can be iterated in float however small it is.
+//
+// The approximation breaks ("glitches") when z gets closer to 0 than to the
+// reference, |z| < |d|: d then carries the whole value and its few digits
+// are not enough. When that happens, or the reference orbit ends before the
+// pixel escapes, we rebase: the pixel continues from the start of the
+// reference, with d = z - Z_0. Nearby pixels have already drifted apart by
+// then, so the float digits of z are enough.
+
+// Same as in julia.frag, in the range -1,1
+in vec2 v_quad_position;
+
+// Half of the size of the view, the center is the start of the orbit
+uniform vec2 u_half_size;
+uniform float u_iterations;
+// Reference orbit, a texel per step, 1024 per row (see progressive.hpp)
+uniform sampler2D u_orbit;
+uniform int u_orbit_length;
+
+layout (location = 0) out float iterations;
+
+vec2 orbit(int n)
+{
+  return texelFetch(u_orbit, ivec2(n & 1023, n >> 10), 0).rg;
+}
+
+// Complex product
+vec2 mul(vec2 a, vec2 b)
+{
+  return vec2(a.x*b.x - a.y*b.y, a.x*b.y + a.y*b.x);
+}
+
+void main()
+{
+  const float threshold = 4.0;
+
+  vec2 Z0 = orbit(0);
+  vec2 d = v_quad_position * u_half_size;
+  int n = 0; // Step of the reference orbit
+  float i;
+  for(i = 0.0; i<u_iterations; ++i){
+    vec2 Z = orbit(n);
+    vec2 z = Z + d;
+    if(dot(z,z) >= threshold) break;
+
+    if(dot(z,z) < dot(d,d) || n == u_orbit_length - 1){
+      // Glitch or end of the reference: rebase
+      d = z - Z0;
+      Z = Z0;
+      n = 0;
+    }
+    d = mul(2.0*Z + d, d);
+    ++n;
+  }
+
+  iterations = i;
+}
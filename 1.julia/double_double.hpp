@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cmath>
+
+namespace julia
+{
+  /* A number stored as the unevaluated sum of two doubles, hi + lo, with
+   * |lo| <= ulp(hi)/2. It has about 32 significant digits instead of 16,
+   * enough to keep the center of the view exact at zooms around 1e30.
+   *
+   * The operations are the classic error-free transformations (Dekker, Knuth):
+   * two_sum gives the rounding error of a sum, two_prod the one of a product
+   * (with a fused multiply-add, which is always exact in std::fma).
+   */
+  struct dd
+  {
+    double hi = 0.0;
+    double lo = 0.0;
+
+    dd() {}
+    dd(double v) : hi(v) {}
+    dd(double h, double l) : hi(h), lo(l) {}
+  };
+
+  namespace detail
+  {
+    inline dd two_sum(double a, double b)
+    {
+      double s = a + b;
+      double v = s - a;
+      double e = (a - (s - v)) + (b - v);
+      return dd(s, e);
+    }
+
+    inline dd quick_two_sum(double a, double b) // |a| >= |b|
+    {
+      double s = a + b;
+      return dd(s, b - (s - a));
+    }
+
+    inline dd two_prod(double a, double b)
+    {
+      double p = a * b;
+      return dd(p, std::fma(a, b, -p));
+    }
+  }
+
+  inline dd operator+(const dd & a, const dd & b)
+  {
+    dd s = detail::two_sum(a.hi, b.hi);
+    dd t = detail::two_sum(a.lo, b.lo);
+    s.lo += t.hi;
+    s = detail::quick_two_sum(s.hi, s.lo);
+    s.lo += t.lo;
+    return detail::quick_two_sum(s.hi, s.lo);
+  }
+
+  inline dd operator-(const dd & a) { return dd(-a.hi, -a.lo); }
+  inline dd operator-(const dd & a, const dd & b) { return a + (-b); }
+
+  inline dd operator*(const dd & a, const dd & b)
+  {
+    dd p = detail::two_prod(a.hi, b.hi);
+    p.lo += a.hi * b.lo + a.lo * b.hi;
+    return detail::quick_two_sum(p.hi, p.lo);
+  }
+
+  inline bool operator==(const dd & a, const dd & b) { return a.hi == b.hi and a.lo == b.lo; }
+  inline bool operator!=(const dd & a, const dd & b) { return not (a == b); }
+
+  /* Nearest float, for the code that does not need the extra digits */
+  inline float to_float(const dd & a) { return float(a.hi + a.lo); }
+}
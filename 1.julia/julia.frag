@@ -4,33 +4,37 @@
 // Contains the coordinates (in the range -1,1) of the fragment we are drawing.
 in vec2 v_quad_position;
 
+// Part of the complex plane that is shown: the center and half of the size
+uniform vec2 u_center;
+uniform vec2 u_half_size;
+// Iteration limit, it grows when we zoom in (see adaptive_iterations)
+uniform float u_iterations;
+// The constant of f(z) = z^2 + c, each c gives a different set
+uniform vec2 u_c;
+
+// We do not write a color but the number of iterations, to a float texture.
+// palette.frag turns it into a color, so the palette can change without
+// computing the fractal again.
+layout (location = 0) out float iterations;
+
 void main()
 {
-  const float iter = 200.0;
   const float threshold = 4.0;
 
-  vec2 z = v_quad_position * normalize(vec2(16,9)) * 2;
-  vec2 c = vec2(-0.4,0.6); //vec2(phi-2,phi-1);
+  vec2 z = u_center + v_quad_position * u_half_size;
+  vec2 c = u_c; // Nice ones: (-0.4,0.6), (phi-2,phi-1), (-0.8,0.156)
 
   // f(z) = z^2 + c
   // Compute z_i = f(z_(i-1))
   // Until the norm of z grows over a threshold
   float i;
-  for(i = 0.0; i<iter && dot(z,z) < threshold; ++i){
+  for(i = 0.0; i<u_iterations && dot(z,z) < threshold; ++i){
     float x = z.x*z.x - z.y*z.y;
     float y = 2*z.x*z.y;
     z = vec2(x,y)+c;
   }
 
-  // Play around with the number of iterations until a nice coloring appears
-  i = pow(i,0.5);
-  // I have no good idea of how to set the color to this
-  float r = 0.5*(1+cos(i+0.4)); // make sure the result range is [0,1]
-  float g = 0.5*(1+cos(i+1));
-  float b = 0.5*(1+cos(i+2.5));
-
-  gl_FragColor = vec4(r,g,b*b,1.0);
-  
+  iterations = i;
 }
 
 
@@ -0,0 +1,304 @@
+#pragma once
+
+/* CPU version of julia.frag.
+ *
+ * Used to make pictures without a GPU (batch jobs, servers) and to check
+ * what the GPU draws. The coloring is the same as in palette.frag.
+ *
+ * The escape loop is evaluated for 8 (AVX2) or 16 (AVX-512) pixels at once.
+ * Pixels that escaped are masked out and keep their value, the loop ends when
+ * all the pixels of the group escaped or the iteration limit is reached.
+ * The image is cut in tiles that are spread over the threads of a
+ * util::thread_pool. Tiles inside the set cost much more than tiles outside,
+ * the pool steals work between threads to keep them all busy.
+ *
+ * The CPU version always iterates in single precision, parameters::deep
+ * only changes what the GPU does. reference_orbit is the CPU half of it.
+ */
+
+#include "common/thread_pool.hpp"
+#include "double_double.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JULIA_X86 1
+#include <immintrin.h>
+#endif
+
+namespace julia
+{
+  /* What is drawn. The defaults are the original constants of julia.frag.
+   * The same structure holds the view of the interactive version. */
+  struct parameters
+  {
+    float c_re = -0.4f;
+    float c_im =  0.6f;
+    // The center has more digits than a float, so deep zooms can be placed
+    // precisely (see reference_orbit). The float versions use to_float().
+    dd center_re = 0.0;
+    dd center_im = 0.0;
+    // Half of the size of the picture in the complex plane,
+    // julia.frag uses normalize(vec2(16,9))*2
+    float half_width  = 2.f * 16.f / std::sqrt(16.f*16.f + 9.f*9.f);
+    float half_height = 2.f *  9.f / std::sqrt(16.f*16.f + 9.f*9.f);
+    int iterations = 200;
+    // Draw with perturbation (deep.frag) instead of julia.frag
+    bool deep = false;
+    // Phase of the cosine of each color channel, see palette.frag
+    float phase[3] = {0.4f, 1.f, 2.5f};
+  };
+
+  /* True if a and b give the same iteration counts (they may differ in colors) */
+  inline bool same_iterations(const parameters & a, const parameters & b)
+  {
+    return a.c_re == b.c_re and a.c_im == b.c_im and
+      a.center_re == b.center_re and a.center_im == b.center_im and
+      a.half_width == b.half_width and a.half_height == b.half_height and
+      a.iterations == b.iterations and a.deep == b.deep;
+  }
+
+  /* Deeper zooms need more iterations to tell the points of the set from the
+   * ones that escape slowly. zoom is 1 for the initial view. */
+  inline int adaptive_iterations(float zoom, int base = 200)
+  {
+    float octaves = std::max(0.f, std::log2(zoom));
+    return std::min(int(base * (1.f + 0.35f*octaves)), 20000);
+  }
+
+  enum isa { scalar, avx2, avx512 };
+
+  inline const char * isa_name(isa i)
+  {
+    switch(i){
+    case avx2:   return "avx2";
+    case avx512: return "avx512";
+    default:     return "scalar";
+    }
+  }
+
+  inline bool supported(isa i)
+  {
+#ifdef JULIA_X86
+    if(i == avx2)   return __builtin_cpu_supports("avx2");
+    if(i == avx512) return __builtin_cpu_supports("avx512f");
+#endif
+    return i == scalar;
+  }
+
+  inline isa best_isa()
+  {
+    return supported(avx512) ? avx512 : supported(avx2) ? avx2 : scalar;
+  }
+
+  namespace detail
+  {
+    const float THRESHOLD = 4.f;
+    const int TILE_WIDTH  = 64;
+    const int TILE_HEIGHT = 16;
+
+    /* Same as palette.frag */
+    inline void color(const float phase[3], float iterations, std::uint8_t * rgba)
+    {
+      float i = std::sqrt(iterations);
+      float r = 0.5f*(1.f+std::cos(i+phase[0]));
+      float g = 0.5f*(1.f+std::cos(i+phase[1]));
+      float b = 0.5f*(1.f+std::cos(i+phase[2]));
+      b = b*b;
+      // Like the GPU does to store a float in an 8 bit channel
+      rgba[0] = std::uint8_t(std::lround(std::min(std::max(r,0.f),1.f) * 255.f));
+      rgba[1] = std::uint8_t(std::lround(std::min(std::max(g,0.f),1.f) * 255.f));
+      rgba[2] = std::uint8_t(std::lround(std::min(std::max(b,0.f),1.f) * 255.f));
+      rgba[3] = 255;
+    }
+
+    /* Iteration counts of `count` consecutive pixels of a row, starting at
+     * column `first`. The real part of pixel x is left + (x+0.5)*dx, computed
+     * the same way by every version so they give the very same result. */
+    inline void row_scalar(const parameters & p, float left, float dx, float y,
+                           int first, int count, float * out)
+    {
+      for(int k = 0; k < count; ++k){
+        float zx = left + (float(first + k) + 0.5f)*dx, zy = y;
+        float i = 0.f;
+        for(; i < p.iterations && zx*zx + zy*zy < THRESHOLD; i += 1.f){
+          float x = zx*zx - zy*zy;
+          float yy = 2*zx*zy;
+          zx = x + p.c_re;
+          zy = yy + p.c_im;
+        }
+        out[k] = i;
+      }
+    }
+
+#ifdef JULIA_X86
+    __attribute__((target("avx2")))
+    inline void row_avx2(const parameters & p, float left, float dx, float y,
+                         int first, int count, float * out)
+    {
+      const __m256 lanes = _mm256_setr_ps(0.5f,1.5f,2.5f,3.5f,4.5f,5.5f,6.5f,7.5f);
+      const __m256 c_re = _mm256_set1_ps(p.c_re);
+      const __m256 c_im = _mm256_set1_ps(p.c_im);
+      const __m256 threshold = _mm256_set1_ps(THRESHOLD);
+      const __m256 one = _mm256_set1_ps(1.f);
+
+      int k = 0;
+      for(; k + 8 <= count; k += 8){
+        __m256 column = _mm256_add_ps(_mm256_set1_ps(float(first + k)), lanes);
+        __m256 zx = _mm256_add_ps(_mm256_set1_ps(left),
+                                  _mm256_mul_ps(column, _mm256_set1_ps(dx)));
+        __m256 zy = _mm256_set1_ps(y);
+        __m256 i = _mm256_setzero_ps();
+        for(int n = 0; n < p.iterations; ++n){
+          __m256 xx = _mm256_mul_ps(zx,zx);
+          __m256 yy = _mm256_mul_ps(zy,zy);
+          // Lanes still inside the threshold
+          __m256 active = _mm256_cmp_ps(_mm256_add_ps(xx,yy), threshold, _CMP_LT_OQ);
+          if(_mm256_movemask_ps(active) == 0) break;
+          i = _mm256_add_ps(i, _mm256_and_ps(active, one));
+          __m256 nx = _mm256_add_ps(_mm256_sub_ps(xx,yy), c_re);
+          __m256 ny = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(zx,zx), zy), c_im);
+          // Escaped lanes keep their value
+          zx = _mm256_blendv_ps(zx, nx, active);
+          zy = _mm256_blendv_ps(zy, ny, active);
+        }
+        _mm256_storeu_ps(out + k, i);
+      }
+      row_scalar(p, left, dx, y, first + k, count - k, out + k);
+    }
+
+    __attribute__((target("avx512f")))
+    inline void row_avx512(const parameters & p, float left, float dx, float y,
+                           int first, int count, float * out)
+    {
+      const __m512 lanes = _mm512_setr_ps(0.5f,1.5f,2.5f,3.5f,4.5f,5.5f,6.5f,7.5f,
+                                          8.5f,9.5f,10.5f,11.5f,12.5f,13.5f,14.5f,15.5f);
+      const __m512 c_re = _mm512_set1_ps(p.c_re);
+      const __m512 c_im = _mm512_set1_ps(p.c_im);
+      const __m512 threshold = _mm512_set1_ps(THRESHOLD);
+      const __m512 one = _mm512_set1_ps(1.f);
+
+      int k = 0;
+      for(; k + 16 <= count; k += 16){
+        __m512 column = _mm512_add_ps(_mm512_set1_ps(float(first + k)), lanes);
+        __m512 zx = _mm512_add_ps(_mm512_set1_ps(left),
+                                  _mm512_mul_ps(column, _mm512_set1_ps(dx)));
+        __m512 zy = _mm512_set1_ps(y);
+        __m512 i = _mm512_setzero_ps();
+        for(int n = 0; n < p.iterations; ++n){
+          __m512 xx = _mm512_mul_ps(zx,zx);
+          __m512 yy = _mm512_mul_ps(zy,zy);
+          __mmask16 active = _mm512_cmp_ps_mask(_mm512_add_ps(xx,yy), threshold, _CMP_LT_OQ);
+          if(active == 0) break;
+          i = _mm512_mask_add_ps(i, active, i, one);
+          __m512 nx = _mm512_add_ps(_mm512_sub_ps(xx,yy), c_re);
+          __m512 ny = _mm512_add_ps(_mm512_mul_ps(_mm512_add_ps(zx,zx), zy), c_im);
+          zx = _mm512_mask_mov_ps(zx, active, nx);
+          zy = _mm512_mask_mov_ps(zy, active, ny);
+        }
+        _mm512_storeu_ps(out + k, i);
+      }
+      row_scalar(p, left, dx, y, first + k, count - k, out + k);
+    }
+#endif
+
+    inline void row(isa which, const parameters & p, float left, float dx, float y,
+                    int first, int count, float * out)
+    {
+#ifdef JULIA_X86
+      if(which == avx512) return row_avx512(p, left, dx, y, first, count, out);
+      if(which == avx2)   return row_avx2(p, left, dx, y, first, count, out);
+#endif
+      row_scalar(p, left, dx, y, first, count, out);
+    }
+  }
+
+  /* Iteration count of every pixel, first row is the top of the picture.
+   * Pixel centers are placed like the fragments of a full screen quad. */
+  inline void iterations(const parameters & p, int width, int height,
+                          std::vector<float> & out, isa which = best_isa(),
+                          util::thread_pool & pool = util::thread_pool::global(),
+                          unsigned threads = 0)
+  {
+    out.resize(std::size_t(width) * height);
+    int tiles_x = (width  + detail::TILE_WIDTH  - 1) / detail::TILE_WIDTH;
+    int tiles_y = (height + detail::TILE_HEIGHT - 1) / detail::TILE_HEIGHT;
+    float dx = 2.f * p.half_width / width;
+    float dy = 2.f * p.half_height / height;
+
+    pool.parallel_for(std::size_t(tiles_x) * tiles_y, 1,
+                      [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t tile = begin; tile < end; ++tile){
+        int x0 = int(tile % tiles_x) * detail::TILE_WIDTH;
+        int y0 = int(tile / tiles_x) * detail::TILE_HEIGHT;
+        int w = std::min(detail::TILE_WIDTH,  width  - x0);
+        int h = std::min(detail::TILE_HEIGHT, height - y0);
+        for(int y = y0; y < y0 + h; ++y){
+          float zy = to_float(p.center_im) + p.half_height - (y + 0.5f) * dy;
+          detail::row(which, p, to_float(p.center_re) - p.half_width, dx, zy, x0, w,
+                      &out[std::size_t(y)*width + x0]);
+        }
+      }
+    }, threads);
+  }
+
+  /* Orbit of the center of the view, z_0 = center, z_(n+1) = z_n^2 + c,
+   * computed with double-double numbers and stored as float pairs (re,im).
+   * It stops after `iterations` steps or once it escapes, the escaped value
+   * is the last one stored. There are always at least two values, deep.frag
+   * needs Z_1 to step from Z_0.
+   *
+   * This is the reference of the deep zoom: deep.frag iterates only the
+   * difference between every pixel and this orbit, which is tiny and fits in
+   * a float, while the orbit itself, which needs all the digits, is done once.
+   */
+  inline void reference_orbit(const parameters & p, std::vector<float> & orbit)
+  {
+    const dd c_re = p.c_re, c_im = p.c_im;
+    dd zx = p.center_re, zy = p.center_im;
+    orbit.clear();
+    orbit.reserve(2 * std::size_t(p.iterations + 1));
+    for(int n = 0; ; ++n){
+      orbit.push_back(to_float(zx));
+      orbit.push_back(to_float(zy));
+      dd xx = zx*zx, yy = zy*zy;
+      if(n >= p.iterations or (n > 0 and (xx + yy).hi >= detail::THRESHOLD)) break;
+      dd x = xx - yy;
+      dd y = zx*zy;
+      zx = x + c_re;
+      zy = y + y + c_im;
+    }
+  }
+
+  /* RGBA picture, first row is the top */
+  inline void render(const parameters & p, int width, int height,
+                     std::vector<std::uint8_t> & rgba, isa which = best_isa(),
+                     util::thread_pool & pool = util::thread_pool::global(),
+                     unsigned threads = 0)
+  {
+    std::vector<float> counts;
+    iterations(p, width, height, counts, which, pool, threads);
+    rgba.resize(counts.size() * 4);
+    pool.parallel_for(counts.size(), 4096,
+                      [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t i = begin; i < end; ++i)
+        detail::color(p.phase, counts[i], &rgba[4*i]);
+    }, threads);
+  }
+
+  /* Writes the picture as a binary .ppm, which almost any viewer opens */
+  inline bool write_ppm(const std::string & filename, int width, int height,
+                        const std::vector<std::uint8_t> & rgba)
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out << "P6\n" << width << " " << height << "\n255\n";
+    for(std::size_t i = 0; i < rgba.size(); i += 4)
+      out.write((const char*)&rgba[i], 3);
+    return out.good();
+  }
+}
@@ -1,4 +1,8 @@
 #include "common/shader.hpp"
+#include "common/trace.hpp"
+#include "common/frame_scheduler.hpp"
+#include "julia_cpu.hpp"
+#include "progressive.hpp"
 
 #include <GL/glew.h>
 #include <GL/gl.h>
@@ -6,6 +10,13 @@
 
 #include <vector>
 #include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
 
 /* Indices of things passed to the vertex shader.
  * These are the X in 'layout (location=X)' */
@@ -89,18 +100,57 @@ static void render_model(const model & m)
   }
 }
 
+/* What is shown, shared by the event handlers through the window user pointer.
+ * Every change is a new set of uniforms for the next frame, the shaders stay
+ * the same. */
+struct view_state
+{
+  julia::parameters view;
+  float zoom = 1.f; // 1 is the initial view, 2 shows half the width...
+  int base_iterations = 200; // Iterations at zoom 1, see adaptive_iterations
+  int palette = 0;
+  bool dragging = false;
+  double drag_x = 0, drag_y = 0; // Last cursor position while dragging
+  util::frame_scheduler scheduler; // Nothing moves, we only draw when needed
+};
+
+/* Shows the parameters in the title bar, handy to note down a nice view */
+static void show_parameters(GLFWwindow* window, const view_state & state)
+{
+  std::ostringstream title;
+  title.precision(17);
+  title << "1. Julia  c=(" << state.view.c_re << "," << state.view.c_im << ")"
+        << "  center=(" << state.view.center_re.hi << "," << state.view.center_im.hi << ")"
+        << "  zoom=" << std::setprecision(3) << state.zoom
+        << "  iterations=" << state.view.iterations
+        << (state.view.deep ? "  deep" : "");
+  glfwSetWindowTitle(window, title.str().c_str());
+}
+
+/* Something changed: draw again and tell the user */
+static void changed(GLFWwindow* window, view_state & state)
+{
+  show_parameters(window, state);
+  state.scheduler.request_redraw();
+}
+
+/* Makes the view as high as it has to be so the pixels are square */
+static void fit_aspect(julia::parameters & view, int width, int height)
+{
+  if(width > 0 and height > 0)
+    view.half_height = view.half_width * height / width;
+}
+
 /* This function gets called in the game loop.
- * All the drawing is done here. */
-static void render()
+ * All the drawing is done here.
+ * Returns true while the picture is being refined. */
+static bool render(const julia::parameters & view, int width, int height)
 {
+  TRACE_FUNCTION();
   static model quad = create_quad_model();
-  static GLuint program = shaders::build_program("./identity.vert","./julia.frag");
-
-  glUseProgram(program);
-  glClearColor(1.f,0.1f,0.1f,1.f);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  static progressive_renderer renderer([]{ render_model(quad); });
 
-  render_model(quad);
+  return renderer.draw(view, width, height);
   // The swapping is done in the loop
 }
 
@@ -119,12 +169,229 @@ static void size_callback(GLFWwindow* window,int,int){
    * to cover the whole window */
   glViewport(0, 0, width, height);
 
+  // The picture has to be drawn again with the new size and shape
+  view_state & state = *(view_state*)glfwGetWindowUserPointer(window);
+  fit_aspect(state.view, width, height);
+  changed(window, state);
+}
+
+/* Called when the window has to be painted again, eg: after being uncovered.
+ * The fractal is still in the texture of the progressive_renderer, so this
+ * only colors it again. */
+static void refresh_callback(GLFWwindow* window){
+  view_state & state = *(view_state*)glfwGetWindowUserPointer(window);
+  state.scheduler.request_redraw();
+}
+
+/* The wheel zooms in and out, keeping the point under the cursor in place */
+static void scroll_callback(GLFWwindow* window, double, double dy){
+  view_state & state = *(view_state*)glfwGetWindowUserPointer(window);
+  julia::parameters & v = state.view;
+
+  int width, height;
+  double x, y;
+  glfwGetWindowSize(window, &width, &height);
+  glfwGetCursorPos(window, &x, &y);
+  // Cursor in the range -1,1, like v_quad_position
+  float qx = 2.f * x / width - 1.f;
+  float qy = 1.f - 2.f * y / height;
+
+  float factor = std::pow(1.25f, float(-dy));
+  // Past a zoom of 1e30 the double-double center has no digits left (and
+  // the float zoom would end at inf), and far out there is nothing to see
+  const float min_zoom = 1e-3f, max_zoom = 1e30f;
+  factor = std::min(std::max(factor, state.zoom / max_zoom), state.zoom / min_zoom);
+  if(factor == 1.f) return;
+  // The center moves by the difference of the offsets of the point, added
+  // in double-double so it stays exact at deep zooms
+  v.center_re = v.center_re + double(qx) * v.half_width * (1.0 - factor);
+  v.center_im = v.center_im + double(qy) * v.half_height * (1.0 - factor);
+  v.half_width  *= factor;
+  v.half_height *= factor;
+
+  state.zoom /= factor;
+  v.iterations = julia::adaptive_iterations(state.zoom, state.base_iterations);
+  changed(window, state);
+}
+
+/* Dragging with the left button moves the picture */
+static void button_callback(GLFWwindow* window, int button, int action, int){
+  view_state & state = *(view_state*)glfwGetWindowUserPointer(window);
+  if(button != GLFW_MOUSE_BUTTON_LEFT) return;
+  state.dragging = action == GLFW_PRESS;
+  glfwGetCursorPos(window, &state.drag_x, &state.drag_y);
+}
+
+static void cursor_callback(GLFWwindow* window, double x, double y){
+  view_state & state = *(view_state*)glfwGetWindowUserPointer(window);
+  if(not state.dragging) return;
+  int width, height;
+  glfwGetWindowSize(window, &width, &height);
+  julia::parameters & v = state.view;
+  // The point under the cursor follows it
+  v.center_re = v.center_re - (x - state.drag_x) * 2.0 * v.half_width / width;
+  v.center_im = v.center_im + (y - state.drag_y) * 2.0 * v.half_height / height;
+  state.drag_x = x;
+  state.drag_y = y;
+  changed(window, state);
+}
+
+/* Keys:
+ *   arrows     move c (slower with shift)
+ *   + -        more or less iterations
+ *   P          next palette, does not compute the fractal again
+ *   D          deep zoom (perturbation, see deep.frag) on and off
+ *   R          back to the initial view
+ */
+static void key_callback(GLFWwindow* window, int key, int, int action, int mods){
+  view_state & state = *(view_state*)glfwGetWindowUserPointer(window);
+  if(action == GLFW_RELEASE) return;
+  julia::parameters & v = state.view;
+  float step = (mods & GLFW_MOD_SHIFT) ? 0.0005f : 0.005f;
+  switch(key){
+  case GLFW_KEY_LEFT:  v.c_re -= step; break;
+  case GLFW_KEY_RIGHT: v.c_re += step; break;
+  case GLFW_KEY_DOWN:  v.c_im -= step; break;
+  case GLFW_KEY_UP:    v.c_im += step; break;
+  case GLFW_KEY_KP_ADD:
+  case GLFW_KEY_EQUAL:
+    state.base_iterations = std::min(state.base_iterations * 2, 20000);
+    v.iterations = julia::adaptive_iterations(state.zoom, state.base_iterations);
+    break;
+  case GLFW_KEY_KP_SUBTRACT:
+  case GLFW_KEY_MINUS:
+    state.base_iterations = std::max(state.base_iterations / 2, 25);
+    v.iterations = julia::adaptive_iterations(state.zoom, state.base_iterations);
+    break;
+  case GLFW_KEY_P:{
+    if(action != GLFW_PRESS) return;
+    static const float palettes[][3] = {
+      {0.4f, 1.f, 2.5f}, {2.f, 1.f, 0.f}, {0.f, 2.f, 4.f}, {3.f, 3.5f, 4.f} };
+    state.palette = (state.palette + 1) % 4;
+    std::copy(palettes[state.palette], palettes[state.palette]+3, v.phase);
+    break;
+  }
+  case GLFW_KEY_D:
+    if(action != GLFW_PRESS) return;
+    v.deep = not v.deep;
+    break;
+  case GLFW_KEY_R:{
+    if(action != GLFW_PRESS) return;
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    julia::parameters initial;
+    initial.deep = v.deep;
+    std::copy(v.phase, v.phase+3, initial.phase);
+    v = initial;
+    fit_aspect(v, width, height);
+    state.zoom = 1.f;
+    state.base_iterations = 200;
+    break;
+  }
+  default:
+    return;
+  }
+  changed(window, state);
 }
 
 
+/* Draws the picture with the CPU and writes it to a file. No window needed. */
+static int cpu_render(const std::string & filename, int width, int height)
+{
+  std::vector<std::uint8_t> rgba;
+  julia::render(julia::parameters(), width, height, rgba);
+  if(!julia::write_ppm(filename, width, height, rgba)){
+    std::cerr << "Cannot write '" << filename << "'" << std::endl;
+    return 1;
+  }
+  std::cout << "Wrote '" << filename << "' (" << julia::isa_name(julia::best_isa())
+            << ")" << std::endl;
+  return 0;
+}
 
-int main()
+/* Prints the speed of the CPU version for every instruction set available
+ * and an increasing number of threads. */
+static int cpu_benchmark(int width, int height)
+{
+  util::thread_pool & pool = util::thread_pool::global();
+  std::vector<std::uint8_t> rgba;
+  std::cout << width << "x" << height << ", Mpixel/s (best of 3)" << std::endl;
+  for(julia::isa isa : {julia::scalar, julia::avx2, julia::avx512}){
+    if(!julia::supported(isa)) continue;
+    std::cout << julia::isa_name(isa) << ":";
+    for(unsigned threads = 1; ; threads = std::min(2*threads, pool.size())){
+      double best = 1e30;
+      for(int run = 0; run < 3; ++run){
+        auto start = std::chrono::steady_clock::now();
+        julia::render(julia::parameters(), width, height, rgba, isa, pool, threads);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+      }
+      std::cout << "  " << threads << "t " << width*height / best / 1e6;
+      if(threads == pool.size()) break;
+    }
+    std::cout << std::endl;
+  }
+  return 0;
+}
+
+/* Compares the frame drawn by the GPU with the CPU version.
+ * Call it after render(), once the picture is complete, before swapping. */
+static void validate(GLFWwindow* window, const julia::parameters & view)
+{
+  int width, height;
+  glfwGetFramebufferSize(window, &width, &height);
+  std::vector<std::uint8_t> gpu(std::size_t(width)*height*4);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadBuffer(GL_BACK);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, gpu.data());
+
+  std::vector<std::uint8_t> cpu;
+  julia::render(view, width, height, cpu);
+
+  // OpenGL gives the rows from the bottom, the CPU version from the top.
+  // A few pixels at the border of the set may escape one iteration earlier
+  // or later due to rounding, so we report how many differ, not just the max.
+  int max_difference = 0;
+  std::size_t different = 0;
+  for(int y = 0; y < height; ++y)
+    for(int x = 0; x < width*4; ++x){
+      int a = gpu[std::size_t(height-1-y)*width*4 + x];
+      int b = cpu[std::size_t(y)*width*4 + x];
+      int d = std::abs(a-b);
+      max_difference = std::max(max_difference, d);
+      if(d > 2) ++different;
+    }
+  std::cout << "GPU vs CPU: max channel difference " << max_difference
+            << ", " << different << " of " << gpu.size()
+            << " channels differ by more than 2" << std::endl;
+}
+
+
+/* Usage:
+ *   julia                              opens the window
+ *   julia --cpu file.ppm [w h]         draws with the CPU, no window
+ *   julia --bench [w h]                speed of the CPU version
+ *   julia --validate                   compares the GPU and CPU pictures
+ */
+int main(int argc, char ** argv)
 {  
+  std::vector<std::string> args(argv+1, argv+argc);
+  bool validating = not args.empty() and args[0] == "--validate";
+  if(not args.empty() and (args[0] == "--cpu" or args[0] == "--bench")){
+    bool bench = args[0] == "--bench";
+    std::size_t size_arg = bench ? 1 : 2;
+    int width  = args.size() > size_arg   ? std::atoi(args[size_arg].c_str())   : 1920;
+    int height = args.size() > size_arg+1 ? std::atoi(args[size_arg+1].c_str()) : 1080;
+    if(bench) return cpu_benchmark(width, height);
+    if(args.size() < 2){
+      std::cerr << "Usage: julia --cpu file.ppm [width height]" << std::endl;
+      return 1;
+    }
+    return cpu_render(args[1], width, height);
+  }
+
+  view_state state;
   if (!glfwInit())
     return 1;
   
@@ -152,14 +419,40 @@ int main()
 
   glDisable(GL_CULL_FACE);
     
+  glfwSetWindowUserPointer(window, &state);
   glfwSetWindowSizeCallback(window, size_callback);
+  glfwSetWindowRefreshCallback(window, refresh_callback);
+  glfwSetScrollCallback(window, scroll_callback);
+  glfwSetMouseButtonCallback(window, button_callback);
+  glfwSetCursorPosCallback(window, cursor_callback);
+  glfwSetKeyCallback(window, key_callback);
   glViewport(0,0,INITIAL_WIDTH,INITIAL_HEIGHT);
+  fit_aspect(state.view, INITIAL_WIDTH, INITIAL_HEIGHT);
+  show_parameters(window, state);
 
+  trace::thread_name("main");
   while(not glfwWindowShouldClose(window)){
-    glfwWaitEvents();
-    render();
-    glfwSwapBuffers(window);
+    if(not state.scheduler.wait()) continue;
+    TRACE_SCOPE("frame");
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    bool refining = render(state.view, width, height);
+    if(refining)
+      state.scheduler.request_redraw(); // Go on with the next step
+    else if(validating and state.view.deep){
+      std::cout << "The CPU version has no deep zoom, nothing to compare" << std::endl;
+      validating = false;
+    }else if(validating){
+      validate(window, state.view);
+      validating = false;
+    }
+    {
+      TRACE_SCOPE("swap");
+      glfwSwapBuffers(window);
+    }
+    state.scheduler.presented();
   }
+  trace::dump("julia_trace.json");
   return 0;
 }
 
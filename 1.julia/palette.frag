@@ -0,0 +1,31 @@
+#version 330
+
+// Same as in julia.frag, in the range -1,1
+in vec2 v_quad_position;
+
+// Iterations computed by julia.frag
+uniform sampler2D u_iterations;
+// Part of the texture that holds the picture, it is drawn at lower
+// resolutions first (see progressive.hpp)
+uniform vec2 u_texture_scale;
+// Phase of the cosines that make each color channel
+uniform vec3 u_phase;
+
+out vec4 color;
+
+void main()
+{
+  vec2 uv = (v_quad_position * 0.5 + 0.5) * u_texture_scale;
+  // Do not blend with the texels outside the picture at the border
+  uv = min(uv, u_texture_scale - 0.5 / vec2(textureSize(u_iterations, 0)));
+  float i = texture(u_iterations, uv).r;
+
+  // Play around with the number of iterations until a nice coloring appears
+  i = pow(i,0.5);
+  // I have no good idea of how to set the color to this
+  float r = 0.5*(1+cos(i+u_phase.r)); // make sure the result range is [0,1]
+  float g = 0.5*(1+cos(i+u_phase.g));
+  float b = 0.5*(1+cos(i+u_phase.b));
+
+  color = vec4(r,g,b*b,1.0);
+}
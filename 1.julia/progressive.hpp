@@ -0,0 +1,276 @@
+#pragma once
+
+#include "common/shader.hpp"
+#include "common/trace.hpp"
+#include "julia_cpu.hpp" // julia::parameters
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+/* Draws the fractal in two passes:
+ *
+ * 1. julia.frag writes the number of iterations of every pixel to a float
+ *    texture.
+ * 2. palette.frag reads the texture and writes the colors to the screen.
+ *
+ * The first pass is the expensive one, and it is only done again when the
+ * view changes. If only the palette changes, or the window has to be painted
+ * again, the texture is reused.
+ *
+ * When the view changes the picture is computed at 1/8 of the resolution
+ * first, then 1/4, 1/2 and finally at full resolution, one step per frame,
+ * so moving around stays smooth. A step that is too expensive for a single
+ * frame (deep zooms need many iterations) is split in bands of rows spread
+ * over several frames. The amount of work per frame adapts to keep the frame
+ * time around FRAME_TARGET.
+ *
+ * The level being computed goes to one texture while the last complete level
+ * is shown from another, and they are swapped when the level is done.
+ *
+ * With parameters::deep the first pass is deep.frag instead, which needs the
+ * reference orbit of the center in a texture. It is computed on the CPU when
+ * the view changes, before the first level.
+ */
+class progressive_renderer
+{
+public:
+  static const int LEVELS = 4; // 1/8, 1/4, 1/2 and full resolution
+
+  /* draw_quad draws a quad covering the viewport, with the positions in the
+   * attribute 0 (see identity.vert) */
+  progressive_renderer(std::function<void()> draw_quad) :
+    _draw_quad(draw_quad)
+  {
+    _iteration_program = shaders::build_program("./identity.vert","./julia.frag");
+    _u_center = glGetUniformLocation(_iteration_program, "u_center");
+    _u_half_size = glGetUniformLocation(_iteration_program, "u_half_size");
+    _u_iterations = glGetUniformLocation(_iteration_program, "u_iterations");
+    _u_c = glGetUniformLocation(_iteration_program, "u_c");
+
+    _deep_program = shaders::build_program("./identity.vert","./deep.frag");
+    _u_deep_half_size = glGetUniformLocation(_deep_program, "u_half_size");
+    _u_deep_iterations = glGetUniformLocation(_deep_program, "u_iterations");
+    _u_orbit = glGetUniformLocation(_deep_program, "u_orbit");
+    _u_orbit_length = glGetUniformLocation(_deep_program, "u_orbit_length");
+
+    _palette_program = shaders::build_program("./identity.vert","./palette.frag");
+    _u_texture = glGetUniformLocation(_palette_program, "u_iterations");
+    _u_texture_scale = glGetUniformLocation(_palette_program, "u_texture_scale");
+    _u_phase = glGetUniformLocation(_palette_program, "u_phase");
+
+    glGenFramebuffers(1, &_framebuffer);
+    glGenTextures(2, _textures);
+    glGenTextures(1, &_orbit_texture);
+  }
+
+  progressive_renderer(const progressive_renderer &) = delete;
+  progressive_renderer & operator=(const progressive_renderer &) = delete;
+
+  ~progressive_renderer()
+  {
+    glDeleteFramebuffers(1, &_framebuffer);
+    glDeleteTextures(2, _textures);
+    glDeleteTextures(1, &_orbit_texture);
+    glDeleteProgram(_iteration_program);
+    glDeleteProgram(_deep_program);
+    glDeleteProgram(_palette_program);
+  }
+
+  /* Does one step of the refinement (if needed) and draws the picture to the
+   * current framebuffer. Returns true if the picture is not finished, that
+   * is, the caller should draw another frame. */
+  bool draw(const julia::parameters & p, int width, int height)
+  {
+    TRACE_SCOPE("progressive_renderer::draw");
+    if(width != _width or height != _height)
+      resize(width, height);
+    if(not julia::same_iterations(p, _drawn)){
+      _drawn = p;
+      _level = LEVELS - 1;
+      _row = 0;
+      _refining = false;
+      if(p.deep)
+        upload_orbit();
+    }
+
+    if(not settled())
+      refine();
+
+    present(p);
+    return not settled();
+  }
+
+  bool settled() const { return _level < 0; }
+
+  /* Bands computed for the last picture, to see how the budget behaves */
+  int bands() const { return _bands; }
+
+private:
+  static constexpr double FRAME_TARGET = 1.0/60.0; // seconds
+  enum { ORBIT_ROW = 1024 }; // Same as in deep.frag
+
+  int level_width(int level) const { return std::max(1, (_width + (1 << level) - 1) >> level); }
+  int level_height(int level) const { return std::max(1, (_height + (1 << level) - 1) >> level); }
+
+  void resize(int width, int height)
+  {
+    _width = width;
+    _height = height;
+    for(GLuint texture : _textures){
+      glBindTexture(GL_TEXTURE_2D, texture);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, nullptr);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    _shown_level = -1; // Nothing valid to show
+    _drawn.iterations = -1; // Forces a restart
+  }
+
+  /* Computes the next band of rows of the current level */
+  void refine()
+  {
+    TRACE_SCOPE("progressive_renderer::refine");
+    adapt_budget();
+
+    int w = level_width(_level), h = level_height(_level);
+    // Rows we can afford this frame
+    double pixels = _budget / std::max(1, _drawn.iterations);
+    int rows = std::max(1, std::min(h - _row, int(pixels / w)));
+    if(_row == 0) _bands = 0;
+    ++_bands;
+
+    GLuint target = _textures[1 - _shown];
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target, 0);
+    glViewport(0, 0, w, h);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(0, _row, w, rows);
+
+    if(_drawn.deep){
+      glUseProgram(_deep_program);
+      glUniform2f(_u_deep_half_size, _drawn.half_width, _drawn.half_height);
+      glUniform1f(_u_deep_iterations, float(_drawn.iterations));
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, _orbit_texture);
+      glUniform1i(_u_orbit, 0);
+      glUniform1i(_u_orbit_length, _orbit_length);
+    }else{
+      glUseProgram(_iteration_program);
+      glUniform2f(_u_center, julia::to_float(_drawn.center_re),
+                  julia::to_float(_drawn.center_im));
+      glUniform2f(_u_half_size, _drawn.half_width, _drawn.half_height);
+      glUniform1f(_u_iterations, float(_drawn.iterations));
+      glUniform2f(_u_c, _drawn.c_re, _drawn.c_im);
+    }
+    _draw_quad();
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, _width, _height);
+
+    _row += rows;
+    if(_row >= h){
+      // The level is complete, show it and go on with the next one
+      _shown = 1 - _shown;
+      _shown_level = _level;
+      --_level;
+      _row = 0;
+    }
+  }
+
+  /* Computes the reference orbit of the view and puts it in _orbit_texture,
+   * ORBIT_ROW steps per row (a texture that wide is allowed everywhere) */
+  void upload_orbit()
+  {
+    TRACE_SCOPE("progressive_renderer::upload_orbit");
+    julia::reference_orbit(_drawn, _orbit);
+    _orbit_length = int(_orbit.size() / 2);
+    int rows = (_orbit_length + ORBIT_ROW - 1) / ORBIT_ROW;
+    _orbit.resize(std::size_t(rows) * ORBIT_ROW * 2, 0.f);
+
+    glBindTexture(GL_TEXTURE_2D, _orbit_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, ORBIT_ROW, rows, 0, GL_RG, GL_FLOAT, _orbit.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  /* Colors the last complete level on the screen */
+  void present(const julia::parameters & p)
+  {
+    TRACE_SCOPE("progressive_renderer::present");
+    if(_shown_level < 0){
+      glClearColor(0.f,0.f,0.f,1.f);
+      glClear(GL_COLOR_BUFFER_BIT);
+      return;
+    }
+    glUseProgram(_palette_program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, _textures[_shown]);
+    glUniform1i(_u_texture, 0);
+    glUniform2f(_u_texture_scale,
+                float(level_width(_shown_level)) / _width,
+                float(level_height(_shown_level)) / _height);
+    glUniform3f(_u_phase, p.phase[0], p.phase[1], p.phase[2]);
+    _draw_quad();
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  /* Grows or shrinks the work per frame looking at the time between frames.
+   * The swap blocks when the GPU falls behind, so a long interval means we
+   * asked for too much. */
+  void adapt_budget()
+  {
+    const double MIN_BUDGET = 1 << 20; // pixel-iterations per frame
+    const double MAX_BUDGET = 1e10;
+    auto now = std::chrono::steady_clock::now();
+    if(_refining){
+      double interval = std::chrono::duration<double>(now - _last_refine).count();
+      if(interval > 1.5 * FRAME_TARGET)
+        _budget = std::max(MIN_BUDGET, _budget * 0.5);
+      else if(interval < 1.1 * FRAME_TARGET)
+        _budget = std::min(MAX_BUDGET, _budget * 1.25);
+    }
+    _refining = true;
+    _last_refine = now;
+  }
+
+  std::function<void()> _draw_quad;
+
+  GLuint _iteration_program = 0;
+  GLint _u_center = -1, _u_half_size = -1, _u_iterations = -1, _u_c = -1;
+  GLuint _deep_program = 0;
+  GLint _u_deep_half_size = -1, _u_deep_iterations = -1;
+  GLint _u_orbit = -1, _u_orbit_length = -1;
+  GLuint _palette_program = 0;
+  GLint _u_texture = -1, _u_texture_scale = -1, _u_phase = -1;
+
+  GLuint _framebuffer = 0;
+  GLuint _textures[2] = {0, 0};
+  int _shown = 0;        // Texture with the last complete level
+  int _shown_level = -1; // Its level, -1 if none
+
+  GLuint _orbit_texture = 0;
+  std::vector<float> _orbit; // re,im pairs
+  int _orbit_length = 0;
+
+  int _width = 0, _height = 0;
+  julia::parameters _drawn; // View being computed
+  int _level = -1;          // Level being computed, -1 when finished
+  int _row = 0;             // First row of the next band
+  int _bands = 0;
+
+  double _budget = 1 << 24;
+  bool _refining = false;
+  std::chrono::steady_clock::time_point _last_refine;
+};
@@ -1,6 +1,7 @@
 #include "common/shapes.hpp"
 #include "common/shader.hpp"
 #include "common/trackball.hpp"
+#include "common/input.hpp"
 
 #include <GL/glew.h>
 #include <GL/gl.h>
@@ -51,6 +52,32 @@ struct scene_state
 
   bool displacing;
   glm::vec2 mouse_pos;
+
+  // The cursor events are only stored by the callback, and applied once per
+  // frame by apply_input()
+  util::cursor_accumulator cursor;
+  util::input_latency latency;
+
+  /* Moves the trackball and the camera to where the cursor is now */
+  void apply_input()
+  {
+    if(not cursor.moved()) return;
+    // The events of a frame can come back to where the cursor was
+    if(cursor.delta() == glm::vec2(0.f)){
+      cursor.clear();
+      return;
+    }
+    if(trackball.tracking())
+      trackball.move(cursor.position());
+    if(displacing){
+      float translation_speed = 0.002;
+      glm::vec2 delta = cursor.delta();
+      glm::vec3 up =  glm::vec3(0,1,0);
+      glm::vec3 right =  glm::vec3(-1,0,0);
+      camera_position += translation_speed * (up*delta.y + right*delta.x);
+    }
+    cursor.clear();
+  }
   
   void update_projection()
   {
@@ -178,6 +205,8 @@ static void mouse_button_callback(GLFWwindow* window,
                                   int button, int action, int mods)
 {
   scene_state & state = *(scene_state*)glfwGetWindowUserPointer(window);
+  // The moves before the click go with the buttons of before
+  state.apply_input();
   
   if (button == GLFW_MOUSE_BUTTON_LEFT){
     if(action == GLFW_PRESS)
@@ -193,19 +222,13 @@ static void mouse_button_callback(GLFWwindow* window,
 
 static void mouse_move_callback(GLFWwindow* window,
                                 double x, double y){
-  float translation_speed = 0.002;
   glm::vec2 mouse_pos(x,y);
   scene_state & state = *(scene_state*)glfwGetWindowUserPointer(window);
   
-  if(state.trackball.tracking()){
-    state.trackball.move(glm::vec2(x,y));
-  }
-  if(state.displacing){
-    glm::vec2 delta = mouse_pos - state.mouse_pos;
-    glm::vec3 up =  glm::vec3(0,1,0);
-    glm::vec3 right =  glm::vec3(-1,0,0);
-    state.camera_position += translation_speed * (up*delta.y + right*delta.x);
-  }
+  // Only stored, a fast mouse sends several of these per frame
+  state.cursor.move(mouse_pos);
+  if(state.trackball.tracking() or state.displacing)
+    state.latency.event();
   state.mouse_pos = mouse_pos;
 }
 
@@ -215,6 +238,7 @@ static void scroll_callback(GLFWwindow* window,double dx, double dy){
 
   state.fov = glm::clamp(state.fov+step*dy, 0.001, Pi - 0.1);
   state.update_projection();
+  state.latency.event();
 }
 
 
@@ -274,9 +298,14 @@ int main()
   
   while(not glfwWindowShouldClose(window)){
     glfwWaitEvents();
+    state.latency.frame();
+    state.apply_input();
     render(state.projection,state.view());
     glfwSwapBuffers(window);
+    state.latency.presented();
   }
+  state.latency.report(std::cout);
+  std::cout << state.cursor.events_per_update() << " cursor events per trackball update" << std::endl;
   return 0;
 }
 
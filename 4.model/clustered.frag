@@ -0,0 +1,72 @@
+#version 330
+
+/* shade.frag with many point lights instead of one, and the camera where it
+ * really is.
+ *
+ * The lights come from light_clusters.hpp: the frustum is cut in a grid of
+ * clusters and every cluster has the list of the lights that can reach it.
+ * A fragment finds its cluster from its pixel (the tile) and its distance to
+ * the camera (the slice), and only adds up the lights of that list.
+ *
+ * The position in view space comes from gl_FragCoord and the inverse of the
+ * projection, so shade.vert is used as it is.
+ */
+
+// This comes from the vertex shader:
+in vec3 v_normal;
+
+// Two texels per light: position in view space and radius, and color
+uniform samplerBuffer u_lights;
+// First index in u_light_indices and number of lights of each cluster
+uniform usamplerBuffer u_clusters;
+uniform usamplerBuffer u_light_indices;
+// Tiles across, tiles down and depth slices
+uniform ivec3 u_grid;
+// The slice of a distance d is log(d)*u_slicing.x + u_slicing.y
+uniform vec2 u_slicing;
+uniform vec2 u_viewport;
+uniform mat4 u_inverse_projection;
+
+out vec4 frag_color;
+
+void main()
+{
+  vec3 object_color = vec3(0.4,0.4,0.9);
+  float specular_power = 64.0;
+
+  vec3 ndc = vec3(gl_FragCoord.xy / u_viewport, gl_FragCoord.z) * 2.0 - 1.0;
+  vec4 view_pos = u_inverse_projection * vec4(ndc, 1.0);
+  vec3 position = view_pos.xyz / view_pos.w;
+  vec3 normal = normalize(v_normal);
+  vec3 to_camera = normalize(-position);
+
+  ivec2 tile = clamp(ivec2(gl_FragCoord.xy / u_viewport * vec2(u_grid.xy)), ivec2(0), u_grid.xy - 1);
+  int slice = clamp(int(floor(log(-position.z) * u_slicing.x + u_slicing.y)), 0, u_grid.z - 1);
+  int cluster = (slice * u_grid.y + tile.y) * u_grid.x + tile.x;
+  uvec2 range = texelFetch(u_clusters, cluster).xy;
+
+  // This term simulates scattered light
+  vec3 linear_color = 0.02 * object_color;
+  for(uint i = range.x; i < range.x + range.y; ++i){
+    int light = int(texelFetch(u_light_indices, int(i)).x);
+    vec4 sphere = texelFetch(u_lights, 2*light);
+    vec3 light_color = texelFetch(u_lights, 2*light + 1).rgb;
+    vec3 to_light = sphere.xyz - position;
+    float distance = length(to_light);
+    if(distance >= sphere.w) continue;
+
+    // Down to 0 at the radius, what is further is not in the lists
+    float falloff = 1.0 - distance / sphere.w;
+    falloff *= falloff;
+    vec3 light_direction = to_light / distance;
+    vec3 halfway_vector = normalize(light_direction + to_camera);
+    vec3 diffuse_color = 0.9 * object_color * light_color * max(dot(normal, light_direction), 0);
+    vec3 specular_color = light_color * pow(max(dot(normal, halfway_vector), 0), specular_power);
+    linear_color += falloff * (diffuse_color + specular_color);
+  }
+
+  // Gamma correction, see shade.frag
+  vec3 corrected_color = pow(linear_color, vec3(1.0/2.2));
+
+  frag_color = vec4(clamp(corrected_color,0,1),1);
+}
@@ -0,0 +1,7 @@
+#version 330
+
+/* Nothing, the depth prepass only writes the depth */
+
+void main()
+{
+}
@@ -0,0 +1,16 @@
+#version 330
+
+/* The depth prepass of shade.vert: only the position, computed exactly the
+ * same way. invariant makes the compiler do it the same way too, so the
+ * depth of the color pass is equal to this one bit for bit (GL_EQUAL). */
+
+layout (location = 0) in vec3 a_position;
+
+uniform mat4 u_mvp;
+
+invariant gl_Position;
+
+void main()
+{
+  gl_Position = u_mvp*vec4(a_position,1.f);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "gpu_timer.hpp"
+#include "common/shader.hpp"
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+
+/* Hierarchical depth (Hi-Z) of a frame, for occlusion culling.
+ *
+ * Level 0 is half the size of the depth buffer and every level is half the
+ * one before, down to 1x1. Each texel has the farthest depth of the pixels
+ * it covers (hiz.comp), so something whose nearest depth is farther than a
+ * texel over all of its screen rectangle was hidden by what was drawn. A
+ * few texels of the right level are enough to know it, whatever its size.
+ *
+ * The pyramid keeps the view-projection of its frame: the next frame tests
+ * its bounding boxes as they were seen then (see cull.comp). What was
+ * hidden in the previous frame is drawn one frame late when the camera
+ * moves, the price of not drawing twice.
+ *
+ * Needs OpenGL 4.3.
+ */
+class depth_pyramid
+{
+public:
+  depth_pyramid() : _program(shaders::build_compute_program("./hiz.comp"))
+  {
+    _u_source_level = glGetUniformLocation(_program, "u_source_level");
+  }
+
+  depth_pyramid(const depth_pyramid &) = delete;
+  depth_pyramid & operator=(const depth_pyramid &) = delete;
+
+  ~depth_pyramid()
+  {
+    if(_texture) glDeleteTextures(1, &_texture);
+    glDeleteProgram(_program);
+  }
+
+  /* Makes the pyramid of a depth texture of width x height, drawn with
+   * view_projection */
+  void build(GLuint depth_texture, int width, int height, const glm::mat4 & view_projection)
+  {
+    allocate(width, height);
+    _view_projection = view_projection;
+    _timer.begin();
+    glUseProgram(_program);
+    glActiveTexture(GL_TEXTURE0);
+    for(int level = 0; level < _levels; ++level){
+      glBindTexture(GL_TEXTURE_2D, level == 0 ? depth_texture : _texture);
+      glUniform1i(_u_source_level, level == 0 ? 0 : level - 1);
+      glBindImageTexture(0, _texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+      int w = std::max(_width / 2 >> level, 1), h = std::max(_height / 2 >> level, 1);
+      glDispatchCompute(GLuint(w + 7) / 8, GLuint(h + 7) / 8, 1);
+      // The next level reads this one
+      glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    _timer.end();
+    _ready = true;
+  }
+
+  /* Forgets the last frame, eg: when the scene changed */
+  void reset() { _ready = false; }
+
+  bool ready() const { return _ready; }
+  GLuint texture() const { return _texture; }
+  int levels() const { return _levels; }
+  /* Of the depth buffer, level 0 is half of it */
+  int width() const { return _width; }
+  int height() const { return _height; }
+  const glm::mat4 & view_projection() const { return _view_projection; }
+
+  /* GPU time of the last build(), waits for it */
+  double gpu_seconds() const { return _timer.seconds(); }
+
+private:
+  void allocate(int width, int height)
+  {
+    if(_texture and width == _width and height == _height) return;
+    if(_texture) glDeleteTextures(1, &_texture);
+    _width = width;
+    _height = height;
+    int w = std::max(width / 2, 1), h = std::max(height / 2, 1);
+    _levels = 1;
+    while((std::max(w, h) >> _levels) > 0) ++_levels;
+
+    glGenTextures(1, &_texture);
+    glBindTexture(GL_TEXTURE_2D, _texture);
+    glTexStorage2D(GL_TEXTURE_2D, _levels, GL_R32F, w, h);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  GLuint _program;
+  GLint _u_source_level;
+  GLuint _texture = 0;
+  int _width = 0, _height = 0, _levels = 0;
+  glm::mat4 _view_projection;
+  bool _ready = false;
+  gpu_timer _timer;
+};
@@ -0,0 +1,390 @@
+#pragma once
+
+#include "model.hpp"
+#include "common/obj_stream.hpp"
+#include "common/trace.hpp"
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Draws a mesh that is too big for the GPU memory, from a binary cache made
+ * with --convert, which splits the mesh in chunks that each cover a small
+ * part of the space (obj::spatial_splitter).
+ *
+ * The GPU memory is a fixed number of pages: models with room for the
+ * biggest chunk, as many as fit in the budget. Every frame:
+ *
+ * 1. The chunks inside the view frustum are wanted, the nearest first. So are
+ *    the ones that will be inside it in prefetch_frames frames if the camera
+ *    keeps moving as it did in the last frame (the change of the matrix is
+ *    applied again, so it follows the trackball as well as the zoom).
+ * 2. Wanted chunks that are not in a page are read from the file by a thread,
+ *    a few at a time.
+ * 3. Chunks that have been read go to a free page, or to the least recently
+ *    used one, at most upload_per_frame bytes per frame. A page used in this
+ *    frame is never taken.
+ *
+ * Only the chunks in pages are drawn, so a part of the mesh is missing until
+ * it arrives, instead of the frame waiting for it.
+ */
+class geometry_pager
+{
+public:
+  struct options
+  {
+    std::size_t budget = std::size_t(256) << 20;    // GPU memory for the pages, bytes
+    std::size_t upload_per_frame = std::size_t(8) << 20; // bytes
+    int prefetch_frames = 15;
+    std::size_t max_reading = 8; // Chunks asked to the reading thread at a time
+  };
+
+  struct statistics
+  {
+    std::size_t frames = 0;
+    std::size_t visible = 0;  // Chunks in the frustum, added over the frames
+    std::size_t hits = 0;     // Of those, the ones that were in a page
+    std::size_t uploads = 0;  // Chunks copied to a page
+    std::size_t uploaded_bytes = 0;
+    std::size_t evictions = 0;
+    std::size_t dropped = 0;  // Read but not wanted any more, or no page left
+    double seconds = 0.0;     // Since the first frame
+
+    double hit_rate() const { return visible ? double(hits) / visible : 1.0; }
+    double upload_bandwidth() const { return seconds > 0.0 ? uploaded_bytes / seconds : 0.0; }
+  };
+
+  geometry_pager(const std::string & filename) : geometry_pager(filename, options()) {}
+
+  geometry_pager(const std::string & filename, const options & o) :
+    _options(o), _index(obj::read_cache_index(filename)), _filename(filename)
+  {
+    std::size_t vertices = 1, indices = 3;
+    for(const obj::cache_entry & e : _index.chunks){
+      vertices = std::max<std::size_t>(vertices, e.vertices);
+      indices = std::max<std::size_t>(indices, e.indices);
+    }
+    _page_bytes = 2 * sizeof(glm::vec3) * vertices + sizeof(std::uint32_t) * indices;
+    // With less than a page nothing can be drawn, and one page would not fit
+    if(_options.budget < _page_bytes and not _index.chunks.empty())
+      throw std::runtime_error("the budget is smaller than a page of " +
+                               std::to_string((_page_bytes + (1 << 20) - 1) >> 20) + " MB");
+    std::size_t pages = _options.budget / _page_bytes;
+    pages = std::min(pages, _index.chunks.size());
+    for(std::size_t i = 0; i < pages; ++i){
+      _pages.emplace_back();
+      _pages.back().m = allocate_model(int(vertices), int(indices));
+    }
+    _chunks.resize(_index.chunks.size());
+    _reader = std::thread([this]{ read(); });
+  }
+
+  geometry_pager(const geometry_pager &) = delete;
+  geometry_pager & operator=(const geometry_pager &) = delete;
+
+  ~geometry_pager()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_all();
+    _reader.join();
+    for(page & p : _pages) release_model(p.m);
+  }
+
+  const obj::bounding_volume & bounds() const { return _index.bounds; }
+  std::size_t pages() const { return _pages.size(); }
+  std::size_t page_bytes() const { return _page_bytes; }
+  std::size_t chunks() const { return _chunks.size(); }
+  const statistics & stats() const { return _stats; }
+
+  /* mvp is what the mesh will be drawn with. Returns true while some chunk
+   * in view is not in a page yet, so the caller should draw another frame. */
+  bool update(const glm::mat4 & mvp)
+  {
+    TRACE_SCOPE("geometry_pager::update");
+    auto now = std::chrono::steady_clock::now();
+    if(_stats.frames == 0) _start = now;
+    ++_frame;
+    ++_stats.frames;
+    _stats.seconds = std::chrono::duration<double>(now - _start).count();
+
+    // Where the camera will be if it keeps moving
+    glm::mat4 predicted = mvp;
+    if(_has_previous){
+      glm::mat4 step = mvp * glm::inverse(_previous);
+      for(int i = 0; i < _options.prefetch_frames; ++i)
+        predicted = step * predicted;
+    }
+    _previous = mvp;
+    _has_previous = true;
+
+    // The center of the near plane, for the distances
+    glm::vec4 eye = glm::inverse(mvp) * glm::vec4(0.f, 0.f, -1.f, 1.f);
+    glm::vec3 camera = glm::vec3(eye.x, eye.y, eye.z) / eye.w;
+
+    choose(mvp, predicted, camera);
+    request();
+    bool waiting = place();
+    return waiting;
+  }
+
+  /* Draws the chunks in pages that are in view. The program and its
+   * uniforms are up to the caller. */
+  void draw() const
+  {
+    TRACE_SCOPE("geometry_pager::draw");
+    for(const page & p : _pages)
+      if(p.chunk != NONE and _chunks[p.chunk].visible == _frame)
+        render_model(p.m);
+  }
+
+private:
+  static const std::size_t NONE = std::size_t(-1);
+
+  struct chunk_state
+  {
+    std::size_t page = NONE;
+    std::size_t visible = 0; // Last frame it was in view
+    std::size_t wanted = 0;  // Last frame it was wanted (visible or prefetched)
+    bool reading = false;
+    bool broken = false;     // Could not be read
+  };
+
+  struct page
+  {
+    model m;
+    std::size_t chunk = NONE;
+    std::size_t used = 0; // Last frame it was wanted
+  };
+
+  struct arrival
+  {
+    std::size_t index;
+    obj::chunk data;
+  };
+
+  /* Is the box, seen through mvp, at least partly in view? */
+  static bool in_view(const glm::mat4 & mvp, const obj::cache_entry & e)
+  {
+    glm::vec4 corners[8];
+    for(int i = 0; i < 8; ++i)
+      corners[i] = mvp * glm::vec4(i & 1 ? e.box_max.x : e.box_min.x,
+                                   i & 2 ? e.box_max.y : e.box_min.y,
+                                   i & 4 ? e.box_max.z : e.box_min.z, 1.f);
+    for(int axis = 0; axis < 3; ++axis){
+      bool all_below = true, all_above = true;
+      for(const glm::vec4 & c : corners){
+        all_below = all_below and c[axis] < -c.w;
+        all_above = all_above and c[axis] > c.w;
+      }
+      if(all_below or all_above) return false;
+    }
+    return true;
+  }
+
+  static float distance(const glm::vec3 & p, const obj::cache_entry & e)
+  {
+    return glm::length(glm::max(glm::max(e.box_min - p, p - e.box_max), glm::vec3(0.f)));
+  }
+
+  /* Fills _wanted: the chunks in view, nearest first, then the ones that
+   * will be, up to the number of pages */
+  void choose(const glm::mat4 & mvp, const glm::mat4 & predicted, const glm::vec3 & camera)
+  {
+    std::vector<std::pair<float, std::size_t>> now, soon;
+    for(std::size_t i = 0; i < _chunks.size(); ++i){
+      const obj::cache_entry & e = _index.chunks[i];
+      if(in_view(mvp, e)){
+        now.emplace_back(distance(camera, e), i);
+        _chunks[i].visible = _frame;
+      }else if(in_view(predicted, e)){
+        soon.emplace_back(distance(camera, e), i);
+      }
+    }
+    std::sort(now.begin(), now.end());
+    std::sort(soon.begin(), soon.end());
+
+    _wanted.clear();
+    for(auto & c : now) if(_wanted.size() < _pages.size()) _wanted.push_back(c.second);
+    std::size_t visible = _wanted.size();
+    for(auto & c : soon) if(_wanted.size() < _pages.size()) _wanted.push_back(c.second);
+
+    for(std::size_t i = 0; i < _wanted.size(); ++i){
+      chunk_state & c = _chunks[_wanted[i]];
+      c.wanted = _frame;
+      if(c.page != NONE) _pages[c.page].used = _frame;
+      if(i < visible){
+        ++_stats.visible;
+        _stats.hits += c.page != NONE;
+      }
+    }
+  }
+
+  /* Asks the reading thread for the wanted chunks that are not in pages */
+  void request()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // What was asked but is not wanted any more is not read
+    for(auto it = _to_read.begin(); it != _to_read.end();){
+      if(_chunks[*it].wanted != _frame){
+        _chunks[*it].reading = false;
+        it = _to_read.erase(it);
+      }else{
+        ++it;
+      }
+    }
+    for(std::size_t i : _wanted){
+      if(_to_read.size() + _being_read >= _options.max_reading) break;
+      chunk_state & c = _chunks[i];
+      if(c.page == NONE and not c.reading and not c.broken){
+        c.reading = true;
+        _to_read.push_back(i);
+      }
+    }
+    _wake.notify_one();
+  }
+
+  /* Puts what has been read in pages. Returns true if a chunk in view is
+   * still missing. */
+  bool place()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for(arrival & a : _arrived) _ready.push_back(std::move(a));
+      _arrived.clear();
+    }
+    // What does not fit in this frame's budget waits for the next one
+    std::size_t budget = _options.upload_per_frame;
+    for(; budget > 0 and not _ready.empty(); _ready.pop_front()){
+      arrival & a = _ready.front();
+      chunk_state & c = _chunks[a.index];
+      c.reading = false;
+      if(a.data.indices.empty()){ // The reader could not read it
+        c.broken = true;
+        continue;
+      }
+      std::size_t target = free_page();
+      if(c.wanted != _frame or target == NONE){
+        ++_stats.dropped;
+        continue;
+      }
+      page & p = _pages[target];
+      if(p.chunk != NONE){
+        _chunks[p.chunk].page = NONE;
+        ++_stats.evictions;
+      }
+      upload(a.data, p.m);
+      p.chunk = a.index;
+      p.used = _frame;
+      c.page = target;
+      std::size_t bytes = 2 * sizeof(glm::vec3) * a.data.positions.size()
+        + sizeof(std::uint32_t) * a.data.indices.size();
+      budget -= std::min(budget, bytes);
+      ++_stats.uploads;
+      _stats.uploaded_bytes += bytes;
+    }
+
+    bool missing = false;
+    for(std::size_t i : _wanted)
+      missing = missing or (_chunks[i].page == NONE and not _chunks[i].broken);
+    return missing;
+  }
+
+  /* A page without a chunk, or the least recently used one that is not
+   * needed in this frame */
+  std::size_t free_page() const
+  {
+    std::size_t best = NONE;
+    for(std::size_t i = 0; i < _pages.size(); ++i){
+      const page & p = _pages[i];
+      if(p.chunk == NONE) return i;
+      if(p.used != _frame and (best == NONE or p.used < _pages[best].used))
+        best = i;
+    }
+    return best;
+  }
+
+  static void upload(const obj::chunk & c, model & m)
+  {
+    glBindBuffer(GL_ARRAY_BUFFER, m.position_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::vec3) * c.positions.size(), c.positions.data());
+    glBindBuffer(GL_ARRAY_BUFFER, m.normal_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::vec3) * c.normals.size(), c.normals.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // Not through GL_ELEMENT_ARRAY_BUFFER, that would change the bound
+    // vertex array
+    glBindBuffer(GL_COPY_WRITE_BUFFER, m.index_buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, 0, sizeof(std::uint32_t) * c.indices.size(), c.indices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    m.indices = int(c.indices.size());
+  }
+
+  /* The reading thread */
+  void read()
+  {
+    trace::thread_name("pager");
+    std::ifstream in(_filename, std::ios::binary);
+    std::unique_lock<std::mutex> lock(_mutex);
+    for(;;){
+      _wake.wait(lock, [this]{ return _stop or not _to_read.empty(); });
+      if(_stop) return;
+      std::size_t index = _to_read.front();
+      _to_read.pop_front();
+      ++_being_read;
+      lock.unlock();
+
+      arrival a;
+      a.index = index;
+      try{
+        obj::read_cache_chunk(in, _index.chunks[index], a.data);
+      }catch(std::exception & e){
+        std::cerr << "Cannot read chunk " << index << " of '" << _filename
+                  << "': " << e.what() << std::endl;
+        a.data.clear();
+      }
+
+      lock.lock();
+      --_being_read;
+      _arrived.push_back(std::move(a));
+    }
+  }
+
+  options _options;
+  obj::cache_index _index;
+  std::string _filename;
+  std::size_t _page_bytes = 0;
+
+  // Render thread only
+  std::vector<page> _pages;
+  std::vector<chunk_state> _chunks;
+  std::vector<std::size_t> _wanted;
+  std::deque<arrival> _ready; // Read, waiting for a page
+  std::size_t _frame = 0;
+  glm::mat4 _previous;
+  bool _has_previous = false;
+  statistics _stats;
+  std::chrono::steady_clock::time_point _start;
+
+  std::mutex _mutex; // Protects what follows
+  std::condition_variable _wake;
+  std::deque<std::size_t> _to_read;
+  std::size_t _being_read = 0;
+  std::deque<arrival> _arrived;
+  bool _stop = false;
+
+  std::thread _reader;
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "model.hpp"
+#include "common/range_allocator.hpp"
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Keeps the vertices and indices of many models in a few big buffers.
+ *
+ * Each block is one model made with allocate_model (a position, a normal and
+ * an index buffer and the vertex array that points to them) with room for
+ * many meshes. Models are ranges of a block, handed out by two
+ * util::range_allocator, one for the vertices and one for the indices, and
+ * are drawn with glDrawElementsBaseVertex: the indices of each model count
+ * from 0, the base vertex moves them to where the model is in the block.
+ *
+ * All the models of a block share its vertex array, so drawing them one
+ * after the other with draw() binds it once instead of once per model. A
+ * new block is made when a model does not fit in the others, at least as big
+ * as the model. Each block also has a vertex array with only the positions,
+ * for depth-only passes.
+ *
+ * Only for the thread that owns the GL context.
+ */
+class geometry_pool
+{
+public:
+  struct options
+  {
+    std::size_t block_vertices = 1 << 20; // 24 MB of positions and normals
+    std::size_t block_indices  = 3 << 20; // 12 MB
+  };
+
+  struct statistics
+  {
+    std::size_t blocks = 0;
+    std::size_t models = 0;
+    std::size_t vertex_capacity = 0, vertices = 0;
+    std::size_t index_capacity = 0, indices = 0;
+    std::size_t free_ranges = 0;
+    // Of the free space of all the blocks, see util::range_allocator
+    double vertex_fragmentation = 0., index_fragmentation = 0.;
+    // Since reset_counters()
+    std::size_t binds = 0, draws = 0;
+
+    /* Part of the capacity that is used */
+    double utilization() const
+    {
+      std::size_t capacity = vertex_capacity * 2 * sizeof(glm::vec3) + index_capacity * sizeof(std::uint32_t);
+      std::size_t used = vertices * 2 * sizeof(glm::vec3) + indices * sizeof(std::uint32_t);
+      return capacity ? double(used) / capacity : 0.;
+    }
+  };
+
+  geometry_pool() : geometry_pool(options()) {}
+  explicit geometry_pool(const options & o) : _options(o) {}
+
+  geometry_pool(const geometry_pool &) = delete;
+  geometry_pool & operator=(const geometry_pool &) = delete;
+
+  ~geometry_pool()
+  {
+    for(block & b : _blocks){
+      release_model(b.gpu);
+      glDeleteVertexArrays(1, &b.depth_array);
+    }
+  }
+
+  /* A model with room for the given number of vertices and indices (at
+   * least one), filled like the ones of allocate_model but at base_vertex and
+   * first_index in its buffers. Give it back with release(). */
+  model allocate(int vertices, int indices)
+  {
+    std::size_t v = 0, i = 0;
+    block * b = nullptr;
+    for(block & candidate : _blocks){
+      if(not candidate.vertices.allocate(std::size_t(vertices), v)) continue;
+      if(candidate.indices.allocate(std::size_t(indices), i)){
+        b = &candidate;
+        break;
+      }
+      candidate.vertices.free(v, std::size_t(vertices));
+    }
+    if(not b){
+      std::size_t block_vertices = std::max(_options.block_vertices, std::size_t(vertices));
+      std::size_t block_indices = std::max(_options.block_indices, std::size_t(indices));
+      _blocks.emplace_back();
+      b = &_blocks.back();
+      b->gpu = allocate_model(int(block_vertices), int(block_indices));
+      glGenVertexArrays(1, &b->depth_array);
+      glBindVertexArray(b->depth_array);
+      glBindBuffer(GL_ARRAY_BUFFER, b->gpu.position_buffer);
+      glVertexAttribPointer(POSITION_INDEX, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+      glEnableVertexAttribArray(POSITION_INDEX);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->gpu.index_buffer);
+      glBindVertexArray(0);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      b->vertices = util::range_allocator(block_vertices);
+      b->indices = util::range_allocator(block_indices);
+      b->vertices.allocate(std::size_t(vertices), v);
+      b->indices.allocate(std::size_t(indices), i);
+    }
+    ++b->models;
+
+    model m = b->gpu;
+    m.vertices = vertices;
+    m.indices = indices;
+    m.base_vertex = GLint(v);
+    m.first_index = GLuint(i);
+    m.pooled = true;
+    return m;
+  }
+
+  /* allocate() and fill it at once, like model_from_data */
+  model add(const std::vector<glm::vec3> & coords,
+            const std::vector<glm::vec3> & normals,
+            const std::vector<std::uint32_t> & indices)
+  {
+    model m = allocate(int(std::min(coords.size(), normals.size())), int(indices.size()));
+    glBindBuffer(GL_ARRAY_BUFFER, m.position_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * m.base_vertex,
+                    sizeof(glm::vec3) * m.vertices, coords.data());
+    glBindBuffer(GL_ARRAY_BUFFER, m.normal_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * m.base_vertex,
+                    sizeof(glm::vec3) * m.vertices, normals.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // GL_COPY_WRITE_BUFFER leaves the vertex array that is bound alone
+    glBindBuffer(GL_COPY_WRITE_BUFFER, m.index_buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, sizeof(std::uint32_t) * m.first_index,
+                    sizeof(std::uint32_t) * m.indices, indices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return m;
+  }
+
+  /* Gives back the ranges of a model made by allocate() */
+  void release(model & m)
+  {
+    for(block & b : _blocks){
+      if(b.gpu.vertex_array != m.vertex_array) continue;
+      b.vertices.free(std::size_t(m.base_vertex), std::size_t(m.vertices));
+      b.indices.free(m.first_index, std::size_t(m.indices));
+      --b.models;
+      break;
+    }
+    m = model();
+  }
+
+  /* Draws any model, pooled or not, without binding its vertex array if it
+   * is the one of the previous draw. Call end() after the last one.
+   * With depth_only pooled models only read their positions. */
+  void draw(const model & m, bool depth_only = false)
+  {
+    if(not m.vertex_array or not m.vertices) return;
+    GLuint vertex_array = m.vertex_array;
+    if(depth_only and m.pooled)
+      for(const block & b : _blocks)
+        if(b.gpu.vertex_array == m.vertex_array)
+          vertex_array = b.depth_array;
+    if(vertex_array != _bound){
+      glBindVertexArray(vertex_array);
+      _bound = vertex_array;
+      ++_binds;
+    }
+    if(m.index_buffer)
+      glDrawElementsBaseVertex(GL_TRIANGLES, m.indices, GL_UNSIGNED_INT,
+                               (const void*)(sizeof(std::uint32_t) * m.first_index),
+                               m.base_vertex);
+    else
+      glDrawArrays(GL_TRIANGLES, 0, m.vertices);
+    ++_draws;
+  }
+
+  /* Leaves no vertex array bound, for code that draws with render_model */
+  void end()
+  {
+    glBindVertexArray(0);
+    _bound = 0;
+  }
+
+  statistics stats() const
+  {
+    statistics s;
+    std::size_t free_vertices = 0, free_indices = 0;
+    std::size_t largest_vertices = 0, largest_indices = 0;
+    for(const block & b : _blocks){
+      ++s.blocks;
+      s.models += b.models;
+      s.vertex_capacity += b.vertices.capacity();
+      s.vertices += b.vertices.used();
+      s.index_capacity += b.indices.capacity();
+      s.indices += b.indices.used();
+      s.free_ranges += b.vertices.free_ranges() + b.indices.free_ranges();
+      free_vertices += b.vertices.capacity() - b.vertices.used();
+      free_indices += b.indices.capacity() - b.indices.used();
+      largest_vertices = std::max(largest_vertices, b.vertices.largest_free());
+      largest_indices = std::max(largest_indices, b.indices.largest_free());
+    }
+    if(free_vertices) s.vertex_fragmentation = 1. - double(largest_vertices) / free_vertices;
+    if(free_indices) s.index_fragmentation = 1. - double(largest_indices) / free_indices;
+    s.binds = _binds;
+    s.draws = _draws;
+    return s;
+  }
+
+  void reset_counters() { _binds = _draws = 0; }
+
+private:
+  struct block
+  {
+    model gpu;
+    GLuint depth_array = 0; // Only the positions of gpu
+    util::range_allocator vertices, indices;
+    std::size_t models = 0;
+  };
+
+  options _options;
+  std::vector<block> _blocks;
+  GLuint _bound = 0;
+  std::size_t _binds = 0, _draws = 0;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <GL/glew.h>
+
+/* How long the GPU takes to run the commands between begin() and end()
+ * (a GL_TIME_ELAPSED query). Timers cannot be nested. */
+class gpu_timer
+{
+public:
+  gpu_timer() { glGenQueries(1, &_query); }
+  ~gpu_timer() { glDeleteQueries(1, &_query); }
+
+  gpu_timer(const gpu_timer &) = delete;
+  gpu_timer & operator=(const gpu_timer &) = delete;
+
+  void begin()
+  {
+    glBeginQuery(GL_TIME_ELAPSED, _query);
+    _used = true;
+  }
+
+  void end() { glEndQuery(GL_TIME_ELAPSED); }
+
+  /* Of the last begin() and end(), 0 if there was none. Waits for the GPU
+   * to get there. */
+  double seconds() const
+  {
+    if(not _used) return 0.;
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(_query, GL_QUERY_RESULT, &nanoseconds);
+    return nanoseconds * 1e-9;
+  }
+
+private:
+  GLuint _query = 0;
+  bool _used = false;
+};
@@ -0,0 +1,337 @@
+#pragma once
+
+#include "model.hpp"
+#include "depth_pyramid.hpp"
+#include "gpu_timer.hpp"
+#include "common/shader.hpp"
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp> // For value_ptr
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+/* Draws many instances of a few meshes with the GPU deciding what to draw.
+ *
+ * The transforms and bounding spheres of the instances are in a shader
+ * storage buffer. Every frame a compute shader (cull.comp) tests the spheres
+ * against the view frustum and writes a DrawElementsIndirectCommand for each
+ * instance, with zero instances if it is not in view, and everything is drawn
+ * with a single glMultiDrawElementsIndirect (instanced.vert reads the
+ * transform from the same buffer). The CPU does the same work for 10 or
+ * 100000 instances.
+ *
+ * With a depth_pyramid of the previous frame the instances in the frustum
+ * are also tested against it, and the ones that were hidden are not drawn
+ * (occlusion culling).
+ *
+ * With a depth prepass the commands are drawn twice: first only the depth,
+ * with instanced_depth.vert, then the colors with GL_EQUAL, so that
+ * shade.frag runs once per pixel instead of once per fragment.
+ *
+ * The meshes must be in the same buffers, eg: models of one block of a
+ * geometry_pool. Needs OpenGL 4.3, see supported().
+ */
+class instance_renderer
+{
+public:
+  struct instance
+  {
+    glm::mat4 transform;
+    std::uint32_t mesh; // Returned by add_mesh
+  };
+
+  struct statistics
+  {
+    std::size_t instances = 0;
+    std::size_t frustum_culled = 0;
+    std::size_t occluded = 0;
+    double gpu_seconds = 0.; // Culling and drawing, with the depth prepass
+
+    std::size_t drawn() const { return instances - frustum_culled - occluded; }
+  };
+
+  instance_renderer() :
+    _program(shaders::build_program("./instanced.vert", "./shade.frag")),
+    _depth_program(shaders::build_program("./instanced_depth.vert", "./depth.frag")),
+    _cull(shaders::build_compute_program("./cull.comp"))
+  {
+    _u_depth_view_projection = glGetUniformLocation(_depth_program, "u_view_projection");
+    _u_view_projection = glGetUniformLocation(_program, "u_view_projection");
+    _u_view = glGetUniformLocation(_program, "u_view");
+    _u_planes = glGetUniformLocation(_cull, "u_planes");
+    _u_count = glGetUniformLocation(_cull, "u_count");
+    _u_occlusion = glGetUniformLocation(_cull, "u_occlusion");
+    _u_previous_view_projection = glGetUniformLocation(_cull, "u_previous_view_projection");
+    _u_depth_size = glGetUniformLocation(_cull, "u_depth_size");
+    _u_pyramid_levels = glGetUniformLocation(_cull, "u_pyramid_levels");
+    glUseProgram(_cull);
+    glUniform1i(glGetUniformLocation(_cull, "u_pyramid"), 0);
+    glUseProgram(0);
+    glGenBuffers(1, &_counters);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _counters);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 2, nullptr, GL_DYNAMIC_READ);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glGenBuffers(1, &_instances);
+    glGenBuffers(1, &_meshes);
+    glGenBuffers(1, &_commands);
+    glGenBuffers(1, &_instance_ids);
+    glGenVertexArrays(1, &_vertex_array);
+    glGenVertexArrays(1, &_depth_vertex_array);
+  }
+
+  instance_renderer(const instance_renderer &) = delete;
+  instance_renderer & operator=(const instance_renderer &) = delete;
+
+  ~instance_renderer()
+  {
+    GLuint buffers[] = { _instances, _meshes, _commands, _instance_ids, _counters };
+    glDeleteBuffers(5, buffers);
+    glDeleteVertexArrays(1, &_vertex_array);
+    glDeleteVertexArrays(1, &_depth_vertex_array);
+    glDeleteProgram(_program);
+    glDeleteProgram(_depth_program);
+    glDeleteProgram(_cull);
+  }
+
+  static bool supported()
+  {
+    return GLEW_VERSION_4_3;
+  }
+
+  /* Adds an indexed model, with a sphere around it in its own coordinates.
+   * Throws std::runtime_error if it is not in the buffers of the first. */
+  std::uint32_t add_mesh(const model & m, const glm::vec3 & center, float radius)
+  {
+    if(_mesh_data.empty()){
+      glBindVertexArray(_vertex_array);
+      glBindBuffer(GL_ARRAY_BUFFER, m.position_buffer);
+      glVertexAttribPointer(POSITION_INDEX, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+      glEnableVertexAttribArray(POSITION_INDEX);
+      glBindBuffer(GL_ARRAY_BUFFER, m.normal_buffer);
+      glVertexAttribPointer(NORMAL_INDEX, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+      glEnableVertexAttribArray(NORMAL_INDEX);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.index_buffer);
+      // The same without the normals, for the depth prepass
+      glBindVertexArray(_depth_vertex_array);
+      glBindBuffer(GL_ARRAY_BUFFER, m.position_buffer);
+      glVertexAttribPointer(POSITION_INDEX, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+      glEnableVertexAttribArray(POSITION_INDEX);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.index_buffer);
+      glBindVertexArray(0);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      _position_buffer = m.position_buffer;
+    }else if(m.position_buffer != _position_buffer){
+      throw std::runtime_error("The meshes of an instance_renderer must share their buffers");
+    }
+    if(not m.index_buffer)
+      throw std::runtime_error("instance_renderer only draws indexed meshes");
+    _mesh_data.push_back(gpu_mesh{ GLuint(m.indices), m.first_index, m.base_vertex, 0 });
+    _spheres.push_back(glm::vec4(center, radius));
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _meshes);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(gpu_mesh) * _mesh_data.size(),
+                 _mesh_data.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return std::uint32_t(_mesh_data.size() - 1);
+  }
+
+  /* Replaces all the instances */
+  void set_instances(const std::vector<instance> & instances)
+  {
+    std::vector<gpu_instance> data(instances.size());
+    for(std::size_t i = 0; i < instances.size(); ++i){
+      const instance & in = instances[i];
+      data[i].transform = in.transform;
+      data[i].sphere = world_sphere(in.transform, _spheres[in.mesh]);
+      data[i].mesh = in.mesh;
+    }
+    _count = instances.size();
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _instances);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(gpu_instance) * data.size(),
+                 data.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _commands);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(command) * _count, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // 0, 1, 2... read once per instance, the base instance picks one
+    std::vector<std::uint32_t> ids(_count);
+    std::iota(ids.begin(), ids.end(), 0u);
+    glBindBuffer(GL_ARRAY_BUFFER, _instance_ids);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(std::uint32_t) * ids.size(), ids.data(), GL_STATIC_DRAW);
+    for(GLuint vertex_array : { _vertex_array, _depth_vertex_array }){
+      glBindVertexArray(vertex_array);
+      glVertexAttribIPointer(INSTANCE_INDEX, 1, GL_UNSIGNED_INT, 0, NULL);
+      glVertexAttribDivisor(INSTANCE_INDEX, 1);
+      glEnableVertexAttribArray(INSTANCE_INDEX);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  /* Culls and draws all the instances. With occlusion (if it is ready), the
+   * ones that were hidden in its frame are not drawn either. With
+   * depth_prepass the depth is drawn first, see above. */
+  void draw(const glm::mat4 & view, const glm::mat4 & projection,
+            const depth_pyramid * occlusion = nullptr, bool depth_prepass = false)
+  {
+    if(not _count) return;
+    _timer.begin();
+    glm::mat4 view_projection = projection * view;
+    glm::vec4 planes[6];
+    frustum_planes(view_projection, planes);
+
+    const GLuint zeros[2] = { 0, 0 };
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _counters);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zeros), zeros);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _instances);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _meshes);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _commands);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _counters);
+
+    glUseProgram(_cull);
+    glUniform4fv(_u_planes, 6, &planes[0].x);
+    glUniform1ui(_u_count, GLuint(_count));
+    bool occluding = occlusion and occlusion->ready();
+    glUniform1i(_u_occlusion, occluding);
+    if(occluding){
+      glUniformMatrix4fv(_u_previous_view_projection, 1, GL_FALSE,
+                         glm::value_ptr(occlusion->view_projection()));
+      glUniform2f(_u_depth_size, float(occlusion->width()), float(occlusion->height()));
+      glUniform1i(_u_pyramid_levels, occlusion->levels());
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, occlusion->texture());
+    }
+    glDispatchCompute(GLuint((_count + 63) / 64), 1, 1);
+    // The commands are read by the draw, not by a shader, and the counters
+    // by glGetBufferSubData in stats()
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _commands);
+    if(depth_prepass){
+      glUseProgram(_depth_program);
+      glUniformMatrix4fv(_u_depth_view_projection, 1, GL_FALSE, glm::value_ptr(view_projection));
+      glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+      glBindVertexArray(_depth_vertex_array);
+      glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, GLsizei(_count), 0);
+      glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+      // Only the nearest fragment of each pixel passes
+      glDepthFunc(GL_EQUAL);
+      glDepthMask(GL_FALSE);
+    }
+    glUseProgram(_program);
+    glUniformMatrix4fv(_u_view_projection, 1, GL_FALSE, glm::value_ptr(view_projection));
+    glUniformMatrix4fv(_u_view, 1, GL_FALSE, glm::value_ptr(view));
+    glBindVertexArray(_vertex_array);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, GLsizei(_count), 0);
+    if(depth_prepass){
+      glDepthFunc(GL_LESS);
+      glDepthMask(GL_TRUE);
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+    if(occluding) glBindTexture(GL_TEXTURE_2D, 0);
+    _timer.end();
+  }
+
+  /* What the last draw() did. Reads the counters of cull.comp back and
+   * waits for the GPU time: for statistics once in a while, not every
+   * frame. */
+  statistics stats() const
+  {
+    statistics s;
+    GLuint counters[2] = { 0, 0 };
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _counters);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    s.instances = _count;
+    s.frustum_culled = counters[0];
+    s.occluded = counters[1];
+    s.gpu_seconds = _timer.seconds();
+    return s;
+  }
+
+  std::size_t size() const { return _count; }
+
+  /* The planes of the frustum of view_projection, a·x + d >= 0 inside,
+   * with a normalized so that the value is a distance (Gribb & Hartmann). */
+  static void frustum_planes(const glm::mat4 & view_projection, glm::vec4 planes[6])
+  {
+    glm::mat4 m = glm::transpose(view_projection);
+    for(int axis = 0; axis < 3; ++axis){
+      planes[2*axis] = m[3] + m[axis];
+      planes[2*axis + 1] = m[3] - m[axis];
+    }
+    for(int i = 0; i < 6; ++i)
+      planes[i] /= glm::length(glm::vec3(planes[i].x, planes[i].y, planes[i].z));
+  }
+
+  /* What cull.comp does with each instance, for the CPU */
+  static bool in_frustum(const glm::vec4 planes[6], const glm::vec4 & sphere)
+  {
+    for(int i = 0; i < 6; ++i)
+      if(glm::dot(glm::vec3(planes[i].x, planes[i].y, planes[i].z),
+                  glm::vec3(sphere.x, sphere.y, sphere.z)) + planes[i].w < -sphere.w)
+        return false;
+    return true;
+  }
+
+  /* The sphere (center, radius) of a mesh moved by transform */
+  static glm::vec4 world_sphere(const glm::mat4 & transform, const glm::vec4 & sphere)
+  {
+    glm::vec4 center = transform * glm::vec4(sphere.x, sphere.y, sphere.z, 1.f);
+    float scale = std::max(glm::length(glm::vec3(transform[0].x, transform[0].y, transform[0].z)),
+                  std::max(glm::length(glm::vec3(transform[1].x, transform[1].y, transform[1].z)),
+                           glm::length(glm::vec3(transform[2].x, transform[2].y, transform[2].z))));
+    return glm::vec4(center.x, center.y, center.z, sphere.w * scale);
+  }
+
+private:
+  static const int INSTANCE_INDEX = 2; // a_instance in instanced.vert
+
+  // The structs of the shaders, std430
+  struct gpu_instance
+  {
+    glm::mat4 transform;
+    glm::vec4 sphere;
+    std::uint32_t mesh;
+    std::uint32_t pad[3];
+  };
+  static_assert(sizeof(gpu_instance) == 96, "Layout of instance in instanced.vert");
+
+  struct gpu_mesh
+  {
+    GLuint count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint pad;
+  };
+
+  struct command
+  {
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint base_instance;
+  };
+  static_assert(sizeof(command) == 20, "DrawElementsIndirectCommand");
+
+  GLuint _program, _depth_program, _cull;
+  GLint _u_view_projection, _u_view, _u_depth_view_projection, _u_planes, _u_count;
+  GLint _u_occlusion, _u_previous_view_projection, _u_depth_size, _u_pyramid_levels;
+  GLuint _instances = 0, _meshes = 0, _commands = 0, _instance_ids = 0;
+  GLuint _counters = 0; // Frustum culled and occluded, written by cull.comp
+  GLuint _vertex_array = 0, _depth_vertex_array = 0;
+  GLuint _position_buffer = 0;
+  std::vector<gpu_mesh> _mesh_data;
+  std::vector<glm::vec4> _spheres; // Of the meshes
+  std::size_t _count = 0;
+  gpu_timer _timer;
+};
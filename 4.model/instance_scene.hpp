@@ -0,0 +1,88 @@
+#pragma once
+
+#include "model.hpp"
+#include "geometry_pool.hpp"
+#include "instance_renderer.hpp"
+#include "depth_pyramid.hpp"
+#include "render_target.hpp"
+#include "common/obj.hpp"
+#include "common/shapes.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp> // For translate, rotate, scale
+
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+
+/* Many copies of a model, and of the cube every fourth, in a grid: what
+ * --instances shows and --bench-instances and --bench-prepass measure.
+ * Drawn with instance_renderer, with occlusion culling against the depth
+ * pyramid of the frame before if occlusion is true, and with a depth
+ * prepass if depth_prepass is. Needs OpenGL 4.3.
+ */
+struct instance_scene
+{
+  explicit instance_scene(const obj::scene & s)
+  {
+    // Both meshes in the same buffers, instance_renderer needs it
+    std::vector<std::uint32_t> cube_indices(shapes::cube::positions.size());
+    std::iota(cube_indices.begin(), cube_indices.end(), 0u);
+    meshes[0] = pool.add(s.positions, s.normals, s.indices);
+    meshes[1] = pool.add(shapes::cube::positions, shapes::cube::normals, cube_indices);
+    spheres[0] = glm::vec4(s.bounds.sphere_center, s.bounds.sphere_radius);
+    spheres[1] = glm::vec4(0.f, 0.f, 0.f, std::sqrt(3.f));
+    for(int i = 0; i < 2; ++i)
+      renderer.add_mesh(meshes[i], glm::vec3(spheres[i].x, spheres[i].y, spheres[i].z), spheres[i].w);
+  }
+
+  /* A cube of count instances, all of radius 1 and distance apart, turned
+   * at random (always the same). They overlap if distance is less than 2. */
+  void place(std::size_t count, float distance = 3.f)
+  {
+    spacing = distance;
+    int side = int(std::ceil(std::cbrt(double(count))));
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> angle(0.f, 6.2831853f);
+    instances.resize(count);
+    world_spheres.resize(count);
+    for(std::size_t i = 0; i < count; ++i){
+      std::uint32_t mesh = i % 4 == 3 ? 1 : 0;
+      const glm::vec4 & sphere = spheres[mesh];
+      glm::vec3 cell(float(i % side), float(i / side % side), float(i / side / side));
+      glm::vec3 axis = glm::normalize(glm::vec3(std::cos(angle(random)), std::sin(angle(random)), 1.f));
+      instances[i].mesh = mesh;
+      instances[i].transform = glm::translate(spacing * (cell - glm::vec3((side - 1) / 2.f))) *
+        glm::rotate(angle(random), axis) * glm::scale(glm::vec3(1.f / sphere.w)) *
+        glm::translate(-glm::vec3(sphere.x, sphere.y, sphere.z));
+      world_spheres[i] = instance_renderer::world_sphere(instances[i].transform, sphere);
+    }
+    renderer.set_instances(instances);
+    pyramid.reset();
+  }
+
+  /* Draws in target, which has to be bound, and keeps its depth for the
+   * occlusion culling of the next frame */
+  void draw(const glm::mat4 & view, const glm::mat4 & projection, const render_target & target)
+  {
+    renderer.draw(view, projection, occlusion ? &pyramid : nullptr, depth_prepass);
+    if(occlusion)
+      pyramid.build(target.depth_texture(), target.width(), target.height(), projection * view);
+    else
+      pyramid.reset();
+  }
+
+  float spacing = 3.f; // Of the last place()
+  bool occlusion = true;
+  bool depth_prepass = false;
+
+  geometry_pool pool;
+  model meshes[2];      // The model and the cube
+  glm::vec4 spheres[2]; // Around the meshes, in their coordinates
+  std::vector<instance_renderer::instance> instances;
+  std::vector<glm::vec4> world_spheres; // Of the instances
+  instance_renderer renderer;
+  depth_pyramid pyramid;
+};
@@ -0,0 +1,42 @@
+#version 430
+
+/* shade.vert for instance_renderer.hpp: the transform of the model comes
+ * from the instance buffer instead of a uniform. a_instance is the number of
+ * the instance, it is the same for all the vertices of a draw and the culling
+ * shader (cull.comp) chooses it with the base instance of the draw command. */
+
+layout (location = 0) in vec3 a_position;
+layout (location = 1) in vec3 a_normal;
+layout (location = 2) in uint a_instance;
+
+struct instance
+{
+  mat4 transform;
+  vec4 sphere; // Bounding sphere in world coordinates, for cull.comp
+  uint mesh;
+  uint pad0, pad1, pad2;
+};
+
+layout (std430, binding = 0) readonly buffer instances
+{
+  instance u_instances[];
+};
+
+uniform mat4 u_view_projection;
+uniform mat4 u_view;
+
+out vec3 v_normal;
+out vec3 v_pos;
+
+// The same depth as instanced_depth.vert
+invariant gl_Position;
+
+void main()
+{
+  mat4 transform = u_instances[a_instance].transform;
+  gl_Position = u_view_projection*transform*vec4(a_position,1.f);
+  v_pos = gl_Position.xyz / gl_Position.w;
+  // The instances are rotated and scaled the same in every direction, so
+  // this is the normal matrix once normalized
+  v_normal = normalize(mat3(u_view*transform)*a_normal);
+}
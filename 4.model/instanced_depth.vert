@@ -0,0 +1,28 @@
+#version 430
+
+/* The depth prepass of instanced.vert, see depth.vert */
+
+layout (location = 0) in vec3 a_position;
+layout (location = 2) in uint a_instance;
+
+struct instance
+{
+  mat4 transform;
+  vec4 sphere;
+  uint mesh;
+  uint pad0, pad1, pad2;
+};
+
+layout (std430, binding = 0) readonly buffer instances
+{
+  instance u_instances[];
+};
+
+uniform mat4 u_view_projection;
+
+invariant gl_Position;
+
+void main()
+{
+  gl_Position = u_view_projection*u_instances[a_instance].transform*vec4(a_position,1.f);
+}
@@ -0,0 +1,335 @@
+#pragma once
+
+#include "common/thread_pool.hpp"
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#define CLUSTERS_SSE 1
+#include <emmintrin.h>
+#endif
+
+/* Point lights for clustered forward shading (clustered.frag).
+ *
+ * The view frustum is cut in a grid of clusters: tiles_x x tiles_y tiles of
+ * the screen, and slices of depth that grow with the distance (the same
+ * ratio between the far and the near side of every slice), so the clusters
+ * are about as deep as they are wide. Every frame bin() finds the clusters
+ * that each light can touch and makes a list of lights per cluster; the
+ * fragment shader finds its cluster from its pixel and depth and only loops
+ * over those lights. A pixel pays for the lights around it, not for all of
+ * them.
+ *
+ * The binning runs on the CPU:
+ *
+ * 1. The box of every light sphere (in view space) is turned into a range
+ *    of tiles and a range of slices. It is conservative, a light can be
+ *    listed in a cluster that its sphere misses near the corners.
+ * 2. Every depth slice is a job of the thread pool: it finds the lights
+ *    whose slice range has it (4 at a time with SSE), counts them in each
+ *    tile and writes the lists. Slices do not share anything, no locks.
+ * 3. The lists of the slices are put one after the other.
+ *
+ * upload() sends the lights, the first index and count of each cluster and
+ * the lists to three texture buffers, that bind() hands to the program.
+ * The projection must be a glm::perspective, without an off-center window.
+ */
+class light_clusters
+{
+public:
+  struct light
+  {
+    glm::vec3 position; // World space
+    float radius;       // Nothing is lit further than this
+    glm::vec3 color;
+  };
+
+  struct options
+  {
+    int tiles_x = 16, tiles_y = 9, slices = 24;
+  };
+
+  struct statistics
+  {
+    std::size_t lights = 0, in_view = 0;
+    std::size_t clusters = 0, used_clusters = 0;
+    std::size_t indices = 0, max_per_cluster = 0;
+    double bin_seconds = 0.;
+
+    /* Lights of the clusters that have any */
+    double average() const { return used_clusters ? double(indices) / used_clusters : 0.; }
+  };
+
+  light_clusters() : light_clusters(options()) {}
+  explicit light_clusters(const options & o, util::thread_pool & threads = util::thread_pool::global()) :
+    _options(o), _threads(threads)
+  {
+    _options.tiles_x = std::max(_options.tiles_x, 1);
+    _options.tiles_y = std::max(_options.tiles_y, 1);
+    _options.slices = std::max(_options.slices, 1);
+    std::size_t clusters = std::size_t(_options.tiles_x) * _options.tiles_y * _options.slices;
+    _clusters.assign(clusters * 2, 0u);
+    _counts.assign(clusters, 0u);
+    _slices.resize(std::size_t(_options.slices));
+
+    glGenBuffers(3, _buffers);
+    glGenTextures(3, _textures);
+    const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+    for(int i = 0; i < 3; ++i){
+      glBindBuffer(GL_TEXTURE_BUFFER, _buffers[i]);
+      glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+      glBindTexture(GL_TEXTURE_BUFFER, _textures[i]);
+      glTexBuffer(GL_TEXTURE_BUFFER, formats[i], _buffers[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  }
+
+  light_clusters(const light_clusters &) = delete;
+  light_clusters & operator=(const light_clusters &) = delete;
+
+  ~light_clusters()
+  {
+    glDeleteTextures(3, _textures);
+    glDeleteBuffers(3, _buffers);
+  }
+
+  /* Makes the lists of lights of every cluster, for a camera and a viewport
+   * of width x height. Only uses the CPU. */
+  void bin(const std::vector<light> & lights, const glm::mat4 & view, const glm::mat4 & projection,
+           int width, int height)
+  {
+    auto start = std::chrono::steady_clock::now();
+    _width = width;
+    _height = height;
+    // Undoes glm::perspective
+    _near = projection[3][2] / (projection[2][2] - 1.f);
+    _far = projection[3][2] / (projection[2][2] + 1.f);
+    _slice_scale = float(_options.slices) / std::log(_far / _near);
+    _slice_bias = -std::log(_near) * _slice_scale;
+    _inverse_projection = glm::inverse(projection);
+
+    bound(lights, view, projection);
+
+    const std::size_t tiles = std::size_t(_options.tiles_x) * _options.tiles_y;
+    _threads.parallel_for(std::size_t(_options.slices), 1, [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t s = begin; s < end; ++s)
+        bin_slice(int(s), &_counts[s * tiles]);
+    });
+
+    // The lists of the slices one after the other
+    std::size_t total = 0;
+    for(slice & s : _slices){
+      s.first = total;
+      total += s.indices.size();
+    }
+    _indices.resize(std::max<std::size_t>(total, 1));
+    _threads.parallel_for(std::size_t(_options.slices), 1, [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t s = begin; s < end; ++s){
+        const slice & sl = _slices[s];
+        std::copy(sl.indices.begin(), sl.indices.end(), _indices.begin() + sl.first);
+        for(std::size_t t = 0; t < tiles; ++t){
+          std::size_t cluster = s * tiles + t;
+          _clusters[2*cluster] += std::uint32_t(sl.first);
+          _clusters[2*cluster + 1] = _counts[cluster];
+        }
+      }
+    });
+
+    _stats.lights = lights.size();
+    _stats.in_view = _visible.size();
+    _stats.clusters = _counts.size();
+    _stats.indices = total;
+    _stats.used_clusters = std::size_t(std::count_if(_counts.begin(), _counts.end(),
+                                                     [](std::uint32_t c){ return c != 0; }));
+    _stats.max_per_cluster = *std::max_element(_counts.begin(), _counts.end());
+    _stats.bin_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  /* Sends what bin() made to the texture buffers */
+  void upload()
+  {
+    const void * data[3] = { _gpu_lights.data(), _clusters.data(), _indices.data() };
+    const std::size_t bytes[3] = { _gpu_lights.size() * sizeof(glm::vec4),
+                                   _clusters.size() * sizeof(std::uint32_t),
+                                   _indices.size() * sizeof(std::uint32_t) };
+    for(int i = 0; i < 3; ++i){
+      // A new store each time, the GPU may still be reading the last one
+      glBindBuffer(GL_TEXTURE_BUFFER, _buffers[i]);
+      glBufferData(GL_TEXTURE_BUFFER, GLsizeiptr(std::max<std::size_t>(bytes[i], 16)), NULL, GL_STREAM_DRAW);
+      glBufferSubData(GL_TEXTURE_BUFFER, 0, GLsizeiptr(bytes[i]), data[i]);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  }
+
+  /* Binds the texture buffers to the texture units 0 to 2 and sets the
+   * uniforms of clustered.frag in program, which has to be in use. The
+   * locations are looked up every time, it is a handful per frame. */
+  void bind(GLuint program) const
+  {
+    const char * samplers[3] = { "u_lights", "u_clusters", "u_light_indices" };
+    for(int i = 0; i < 3; ++i){
+      glActiveTexture(GLenum(GL_TEXTURE0 + i));
+      glBindTexture(GL_TEXTURE_BUFFER, _textures[i]);
+      glUniform1i(glGetUniformLocation(program, samplers[i]), i);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glUniform3i(glGetUniformLocation(program, "u_grid"),
+                _options.tiles_x, _options.tiles_y, _options.slices);
+    glUniform2f(glGetUniformLocation(program, "u_slicing"), _slice_scale, _slice_bias);
+    glUniform2f(glGetUniformLocation(program, "u_viewport"), float(_width), float(_height));
+    glUniformMatrix4fv(glGetUniformLocation(program, "u_inverse_projection"), 1, GL_FALSE,
+                       &_inverse_projection[0][0]);
+  }
+
+  /* Of the last bin() */
+  const statistics & stats() const { return _stats; }
+
+private:
+  struct slice
+  {
+    std::vector<std::uint32_t> lights;  // Of _visible that reach this slice
+    std::vector<std::uint32_t> indices; // Lists of the tiles of the slice
+    std::size_t first = 0;              // Of indices in _indices
+  };
+
+  /* Depth slice of a distance in front of the camera */
+  int slice_of(float depth) const
+  {
+    int s = int(std::floor(std::log(depth) * _slice_scale + _slice_bias));
+    return std::min(std::max(s, 0), _options.slices - 1);
+  }
+
+  /* Tile range of [low, high] of normalized device coordinates */
+  static void tile_range(float low, float high, int tiles, int & first, int & last)
+  {
+    first = std::min(std::max(int(std::floor((low + 1.f) * 0.5f * tiles)), 0), tiles - 1);
+    last = std::min(std::max(int(std::floor((high + 1.f) * 0.5f * tiles)), 0), tiles - 1);
+  }
+
+  /* Step 1: the lights in view, with their view space spheres for the GPU
+   * and their cluster ranges. The ranges are padded to a multiple of 4 with
+   * lights that are in no slice, for the SSE loop. */
+  void bound(const std::vector<light> & lights, const glm::mat4 & view, const glm::mat4 & projection)
+  {
+    _visible.clear();
+    _gpu_lights.clear();
+    for(auto * v : { &_first_slice, &_last_slice, &_tile_x0, &_tile_x1, &_tile_y0, &_tile_y1 })
+      v->clear();
+
+    const float sx = projection[0][0], sy = projection[1][1];
+    for(std::uint32_t i = 0; i < lights.size(); ++i){
+      const light & l = lights[i];
+      glm::vec4 c = view * glm::vec4(l.position, 1.f);
+      float r = l.radius;
+      // Distance in front of the camera, -z, cut to the frustum
+      float d0 = std::max(-c.z - r, _near), d1 = std::min(-c.z + r, _far);
+      if(d0 > d1) continue;
+      // x/d and y/d over the box are extreme at its corners
+      float x0 = sx * std::min((c.x - r) / d0, (c.x - r) / d1);
+      float x1 = sx * std::max((c.x + r) / d0, (c.x + r) / d1);
+      float y0 = sy * std::min((c.y - r) / d0, (c.y - r) / d1);
+      float y1 = sy * std::max((c.y + r) / d0, (c.y + r) / d1);
+      if(x0 > 1.f or x1 < -1.f or y0 > 1.f or y1 < -1.f) continue;
+
+      int tx0, tx1, ty0, ty1;
+      tile_range(x0, x1, _options.tiles_x, tx0, tx1);
+      tile_range(y0, y1, _options.tiles_y, ty0, ty1);
+      _gpu_lights.push_back(glm::vec4(c.x, c.y, c.z, r));
+      _gpu_lights.push_back(glm::vec4(l.color, 0.f));
+      _visible.push_back(i);
+      _first_slice.push_back(slice_of(d0));
+      _last_slice.push_back(slice_of(d1));
+      _tile_x0.push_back(tx0);
+      _tile_x1.push_back(tx1);
+      _tile_y0.push_back(ty0);
+      _tile_y1.push_back(ty1);
+    }
+    while(_first_slice.size() % 4){
+      _first_slice.push_back(_options.slices);
+      _last_slice.push_back(-1);
+    }
+  }
+
+  /* Step 2 for one slice, counts has one entry per tile */
+  void bin_slice(int s, std::uint32_t * counts)
+  {
+    slice & sl = _slices[std::size_t(s)];
+    sl.lights.clear();
+    const std::size_t padded = _first_slice.size();
+#ifdef CLUSTERS_SSE
+    const __m128i here = _mm_set1_epi32(s);
+    for(std::size_t i = 0; i < padded; i += 4){
+      __m128i first = _mm_loadu_si128((const __m128i*)&_first_slice[i]);
+      __m128i last = _mm_loadu_si128((const __m128i*)&_last_slice[i]);
+      __m128i out = _mm_or_si128(_mm_cmpgt_epi32(first, here), _mm_cmplt_epi32(last, here));
+      int mask = ~_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xf;
+      for(; mask; mask &= mask - 1){
+        int lane = 0;
+        while(not (mask & (1 << lane))) ++lane;
+        sl.lights.push_back(std::uint32_t(i) + std::uint32_t(lane));
+      }
+    }
+#else
+    for(std::size_t i = 0; i < padded; ++i)
+      if(_first_slice[i] <= s and s <= _last_slice[i])
+        sl.lights.push_back(std::uint32_t(i));
+#endif
+
+    // Count, then the first index of every tile, then the lists
+    const int tiles_x = _options.tiles_x, tiles = tiles_x * _options.tiles_y;
+    std::fill(counts, counts + tiles, 0u);
+    for(std::uint32_t l : sl.lights)
+      for(int y = _tile_y0[l]; y <= _tile_y1[l]; ++y)
+        for(int x = _tile_x0[l]; x <= _tile_x1[l]; ++x)
+          ++counts[y*tiles_x + x];
+    std::uint32_t * clusters = &_clusters[2 * std::size_t(s) * tiles];
+    std::uint32_t total = 0;
+    for(int t = 0; t < tiles; ++t){
+      clusters[2*t] = total; // bin() adds where the slice starts
+      total += counts[t];
+    }
+    sl.indices.resize(total);
+    for(int t = 0; t < tiles; ++t) counts[t] = 0;
+    for(std::uint32_t l : sl.lights)
+      for(int y = _tile_y0[l]; y <= _tile_y1[l]; ++y)
+        for(int x = _tile_x0[l]; x <= _tile_x1[l]; ++x){
+          int t = y*tiles_x + x;
+          sl.indices[clusters[2*t] + counts[t]++] = l;
+        }
+  }
+
+  options _options;
+  util::thread_pool & _threads;
+
+  int _width = 1, _height = 1;
+  float _near = 0.1f, _far = 100.f;
+  float _slice_scale = 1.f, _slice_bias = 0.f;
+  glm::mat4 _inverse_projection;
+
+  // Lights in view, the index of each in the list given to bin() and its
+  // cluster ranges
+  std::vector<std::uint32_t> _visible;
+  std::vector<std::int32_t> _first_slice, _last_slice;
+  std::vector<std::int32_t> _tile_x0, _tile_x1, _tile_y0, _tile_y1;
+
+  std::vector<slice> _slices;
+  std::vector<std::uint32_t> _counts; // Lights of each cluster
+
+  // What goes to the GPU: 2 texels per light in view, first index and count
+  // of each cluster, and the lists, indices of the lights in view
+  std::vector<glm::vec4> _gpu_lights;
+  std::vector<std::uint32_t> _clusters;
+  std::vector<std::uint32_t> _indices;
+
+  GLuint _buffers[3];
+  GLuint _textures[3];
+  statistics _stats;
+};
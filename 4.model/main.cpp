@@ -1,6 +1,26 @@
 #include "common/shader.hpp"
 #include "common/trackball.hpp"
+#include "common/input.hpp"
+#include "common/shapes.hpp"
+#include "common/trace.hpp"
+#include "common/frame_scheduler.hpp"
+#include "common/cpu_raster.hpp"
 #include "common/obj.hpp"
+#include "common/obj_stream.hpp"
+#include "common/memory.hpp"
+#include "common/batch_transform.hpp"
+#include "common/scene_graph.hpp"
+#include "common/ray_cast.hpp"
+
+#include "model.hpp"
+#include "model_loader.hpp"
+#include "geometry_pool.hpp"
+#include "instance_renderer.hpp"
+#include "instance_scene.hpp"
+#include "render_target.hpp"
+#include "geometry_pager.hpp"
+#include "light_clusters.hpp"
+#include "picker.hpp"
 
 #include <GL/glew.h>
 #include <GL/gl.h>
@@ -12,12 +32,38 @@
 
 #include <vector>
 #include <iostream>
+#include <cmath>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <new>
+#include <functional>
+#include <random>
+
+#ifdef GLOW_COUNT_ALLOCATIONS
+/* Every allocation of the program goes through these, so that --bench-load
+ * can tell how many a load takes (util::heap() in common/memory.hpp). They
+ * cost a header and atomic counts on every new, so only with
+ * cmake -DGLOW_COUNT_ALLOCATIONS=ON. */
+void * operator new(std::size_t bytes)
+{
+  if(void * p = util::counted_allocate(bytes)) return p;
+  throw std::bad_alloc();
+}
+void * operator new[](std::size_t bytes) { return operator new(bytes); }
+void * operator new(std::size_t bytes, const std::nothrow_t &) noexcept { return util::counted_allocate(bytes); }
+void * operator new[](std::size_t bytes, const std::nothrow_t &) noexcept { return util::counted_allocate(bytes); }
+void operator delete(void * p) noexcept { util::counted_free(p); }
+void operator delete[](void * p) noexcept { util::counted_free(p); }
+void operator delete(void * p, std::size_t) noexcept { util::counted_free(p); }
+void operator delete[](void * p, std::size_t) noexcept { util::counted_free(p); }
+void operator delete(void * p, const std::nothrow_t &) noexcept { util::counted_free(p); }
+void operator delete[](void * p, const std::nothrow_t &) noexcept { util::counted_free(p); }
+#endif
 
-const float Pi = 3.141592653589793;
 
-/* Indices of things passed to the vertex shader.*/
-static const int POSITION_INDEX = 0;
-static const int NORMAL_INDEX   = 1;
+const float Pi = 3.141592653589793;
 
 // Initial window size
 const int INITIAL_WIDTH  = 800;
@@ -49,8 +95,60 @@ struct scene_state
   util::trackball trackball;
   glm::vec3 camera_position;
 
+  // Callbacks that change what is seen call scheduler.request_redraw()
+  util::frame_scheduler scheduler;
+
+  // Draw with the CPU (common/cpu_raster.hpp) instead of OpenGL, C switches
+  bool cpu_backend = false;
+  // The loader keeps a copy of the meshes for the CPU renderer and the rays,
+  // only with --with-cpu
+  bool keep_geometry = false;
+
+  // Occlusion culling of --instances, H switches
+  bool occlusion = true;
+
+  // Draw the depth first and then the colors of the nearest fragments, Z
+  // switches
+  bool depth_prepass = false;
+
+  // Many moving point lights (light_clusters.hpp) instead of one, L switches
+  bool many_lights = false;
+
+  // The models turn around the center of the window, R switches
+  bool turning = false;
+
+  // The middle button asks what is under this pixel, counted from the bottom
+  bool picking = false;
+  int pick_x = 0, pick_y = 0;
+
   bool displacing;
   glm::vec2 mouse_pos;
+
+  // The cursor events are only stored by the callback, and applied once per
+  // frame by apply_input(). I prints the latency of the input.
+  util::cursor_accumulator cursor;
+  util::input_latency latency;
+
+  /* Moves the trackball and the camera to where the cursor is now */
+  void apply_input()
+  {
+    if(not cursor.moved()) return;
+    // The events of a frame can come back to where the cursor was
+    if(cursor.delta() == glm::vec2(0.f)){
+      cursor.clear();
+      return;
+    }
+    if(trackball.tracking())
+      trackball.move(cursor.position());
+    if(displacing){
+      float translation_speed = 0.002;
+      glm::vec2 delta = cursor.delta();
+      glm::vec3 up =  glm::vec3(0,1,0);
+      glm::vec3 right =  glm::vec3(-1,0,0);
+      camera_position += translation_speed * (up*delta.y + right*delta.x);
+    }
+    cursor.clear();
+  }
   
   void update_projection()
   {
@@ -73,112 +171,291 @@ struct scene_state
   int height;
 };
 
-/* Represents an oject in the scene */ 
-struct model
+/* Where the models of the window are: a node of a scene graph for each file
+ * of the loader, all under a root that turns them when R is pressed */
+struct model_layout
 {
-  model()
-  {
-    vertices        = 0;
-    vertex_array    = 0;
-    position_buffer = 0;
-    normal_buffer   = 0;
-  }
+  util::scene_graph graph;
+  util::scene_graph::node root = graph.add(util::scene_graph::none);
+  std::vector<util::scene_graph::node> models; // By entry of the loader
 
-  glm::mat4 transform; 
-  GLuint vertex_array;
-  GLuint position_buffer;
-  GLuint normal_buffer;
-  int vertices;
+  const glm::mat4 & placement(std::size_t entry) const { return graph.world(models[entry]); }
 };
 
-
-/* Creates a model with given coordinates and normals. 
- * Very similar to the old create_cube_model
- */
-static model model_from_data(std::vector<glm::vec3> & coords,
-                             std::vector<glm::vec3> & normals)
+/* Normal matrix for a model, u_normal_mat in shade.vert */
+static glm::mat3 normal_matrix(const glm::mat4 & view, const glm::mat4 & transform)
 {
-  model m;
-
-  glGenBuffers(1,&m.position_buffer);
-  glGenBuffers(1,&m.normal_buffer);
-  glGenVertexArrays(1,&m.vertex_array);
-  
-  glBindVertexArray(m.vertex_array);
-
-  // Positions
-  glBindBuffer(GL_ARRAY_BUFFER, m.position_buffer);
-  glBufferData(GL_ARRAY_BUFFER,
-               sizeof(glm::vec3) * coords.size(),
-               coords.data(), GL_STATIC_DRAW);
-  glVertexAttribPointer(POSITION_INDEX, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-  glEnableVertexAttribArray(POSITION_INDEX);
-
-  // normals
-  glBindBuffer(GL_ARRAY_BUFFER, m.normal_buffer);
-  glBufferData(GL_ARRAY_BUFFER,
-               sizeof(glm::vec3) * normals.size(),
-               normals.data(), GL_STATIC_DRAW);
-  glVertexAttribPointer(NORMAL_INDEX, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-  glEnableVertexAttribArray(NORMAL_INDEX);
-
-  m.vertices = std::min(coords.size(),normals.size());
-  
-  glBindVertexArray(0);
-  return m;
+  return glm::transpose(glm::inverse(glm::mat3(view*transform)));
 }
 
-// Loads the coordinates and positions from a file using some old code
-// I wrote somwhen. Then uses model_from_data to make a model with it.
-static model load_model(const std::string & filename)
+/* Draws a model, or a box in its place while it is loading, moved by
+ * placement. The chunks of a streamed file are drawn as they arrive.
+ * For the depth prepass depth_only is true and u_normal_mat_loc is -1. */
+static void draw_entry(geometry_pool & pool,
+                       const model_loader::entry & e, const glm::mat4 & placement,
+                       const model & placeholder,
+                       const glm::mat4 & projection, const glm::mat4 & view,
+                       GLint u_mvp_loc, GLint u_normal_mat_loc, bool depth_only)
 {
-  
-  std::vector<glm::vec3> coords;
-  std::vector<glm::vec3> normals;
-  std::vector<glm::vec2> tex_coords; // Texture coordinates are ignored in this example
-  
-  obj::obj_file f (filename);
-  std::cout << "File '" << filename << "' contains objects:" << std::endl;
-  for (std::string object : f.objects())
-    std::cout << "   " << object << std::endl;
-  std::cout << "Only the first is loaded" << std::endl;
-  f.get_object(f.objects().front(), coords, normals, tex_coords);
+  if(e.failed) return;
 
-  return model_from_data(coords,normals);
-}
+  bool has_chunks = not e.chunks.empty();
+  const model & m = e.ready or has_chunks ? e.m : placeholder;
+  glm::mat4 transform = placement * e.m.transform;
+  if(not e.ready and not has_chunks and e.parsed){
+    // The cube goes from -1 to 1, make it match the bounding box
+    glm::vec3 center = (e.bounds.min + e.bounds.max) / 2.f;
+    glm::vec3 half_size = glm::max((e.bounds.max - e.bounds.min) / 2.f, glm::vec3(1e-3f));
+    transform = transform * glm::translate(center) * glm::scale(half_size);
+  }
 
-/* This function just renders a model */
-static void render_model(const model & m)
-{
-  if(m.vertex_array and m.position_buffer and m.vertices){
-    glBindVertexArray(m.vertex_array);
-    glDrawArrays(GL_TRIANGLES,0,m.vertices);
-    glBindVertexArray(0);
+  glm::mat4 mvp = projection*view*transform;
+  glUniformMatrix4fv(u_mvp_loc,1,GL_FALSE,glm::value_ptr(mvp));
+
+  if(u_normal_mat_loc >= 0){
+    glm::mat3 nm = normal_matrix(view, transform);
+    glUniformMatrix3fv(u_normal_mat_loc,1,GL_FALSE,glm::value_ptr(nm));
+  }
+
+  if(has_chunks){
+    for(const model & c : e.chunks)
+      pool.draw(c, depth_only);
   }else{
-    std::cerr << "Attempt to render an invalid model" << std::endl;
+    pool.draw(m, depth_only);
   }
 }
 
 /* This function gets called in the game loop.
- * All the drawing is done here. */
-static void render(const glm::mat4 & projection, const glm::mat4 & view)
+ * All the drawing is done here.
+ * With depth_prepass the models are drawn twice: first only their depth,
+ * with a program that only has the position (depth.vert), and then with
+ * shade.frag but only where the depth is equal, so the shading runs once
+ * per pixel however many models overlap.
+ * With lights, binned and uploaded for this camera, the models are shaded by
+ * clustered.frag with those lights instead of shade.frag.
+ * Returns true if it has to be called again, because models are still loading. */
+static bool render(model_loader & loader, const model_layout & layout,
+                   geometry_pool & pool, geometry_pager * pager,
+                   const glm::mat4 & projection, const glm::mat4 & view, bool depth_prepass,
+                   const light_clusters * lights)
 {
-  static model cube = load_model("../models/teapot.obj");
+  TRACE_FUNCTION();
+  static model cube = model_from_data(shapes::cube::positions, shapes::cube::normals);
   static GLuint program = shaders::build_program("./shade.vert","./shade.frag");
   static GLint u_mvp_loc = glGetUniformLocation(program, "u_mvp");
   static GLint u_normal_mat_loc = glGetUniformLocation(program, "u_normal_mat");
+  static GLuint depth_program = shaders::build_program("./depth.vert","./depth.frag");
+  static GLint u_depth_mvp_loc = glGetUniformLocation(depth_program, "u_mvp");
+  static GLuint lit_program = shaders::build_program("./shade.vert","./clustered.frag");
+  static GLint u_lit_mvp_loc = glGetUniformLocation(lit_program, "u_mvp");
+  static GLint u_lit_normal_mat_loc = glGetUniformLocation(lit_program, "u_normal_mat");
+
+  // A few megabytes of the models that are still loading go to the GPU
+  bool loading = loader.upload();
 
-  glUseProgram(program);
   glClearColor(0.2f,0.2f,0.25f,1.f);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  glm::mat4 mvp = projection*view*cube.transform;
-  glUniformMatrix4fv(u_mvp_loc,1,GL_FALSE,glm::value_ptr(mvp));
+  if(depth_prepass){
+    glUseProgram(depth_program);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    for(std::size_t i = 0; i < loader.entries().size(); ++i)
+      draw_entry(pool, loader.entries()[i], layout.placement(i), cube, projection, view,
+                 u_depth_mvp_loc, -1, true);
+    pool.end();
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthFunc(GL_EQUAL);
+    glDepthMask(GL_FALSE);
+  }
 
-  glm::mat3 nm = glm::transpose(glm::inverse(glm::mat3(view*cube.transform)));
-  glUniformMatrix3fv(u_normal_mat_loc,1,GL_FALSE,glm::value_ptr(nm));
-  
-  render_model(cube);   
+  GLint mvp_loc = u_mvp_loc, normal_mat_loc = u_normal_mat_loc;
+  if(lights){
+    glUseProgram(lit_program);
+    lights->bind(lit_program);
+    mvp_loc = u_lit_mvp_loc;
+    normal_mat_loc = u_lit_normal_mat_loc;
+  }else{
+    glUseProgram(program);
+  }
+
+  // Most models share the vertex array of the pool, it is bound once
+  for(std::size_t i = 0; i < loader.entries().size(); ++i)
+    draw_entry(pool, loader.entries()[i], layout.placement(i), cube, projection, view,
+               mvp_loc, normal_mat_loc, false);
+  pool.end();
+
+  if(depth_prepass){
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+  }
+
+  if(pager){
+    // Centered like the files of the loader
+    glm::mat4 transform = layout.graph.world(layout.root) * glm::translate(-pager->bounds().centroid);
+    glm::mat4 mvp = projection*view*transform;
+    loading = pager->update(mvp) or loading;
+    glUniformMatrix4fv(mvp_loc,1,GL_FALSE,glm::value_ptr(mvp));
+    glm::mat3 nm = normal_matrix(view, transform);
+    glUniformMatrix3fv(normal_mat_loc,1,GL_FALSE,glm::value_ptr(nm));
+    pager->draw();
+  }
+
+  return loading;
+}
+
+/* count point lights in a box of half side extent around the origin, each
+ * turning around the vertical axis at its own speed. Always the same ones
+ * for the same time. */
+static std::vector<light_clusters::light> moving_lights(std::size_t count, float extent, double time)
+{
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> position(-extent, extent);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  std::vector<light_clusters::light> lights(count);
+  for(light_clusters::light & l : lights){
+    glm::vec3 p(position(random), position(random), position(random));
+    float angle = float(std::fmod(time * (unit(random) - 0.5f), 2.0 * Pi));
+    float c = std::cos(angle), s = std::sin(angle);
+    l.position = glm::vec3(c*p.x - s*p.z, p.y, s*p.x + c*p.z);
+    l.radius = 0.5f + 0.5f * unit(random);
+    l.color = glm::vec3(unit(random), unit(random), unit(random));
+  }
+  return lights;
+}
+
+static void print_lights_stats(const light_clusters & lights)
+{
+  const light_clusters::statistics s = lights.stats();
+  std::cout << "Lights: " << s.in_view << " of " << s.lights << " in view, "
+            << s.used_clusters << " of " << s.clusters << " clusters lit, "
+            << s.average() << " lights per lit cluster (" << s.max_per_cluster << " at most), "
+            << s.bin_seconds*1e3 << " ms to bin" << std::endl;
+}
+
+static void print_pool_stats(const geometry_pool & pool)
+{
+  const geometry_pool::statistics s = pool.stats();
+  std::cout << "Pool: " << s.models << " models in " << s.blocks << " blocks, "
+            << s.vertices << "/" << s.vertex_capacity << " vertices, "
+            << s.indices << "/" << s.index_capacity << " indices ("
+            << 100.0 * s.utilization() << "% used), fragmentation "
+            << 100.0 * s.vertex_fragmentation << "% of the free vertices, "
+            << 100.0 * s.index_fragmentation << "% of the free indices, "
+            << s.binds << " binds for " << s.draws << " draws in the last frame" << std::endl;
+}
+
+static void print_pager_stats(const geometry_pager & pager)
+{
+  const geometry_pager::statistics & s = pager.stats();
+  std::cout << "Pager: " << pager.pages() << " pages of " << pager.page_bytes() / 1024
+            << " KB for " << pager.chunks() << " chunks, hit rate " << 100.0 * s.hit_rate()
+            << "%, " << s.uploads << " uploads (" << s.upload_bandwidth() / (1 << 20)
+            << " MB/s), " << s.evictions << " evictions, " << s.dropped << " dropped" << std::endl;
+}
+
+
+/* Sends p a pick of pixel (x, y) of the models that are ready, model i of
+ * the loader is object i + 1. Drawn after render(), with the same camera.
+ * Returns false if the picker has too many picks on their way. */
+static bool pick_models(picker & p, const model_loader & loader, const model_layout & layout,
+                        geometry_pool & pool, const glm::mat4 & view_projection,
+                        int width, int height, int x, int y)
+{
+  TRACE_FUNCTION();
+  if(not p.begin(width, height, x, y)) return false;
+  for(std::size_t i = 0; i < loader.entries().size(); ++i){
+    const model_loader::entry & e = loader.entries()[i];
+    // The triangles of a streamed file are counted per chunk, left out
+    if(not e.ready or not e.chunks.empty()) continue;
+    p.object(std::uint32_t(i + 1), view_projection * layout.placement(i) * e.m.transform);
+    pool.draw(e.m, true);
+  }
+  pool.end();
+  p.end();
+  return true;
+}
+
+/* The same pick with rays (common/ray_cast.hpp) through the copies of the
+ * meshes that the loader keeps for the CPU renderer. latency is the time the
+ * rays took. */
+static picker::result cast_models(const model_loader & loader, const model_layout & layout,
+                                  const glm::mat4 & view_projection,
+                                  int width, int height, int x, int y)
+{
+  auto start = std::chrono::steady_clock::now();
+  picker::result r;
+  r.x = x;
+  r.y = y;
+  util::ray_hit nearest;
+  for(std::size_t i = 0; i < loader.entries().size(); ++i){
+    const model_loader::entry & e = loader.entries()[i];
+    if(not e.ready or e.coords.empty()) continue;
+    glm::mat4 mvp = view_projection * layout.placement(i) * e.m.transform;
+    util::ray_hit h = util::cast(util::pixel_ray(mvp, x, y, width, height), e.coords, e.indices);
+    if(h.t < nearest.t){
+      nearest = h;
+      r.object = std::uint32_t(i + 1);
+      r.triangle = h.triangle;
+    }
+  }
+  r.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return r;
+}
+
+static void print_pick(const model_loader & loader, const char * what, const picker::result & r)
+{
+  std::cout << what << " pick of (" << r.x << ", " << r.y << "): ";
+  if(r.object)
+    std::cout << loader.entries()[r.object - 1].filename << ", triangle " << r.triangle;
+  else
+    std::cout << "nothing";
+  std::cout << ", " << r.latency*1e3 << " ms";
+  if(r.polls) std::cout << ", " << r.polls - 1 << " frames later";
+  std::cout << std::endl;
+}
+
+/* Same as render() but with the CPU. The picture is left in fb. */
+static bool render_cpu(model_loader & loader, const model_layout & layout,
+                       const glm::mat4 & projection, const glm::mat4 & view,
+                       raster::renderer & renderer, raster::framebuffer & fb)
+{
+  TRACE_FUNCTION();
+  bool loading = loader.upload();
+  renderer.begin(fb, glm::vec3(0.2f,0.2f,0.25f));
+  for(std::size_t i = 0; i < loader.entries().size(); ++i){
+    const model_loader::entry & e = loader.entries()[i];
+    glm::mat4 transform = layout.placement(i) * e.m.transform;
+    if(e.ready)
+      renderer.draw(e.coords, e.normals, e.indices, projection*view*transform,
+                    normal_matrix(view, transform));
+  }
+  renderer.finish();
+  return loading;
+}
+
+/* Shows a picture drawn by the CPU: it goes to a texture, which is copied to
+ * the window with glBlitFramebuffer (flipped, the first row is the top). */
+static void present_cpu(const raster::framebuffer & fb)
+{
+  static GLuint texture = 0, framebuffer = 0;
+  static int width = 0, height = 0;
+  if(!texture){
+    glGenTextures(1, &texture);
+    glGenFramebuffers(1, &framebuffer);
+  }
+  glBindTexture(GL_TEXTURE_2D, texture);
+  if(fb.width != width or fb.height != height){
+    width = fb.width;
+    height = fb.height;
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  }
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, fb.color.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+  glBlitFramebuffer(0, 0, width, height, 0, height, width, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
 }
 
 
@@ -189,6 +466,12 @@ static void size_callback(GLFWwindow* window,int,int){
   
   state.update_trackball();
   state.update_projection();
+  state.scheduler.request_redraw();
+}
+
+static void refresh_callback(GLFWwindow* window){
+  scene_state & state = *(scene_state*)glfwGetWindowUserPointer(window);
+  state.scheduler.request_redraw();
 }
 
 
@@ -197,6 +480,8 @@ static void mouse_button_callback(GLFWwindow* window,
                                   int button, int action, int mods)
 {
   scene_state & state = *(scene_state*)glfwGetWindowUserPointer(window);
+  // The moves before the click go with the buttons of before
+  state.apply_input();
   
   if (button == GLFW_MOUSE_BUTTON_LEFT){
     if(action == GLFW_PRESS)
@@ -207,23 +492,28 @@ static void mouse_button_callback(GLFWwindow* window,
   else if (button == GLFW_MOUSE_BUTTON_RIGHT){
     state.displacing = (action == GLFW_PRESS);
   }
+  else if (button == GLFW_MOUSE_BUTTON_MIDDLE and action == GLFW_PRESS){
+    // The mouse is in window coordinates, the pixels can be smaller
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    state.picking = true;
+    state.pick_x = int(state.mouse_pos.x * state.width / width);
+    state.pick_y = state.height - 1 - int(state.mouse_pos.y * state.height / height);
+    state.scheduler.request_redraw();
+  }
   
 }
 
 static void mouse_move_callback(GLFWwindow* window,
                                 double x, double y){
-  float translation_speed = 0.002;
   glm::vec2 mouse_pos(x,y);
   scene_state & state = *(scene_state*)glfwGetWindowUserPointer(window);
   
-  if(state.trackball.tracking()){
-    state.trackball.move(glm::vec2(x,y));
-  }
-  if(state.displacing){
-    glm::vec2 delta = mouse_pos - state.mouse_pos;
-    glm::vec3 up =  glm::vec3(0,1,0);
-    glm::vec3 right =  glm::vec3(-1,0,0);
-    state.camera_position += translation_speed * (up*delta.y + right*delta.x);
+  // Only stored, a fast mouse sends several of these per frame
+  state.cursor.move(mouse_pos);
+  if(state.trackball.tracking() or state.displacing){
+    state.latency.event();
+    state.scheduler.request_redraw();
   }
   state.mouse_pos = mouse_pos;
 }
@@ -234,26 +524,1042 @@ static void scroll_callback(GLFWwindow* window,double dx, double dy){
 
   state.fov = glm::clamp(state.fov+step*dy, 0.001, Pi - 0.1);
   state.update_projection();
+  state.latency.event();
+  state.scheduler.request_redraw();
 }
 
+static void key_callback(GLFWwindow* window, int key, int, int action, int)
+{
+  scene_state & state = *(scene_state*)glfwGetWindowUserPointer(window);
+  // T writes what the trace recorder has so far (see common/trace.hpp)
+  if (key == GLFW_KEY_T and action == GLFW_PRESS)
+    trace::dump("model_trace.json");
+  // C switches between OpenGL and the CPU renderer
+  if (key == GLFW_KEY_C and action == GLFW_PRESS){
+    if(not state.keep_geometry){
+      std::cout << "The CPU renderer needs the meshes, run with --with-cpu" << std::endl;
+      return;
+    }
+    state.cpu_backend = not state.cpu_backend;
+    std::cout << (state.cpu_backend ? "CPU" : "OpenGL") << " renderer" << std::endl;
+    state.scheduler.request_redraw();
+  }
+  // H switches the occlusion culling of --instances
+  if (key == GLFW_KEY_H and action == GLFW_PRESS){
+    state.occlusion = not state.occlusion;
+    std::cout << "Occlusion culling " << (state.occlusion ? "on" : "off") << std::endl;
+    state.scheduler.request_redraw();
+  }
+  // R turns the models or stops them
+  if (key == GLFW_KEY_R and action == GLFW_PRESS){
+    state.turning = not state.turning;
+    state.scheduler.request_redraw();
+  }
+  // L switches between one light and many
+  if (key == GLFW_KEY_L and action == GLFW_PRESS){
+    state.many_lights = not state.many_lights;
+    std::cout << (state.many_lights ? "Many lights" : "One light") << std::endl;
+    state.scheduler.request_redraw();
+  }
+  // I prints how long the input takes to be on the screen
+  if (key == GLFW_KEY_I and action == GLFW_PRESS){
+    state.latency.report(std::cout);
+    std::cout << state.cursor.events_per_update() << " cursor events per trackball update" << std::endl;
+  }
+  // Z switches the depth prepass
+  if (key == GLFW_KEY_Z and action == GLFW_PRESS){
+    state.depth_prepass = not state.depth_prepass;
+    std::cout << "Depth prepass " << (state.depth_prepass ? "on" : "off") << std::endl;
+    state.scheduler.request_redraw();
+  }
+}
 
 
-int main()
+/* Reads a file like model_loader does, for the modes that do not open a
+ * window */
+static bool read_model(const std::string & filename, obj::scene & s)
+{
+  try{
+    s = obj::read_scene(filename);
+  }catch(std::exception & e){
+    std::cerr << "Cannot load '" << filename << "': " << e.what() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/* The initial camera of the window, for a picture of the given size */
+static void camera_for(int width, int height, glm::mat4 & projection, glm::mat4 & view)
 {
   scene_state state;
+  state.width = width;
+  state.height = height;
+  state.update_projection();
+  projection = state.projection;
+  view = state.view();
+}
+
+/* Draws the model with the CPU and writes it to a file. No window needed. */
+static int cpu_render(const std::string & filename, const std::string & output,
+                      int width, int height)
+{
+  obj::scene s;
+  if(!read_model(filename, s)) return 1;
+  glm::mat4 projection, view;
+  camera_for(width, height, projection, view);
+  glm::mat4 transform = glm::translate(-s.bounds.centroid); // As model_loader
+
+  raster::renderer renderer;
+  raster::framebuffer fb;
+  fb.resize(width, height);
+  renderer.begin(fb, glm::vec3(0.2f,0.2f,0.25f));
+  renderer.draw(s.positions, s.normals, s.indices, projection*view*transform,
+                normal_matrix(view, transform));
+  renderer.finish();
+  if(!raster::write_ppm(output, fb)){
+    std::cerr << "Cannot write '" << output << "'" << std::endl;
+    return 1;
+  }
+  std::cout << "Wrote '" << output << "'" << std::endl;
+  return 0;
+}
+
+/* A framebuffer with color and depth renderbuffers of the given size, bound
+ * and with its viewport set, for the benchmarks */
+static void offscreen_target(int width, int height, GLuint & framebuffer, GLuint buffers[2])
+{
+  glGenFramebuffers(1, &framebuffer);
+  glGenRenderbuffers(2, buffers);
+  glBindRenderbuffer(GL_RENDERBUFFER, buffers[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, buffers[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, buffers[0]);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, buffers[1]);
+  glViewport(0, 0, width, height);
+}
+
+/* Milliseconds per frame of the CPU renderer and of OpenGL (whatever the
+ * driver is, llvmpipe on machines without a GPU) at 1080p and 4K.
+ * OpenGL draws to an offscreen framebuffer of the same size, glFinish waits
+ * until it is done. The best of FRAMES frames is taken for both. */
+static int raster_benchmark(const std::string & filename)
+{
+  const int FRAMES = 20;
+  obj::scene s;
+  if(!read_model(filename, s)) return 1;
+  std::cout << filename << ": " << s.indices.size()/3 << " triangles, "
+            << util::thread_pool::global().size() << " threads" << std::endl;
+
   if (!glfwInit())
     return 1;
-  
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
   glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
-  
-  GLFWwindow *window =
-    glfwCreateWindow(INITIAL_WIDTH, INITIAL_HEIGHT, "4. model", NULL, NULL);
+  glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+  GLFWwindow *window = glfwCreateWindow(64, 64, "4. model", NULL, NULL);
   if (!window){
     std::cerr << "glfw: Failed to create the window." << std::endl;
     glfwTerminate();
     return 1;
+  }
+  glfwMakeContextCurrent(window);
+  glewExperimental=true;
+  if (glewInit() != GLEW_OK){
+    std::cerr << "glew error" << std::endl;
+    return 1;
+  }
+  std::cout << "OpenGL: " << glGetString(GL_RENDERER) << std::endl;
+  glEnable(GL_CULL_FACE);
+  glEnable(GL_DEPTH_TEST);
+
+  model m = model_from_data(s.positions, s.normals, s.indices);
+  GLuint program = shaders::build_program("./shade.vert","./shade.frag");
+  GLint u_mvp_loc = glGetUniformLocation(program, "u_mvp");
+  GLint u_normal_mat_loc = glGetUniformLocation(program, "u_normal_mat");
+
+  raster::renderer renderer;
+  raster::framebuffer fb;
+  const int sizes[][2] = { {1920, 1080}, {3840, 2160} };
+  glm::mat4 transform = glm::translate(-s.bounds.centroid);
+  for(const int * size : sizes){
+    int width = size[0], height = size[1];
+    glm::mat4 projection, view;
+    camera_for(width, height, projection, view);
+    glm::mat4 mvp = projection*view*transform;
+    glm::mat3 nm = normal_matrix(view, transform);
+
+    fb.resize(width, height);
+    double cpu = 1e30;
+    for(int i = 0; i < FRAMES; ++i){
+      auto start = std::chrono::steady_clock::now();
+      renderer.begin(fb, glm::vec3(0.2f,0.2f,0.25f));
+      renderer.draw(s.positions, s.normals, s.indices, mvp, nm);
+      renderer.finish();
+      cpu = std::min(cpu, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    GLuint framebuffer, buffers[2];
+    offscreen_target(width, height, framebuffer, buffers);
+    glUseProgram(program);
+    glUniformMatrix4fv(u_mvp_loc,1,GL_FALSE,glm::value_ptr(mvp));
+    glUniformMatrix3fv(u_normal_mat_loc,1,GL_FALSE,glm::value_ptr(nm));
+    double gl = 1e30;
+    for(int i = 0; i < FRAMES; ++i){
+      auto start = std::chrono::steady_clock::now();
+      glClearColor(0.2f,0.2f,0.25f,1.f);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      render_model(m);
+      glFinish();
+      gl = std::min(gl, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(2, buffers);
+
+    std::cout << width << "x" << height << ": CPU " << cpu*1e3 << " ms, OpenGL "
+              << gl*1e3 << " ms (" << renderer.last_stats().binned << " triangles after culling, "
+              << renderer.last_stats().bin_entries << " bin entries)" << std::endl;
+  }
+  release_model(m);
+  glDeleteProgram(program);
+  glfwTerminate();
+  return 0;
+}
+
+
+/* Picks PICKS random pixels of a 1080p frame of the model in three ways:
+ * with picker.hpp, drawing a frame after the pick until poll() has it, with
+ * the same pass read at once by glReadPixels, which waits for the GPU, and
+ * with the rays of common/ray_cast.hpp. Prints the average cost of each on
+ * the CPU, how many frames the picker takes to answer and how often the GPU
+ * and the rays agree. */
+static int pick_benchmark(const std::string & filename)
+{
+  const int PICKS = 100;
+  const int WIDTH = 1920, HEIGHT = 1080;
+  obj::scene s;
+  if(!read_model(filename, s)) return 1;
+  std::cout << filename << ": " << s.indices.size()/3 << " triangles, "
+            << util::thread_pool::global().size() << " threads" << std::endl;
+
+  if (!glfwInit())
+    return 1;
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+  glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+  GLFWwindow *window = glfwCreateWindow(64, 64, "4. model", NULL, NULL);
+  if (!window){
+    std::cerr << "glfw: Failed to create the window." << std::endl;
+    glfwTerminate();
+    return 1;
+  }
+  glfwMakeContextCurrent(window);
+  glewExperimental=true;
+  if (glewInit() != GLEW_OK){
+    std::cerr << "glew error" << std::endl;
+    return 1;
+  }
+  std::cout << "OpenGL: " << glGetString(GL_RENDERER) << std::endl;
+  glEnable(GL_CULL_FACE);
+  glEnable(GL_DEPTH_TEST);
+
+  {
+    model m = model_from_data(s.positions, s.normals, s.indices);
+    GLuint program = shaders::build_program("./shade.vert","./shade.frag");
+    GLint u_mvp_loc = glGetUniformLocation(program, "u_mvp");
+    GLint u_normal_mat_loc = glGetUniformLocation(program, "u_normal_mat");
+    picker p;
+
+    glm::mat4 projection, view;
+    camera_for(WIDTH, HEIGHT, projection, view);
+    glm::mat4 transform = glm::translate(-s.bounds.centroid);
+    glm::mat4 mvp = projection*view*transform;
+    glm::mat3 nm = normal_matrix(view, transform);
+    GLuint framebuffer, buffers[2];
+    offscreen_target(WIDTH, HEIGHT, framebuffer, buffers);
+    auto frame = [&]{
+      glUseProgram(program);
+      glUniformMatrix4fv(u_mvp_loc,1,GL_FALSE,glm::value_ptr(mvp));
+      glUniformMatrix3fv(u_normal_mat_loc,1,GL_FALSE,glm::value_ptr(nm));
+      glClearColor(0.2f,0.2f,0.25f,1.f);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      render_model(m);
+      glFlush();
+    };
+    auto pick_pass = [&](int x, int y){
+      p.begin(WIDTH, HEIGHT, x, y);
+      p.object(1, mvp);
+      render_model(m);
+    };
+
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> pixel_x(0, WIDTH - 1), pixel_y(0, HEIGHT - 1);
+    double submit = 0., latency = 0., stall = 0., rays = 0.;
+    int frames = 0, max_frames = 0, hits = 0, agree = 0;
+    for(int i = 0; i < PICKS; ++i){
+      int x = pixel_x(random), y = pixel_y(random);
+      frame();
+
+      // Asynchronous: the pass and the copy to the pixel buffer, then frames
+      // until the answer is there
+      auto start = std::chrono::steady_clock::now();
+      pick_pass(x, y);
+      p.end();
+      submit += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      picker::result gpu;
+      while(not p.poll(gpu)) frame();
+      latency += gpu.latency;
+      frames += gpu.polls - 1;
+      max_frames = std::max(max_frames, gpu.polls - 1);
+
+      // Synchronous: the same pass read right away
+      frame();
+      start = std::chrono::steady_clock::now();
+      pick_pass(x, y);
+      GLuint pixel[2];
+      glReadPixels(0, 0, 1, 1, GL_RG_INTEGER, GL_UNSIGNED_INT, pixel);
+      stall += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      p.end();
+      while(not p.poll(gpu)) frame();
+
+      start = std::chrono::steady_clock::now();
+      util::ray_hit cpu = util::cast(util::pixel_ray(mvp, x, y, WIDTH, HEIGHT), s.positions, s.indices);
+      rays += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      hits += cpu.hit();
+      agree += cpu.hit() ? pixel[0] == 1 and pixel[1] == cpu.triangle : pixel[0] == 0;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(2, buffers);
+    release_model(m);
+    glDeleteProgram(program);
+
+    std::cout << PICKS << " picks, " << hits << " on the model:" << std::endl
+              << "  Pixel buffer: " << submit/PICKS*1e3 << " ms to send, answer after "
+              << double(frames)/PICKS << " frames (" << max_frames << " at most), "
+              << latency/PICKS*1e3 << " ms" << std::endl
+              << "  glReadPixels: " << stall/PICKS*1e3 << " ms waiting for the GPU" << std::endl
+              << "  Rays:         " << rays/PICKS*1e3 << " ms" << std::endl
+              << "  The GPU and the rays agree on " << agree << " of " << PICKS << std::endl;
+  }
+  glfwTerminate();
+  return 0;
+}
+
+
+/* The model lit by more and more point lights at the same density, so
+ * that about as many reach each pixel: the volume of the lights grows with
+ * their number. Prints how long the binning takes with all the threads and
+ * with one, and how long OpenGL takes to draw a 1080p frame with the
+ * clusters and with a single cluster where every pixel loops over all the
+ * lights in view. The best of FRAMES frames is taken. */
+static int lights_benchmark(const std::string & filename)
+{
+  const int FRAMES = 10;
+  const int WIDTH = 1920, HEIGHT = 1080;
+  obj::scene s;
+  if(!read_model(filename, s)) return 1;
+
+  if (!glfwInit())
+    return 1;
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+  glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+  GLFWwindow *window = glfwCreateWindow(64, 64, "4. model", NULL, NULL);
+  if (!window){
+    std::cerr << "glfw: Failed to create the window." << std::endl;
+    glfwTerminate();
+    return 1;
+  }
+  glfwMakeContextCurrent(window);
+  glewExperimental=true;
+  if (glewInit() != GLEW_OK){
+    std::cerr << "glew error" << std::endl;
+    return 1;
+  }
+  std::cout << "OpenGL: " << glGetString(GL_RENDERER) << ", "
+            << util::thread_pool::global().size() << " threads" << std::endl;
+  glEnable(GL_CULL_FACE);
+  glEnable(GL_DEPTH_TEST);
+
+  {
+    model m = model_from_data(s.positions, s.normals, s.indices);
+    GLuint program = shaders::build_program("./shade.vert","./clustered.frag");
+    GLint u_mvp_loc = glGetUniformLocation(program, "u_mvp");
+    GLint u_normal_mat_loc = glGetUniformLocation(program, "u_normal_mat");
+    GLuint framebuffer, buffers[2];
+    offscreen_target(WIDTH, HEIGHT, framebuffer, buffers);
+
+    glm::mat4 projection, view;
+    camera_for(WIDTH, HEIGHT, projection, view);
+    glm::mat4 transform = glm::translate(-s.bounds.centroid);
+    glUseProgram(program);
+    glm::mat4 mvp = projection*view*transform;
+    glUniformMatrix4fv(u_mvp_loc,1,GL_FALSE,glm::value_ptr(mvp));
+    glm::mat3 nm = normal_matrix(view, transform);
+    glUniformMatrix3fv(u_normal_mat_loc,1,GL_FALSE,glm::value_ptr(nm));
+
+    util::thread_pool one_thread(1);
+    light_clusters clustered, serial(light_clusters::options(), one_thread);
+    light_clusters::options single;
+    single.tiles_x = single.tiles_y = single.slices = 1;
+    light_clusters all(single);
+
+    // Best time of FRAMES draws with some lights
+    auto draw = [&](light_clusters & lights){
+      lights.upload();
+      lights.bind(program);
+      double best = 1e30;
+      for(int frame = 0; frame < FRAMES; ++frame){
+        auto start = std::chrono::steady_clock::now();
+        glClearColor(0.2f,0.2f,0.25f,1.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        render_model(m);
+        glFinish();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+      }
+      return best;
+    };
+    // Best time of FRAMES binnings
+    auto bin = [&](light_clusters & lights, const std::vector<light_clusters::light> & l){
+      double best = 1e30;
+      for(int frame = 0; frame < FRAMES; ++frame){
+        lights.bin(l, view, projection, WIDTH, HEIGHT);
+        best = std::min(best, lights.stats().bin_seconds);
+      }
+      return best;
+    };
+
+    for(std::size_t count : { 256, 1024, 4096, 16384 }){
+      std::vector<light_clusters::light> l = moving_lights(count, 2.f * std::cbrt(count / 256.f), 0.0);
+      double bin_serial = bin(serial, l);
+      double bin_parallel = bin(clustered, l);
+      bin(all, l);
+      double gl_clustered = draw(clustered);
+      double gl_all = draw(all);
+      const light_clusters::statistics st = clustered.stats();
+      std::cout << count << " lights, " << st.in_view << " in view, " << st.average()
+                << " per lit cluster (" << st.max_per_cluster << " at most):" << std::endl
+                << "  binning: " << bin_parallel*1e3 << " ms, " << bin_serial*1e3
+                << " ms with one thread" << std::endl
+                << "  OpenGL: " << gl_clustered*1e3 << " ms clustered, " << gl_all*1e3
+                << " ms with all the lights in view, " << gl_all / gl_clustered << "x" << std::endl;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(2, buffers);
+    release_model(m);
+    glDeleteProgram(program);
+  }
+  glfwTerminate();
+  return 0;
+}
+
+/* Creates a window, shown or hidden (for the benchmarks), with an OpenGL 4.3
+ * context or newer, for the modes that use instance_renderer. nullptr if
+ * there is none. */
+static GLFWwindow * create_gl43_window(int width, int height, bool visible)
+{
+  glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_VISIBLE, visible ? GL_TRUE : GL_FALSE);
+  const int versions[][2] = { {4, 5}, {4, 3} };
+  for(const int * version : versions){
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, version[0]);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, version[1]);
+    if(GLFWwindow * window = glfwCreateWindow(width, height, "4. model", NULL, NULL))
+      return window;
+  }
+  std::cerr << "glfw: Failed to create an OpenGL 4.3 window." << std::endl;
+  return nullptr;
+}
+
+/* render() for --instances: draws in target, where the depth pyramid can
+ * read the depth, and copies it to the window.
+ * Returns true if it has to be called again: what was hidden from the
+ * previous camera can be in view from this one, the next frame tests it
+ * against the depth of this one. */
+static bool render_instances(instance_scene & scene, render_target & target,
+                             const scene_state & state)
+{
+  TRACE_FUNCTION();
+  bool moved = scene.pyramid.view_projection() != state.projection * state.view();
+  target.resize(state.width, state.height);
+  target.bind();
+  glClearColor(0.2f,0.2f,0.25f,1.f);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  scene.occlusion = state.occlusion;
+  scene.depth_prepass = state.depth_prepass;
+  scene.draw(state.view(), state.projection, target);
+  target.present(state.width, state.height);
+  return scene.occlusion and moved;
+}
+
+static void print_instance_stats(const instance_scene & scene)
+{
+  const instance_renderer::statistics s = scene.renderer.stats();
+  std::cout << "Instances: " << s.drawn() << " of " << s.instances << " drawn, "
+            << s.frustum_culled << " out of the frustum, " << s.occluded << " occluded, "
+            << s.gpu_seconds*1e3 << " ms of GPU";
+  if(scene.pyramid.ready())
+    std::cout << " + " << scene.pyramid.gpu_seconds()*1e3 << " ms for the depth pyramid";
+  std::cout << std::endl;
+}
+
+/* Many copies of a model (instance_scene.hpp), drawn the way render() does
+ * it, with the frustum culling on the CPU and one draw call per model, and
+ * with instance_renderer, where a compute shader culls and writes the draw
+ * commands, without and with occlusion culling. Prints how long the CPU
+ * takes to send a frame and how long until it is drawn, and the GPU time.
+ * Needs OpenGL 4.3, llvmpipe has 4.5. */
+static int instances_benchmark(const std::string & filename)
+{
+  const int FRAMES = 10;
+  const int WIDTH = 1920, HEIGHT = 1080;
+  obj::scene s;
+  if(!read_model(filename, s)) return 1;
+
+  if (!glfwInit())
+    return 1;
+  GLFWwindow *window = create_gl43_window(64, 64, false);
+  if (!window){
+    glfwTerminate();
+    return 1;
+  }
+  glfwMakeContextCurrent(window);
+  glewExperimental=true;
+  if (glewInit() != GLEW_OK or not instance_renderer::supported()){
+    std::cerr << "OpenGL 4.3 is needed" << std::endl;
+    glfwTerminate();
+    return 1;
+  }
+  std::cout << "OpenGL: " << glGetString(GL_RENDERER) << ", "
+            << glGetString(GL_VERSION) << std::endl;
+  glEnable(GL_CULL_FACE);
+  glEnable(GL_DEPTH_TEST);
+
+  {
+    instance_scene scene(s);
+    GLuint program = shaders::build_program("./shade.vert","./shade.frag");
+    GLint u_mvp_loc = glGetUniformLocation(program, "u_mvp");
+    GLint u_normal_mat_loc = glGetUniformLocation(program, "u_normal_mat");
+    render_target target;
+    target.resize(WIDTH, HEIGHT);
+    target.bind();
+
+    // Times a way of drawing a frame, the best of FRAMES
+    struct timing { double submit = 1e30, frame = 1e30; };
+    auto measure = [&](const std::function<void()> & draw){
+      timing t;
+      for(int frame = 0; frame < FRAMES; ++frame){
+        auto start = std::chrono::steady_clock::now();
+        glClearColor(0.2f,0.2f,0.25f,1.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        draw();
+        auto sent = std::chrono::steady_clock::now();
+        glFinish();
+        auto end = std::chrono::steady_clock::now();
+        t.submit = std::min(t.submit, std::chrono::duration<double>(sent - start).count());
+        t.frame = std::min(t.frame, std::chrono::duration<double>(end - start).count());
+      }
+      return t;
+    };
+
+    for(std::size_t count : { 10000, 100000 }){
+      scene.place(count);
+      // From inside the cube of instances: part of them are behind the
+      // camera or out of the sides, many are hidden by nearer ones
+      int side = int(std::ceil(std::cbrt(double(count))));
+      glm::mat4 projection = glm::perspective(Pi/4.f, float(WIDTH)/HEIGHT, 0.1f, 1000.f);
+      glm::mat4 view = glm::lookAt(glm::vec3(0.f, 0.f, scene.spacing * side / 4.f),
+                                   glm::vec3(0.f), glm::vec3(0.f, 1.f, 0.f));
+      glm::mat4 view_projection = projection * view;
+
+      std::size_t cpu_visible = 0;
+      timing cpu = measure([&]{
+        glUseProgram(program);
+        glm::vec4 planes[6];
+        instance_renderer::frustum_planes(view_projection, planes);
+        cpu_visible = 0;
+        for(std::size_t i = 0; i < count; ++i){
+          if(not instance_renderer::in_frustum(planes, scene.world_spheres[i])) continue;
+          const glm::mat4 & transform = scene.instances[i].transform;
+          glm::mat4 mvp = view_projection * transform;
+          glUniformMatrix4fv(u_mvp_loc,1,GL_FALSE,glm::value_ptr(mvp));
+          glm::mat3 nm = normal_matrix(view, transform);
+          glUniformMatrix3fv(u_normal_mat_loc,1,GL_FALSE,glm::value_ptr(nm));
+          scene.pool.draw(scene.meshes[scene.instances[i].mesh]);
+          ++cpu_visible;
+        }
+        scene.pool.end();
+      });
+
+      scene.occlusion = false;
+      timing gpu = measure([&]{ scene.draw(view, projection, target); });
+      instance_renderer::statistics frustum = scene.renderer.stats();
+
+      // The first frame has no pyramid yet
+      scene.occlusion = true;
+      scene.draw(view, projection, target);
+      timing hiz = measure([&]{ scene.draw(view, projection, target); });
+      instance_renderer::statistics occlusion = scene.renderer.stats();
+      double pyramid = scene.pyramid.gpu_seconds();
+
+      std::cout << count << " instances, " << cpu_visible << " in the frustum, "
+                << occlusion.occluded << " of them occluded:" << std::endl
+                << "  CPU culling, a draw call each: " << cpu.submit*1e3 << " ms to send, "
+                << cpu.frame*1e3 << " ms a frame" << std::endl
+                << "  GPU frustum culling:           " << gpu.submit*1e3 << " ms to send, "
+                << gpu.frame*1e3 << " ms a frame, " << frustum.gpu_seconds*1e3
+                << " ms of GPU (" << frustum.drawn() << " drawn)" << std::endl
+                << "  GPU frustum and Hi-Z culling:  " << hiz.submit*1e3 << " ms to send, "
+                << hiz.frame*1e3 << " ms a frame, " << occlusion.gpu_seconds*1e3
+                << " ms of GPU + " << pyramid*1e3 << " ms for the pyramid ("
+                << occlusion.drawn() << " drawn), "
+                << (frustum.gpu_seconds - occlusion.gpu_seconds - pyramid)*1e3
+                << " ms of GPU saved" << std::endl;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteProgram(program);
+  }
+  glfwTerminate();
+  return 0;
+}
+
+/* Many overlapping copies of a model filling the screen, drawn by
+ * instance_renderer without and with the depth prepass. Without it most
+ * pixels are shaded several times, by each copy that is nearer than the ones
+ * drawn before; with it only once, for the price of drawing the vertices
+ * twice. Prints the frame and GPU times of both and the speedup.
+ * Needs OpenGL 4.3. */
+static int prepass_benchmark(const std::string & filename)
+{
+  const int FRAMES = 10;
+  const int WIDTH = 1920, HEIGHT = 1080;
+  obj::scene s;
+  if(!read_model(filename, s)) return 1;
+
+  if (!glfwInit())
+    return 1;
+  GLFWwindow *window = create_gl43_window(64, 64, false);
+  if (!window){
+    glfwTerminate();
+    return 1;
+  }
+  glfwMakeContextCurrent(window);
+  glewExperimental=true;
+  if (glewInit() != GLEW_OK or not instance_renderer::supported()){
+    std::cerr << "OpenGL 4.3 is needed" << std::endl;
+    glfwTerminate();
+    return 1;
+  }
+  std::cout << "OpenGL: " << glGetString(GL_RENDERER) << ", "
+            << glGetString(GL_VERSION) << std::endl;
+  glEnable(GL_CULL_FACE);
+  glEnable(GL_DEPTH_TEST);
+
+  {
+    instance_scene scene(s);
+    scene.occlusion = false;
+    render_target target;
+    target.resize(WIDTH, HEIGHT);
+    target.bind();
+
+    for(std::size_t count : { 216, 1000 }){
+      // Radius 1 and a third of it apart: from the front a pixel is covered
+      // by about as many copies as there are in a row of the cube
+      scene.place(count, 1.f / 3.f);
+      int side = int(std::ceil(std::cbrt(double(count))));
+      float size = scene.spacing * side + 2.f;
+      glm::mat4 projection = glm::perspective(Pi/4.f, float(WIDTH)/HEIGHT, 0.1f, 1000.f);
+      glm::mat4 view = glm::lookAt(glm::vec3(0.f, 0.f, 1.5f * size),
+                                   glm::vec3(0.f), glm::vec3(0.f, 1.f, 0.f));
+
+      double frame[2] = { 1e30, 1e30 }, gpu[2] = { 1e30, 1e30 };
+      for(int prepass = 0; prepass < 2; ++prepass){
+        scene.depth_prepass = prepass == 1;
+        for(int f = 0; f < FRAMES; ++f){
+          auto start = std::chrono::steady_clock::now();
+          glClearColor(0.2f,0.2f,0.25f,1.f);
+          glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+          scene.draw(view, projection, target);
+          glFinish();
+          auto end = std::chrono::steady_clock::now();
+          frame[prepass] = std::min(frame[prepass], std::chrono::duration<double>(end - start).count());
+          gpu[prepass] = std::min(gpu[prepass], scene.renderer.stats().gpu_seconds);
+        }
+      }
+
+      std::cout << count << " instances, " << side << " deep:" << std::endl
+                << "  Without prepass: " << frame[0]*1e3 << " ms a frame, "
+                << gpu[0]*1e3 << " ms of GPU" << std::endl
+                << "  With prepass:    " << frame[1]*1e3 << " ms a frame, "
+                << gpu[1]*1e3 << " ms of GPU" << std::endl
+                << "  Speedup " << gpu[0] / gpu[1] << "x on the GPU, "
+                << frame[0] / frame[1] << "x a frame" << std::endl;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+  glfwTerminate();
+  return 0;
+}
+
+/* The matrices of count instances computed like draw_entry() does, one
+ * glm::mat4 product and one glm::inverse at a time, and with
+ * util::batch_transform (common/batch_transform.hpp) on one thread and on
+ * all of them, into memory and into a mapped OpenGL buffer. Prints the best
+ * of RUNS and the largest difference with glm. */
+static int transform_benchmark(std::size_t count)
+{
+  const int RUNS = 10;
+  glm::mat4 projection, view;
+  camera_for(1920, 1080, projection, view);
+  glm::mat4 view_projection = projection * view;
+
+  // Turned, scaled and moved like the instances of instance_scene
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  std::vector<glm::mat4> transforms(count);
+  util::transform_array soa;
+  soa.resize(count);
+  for(std::size_t i = 0; i < count; ++i){
+    glm::vec3 axis = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) + glm::vec3(0.1f));
+    transforms[i] = glm::translate(glm::vec3(unit(random), unit(random), unit(random)) * 100.f) *
+      glm::rotate(unit(random) * 2.f * Pi, axis) * glm::scale(glm::vec3(0.5f + unit(random)));
+    soa.set(i, transforms[i]);
+  }
+
+  auto best = [&](const std::function<void()> & f){
+    double seconds = 1e30;
+    for(int run = 0; run < RUNS; ++run){
+      auto start = std::chrono::steady_clock::now();
+      f();
+      seconds = std::min(seconds, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return seconds;
+  };
+  std::vector<util::instance_matrices> reference(count), out(count);
+  // Largest difference with the glm loop, relative to the size of the value
+  auto error = [&](const util::instance_matrices * m){
+    float worst = 0.f;
+    for(std::size_t i = 0; i < count; ++i){
+      const float * a = &m[i].mvp[0][0];
+      const float * b = &reference[i].mvp[0][0];
+      for(int e = 0; e < 28; ++e)
+        worst = std::max(worst, std::abs(a[e] - b[e]) / (1.f + std::abs(b[e])));
+    }
+    return worst;
+  };
+
+  double scalar = best([&]{
+    for(std::size_t i = 0; i < count; ++i){
+      reference[i].mvp = view_projection * transforms[i];
+      glm::mat3 nm = normal_matrix(view, transforms[i]);
+      for(int c = 0; c < 3; ++c)
+        reference[i].normal[c] = glm::vec4(nm[c][0], nm[c][1], nm[c][2], 0.f);
+    }
+  });
+  util::thread_pool one_thread(1);
+  double simd = best([&]{ util::batch_transform(view_projection, view, soa, out.data(), one_thread); });
+  float simd_error = error(out.data());
+  double threads = best([&]{ util::batch_transform(view_projection, view, soa, out.data()); });
+
+  std::cout << count << " instances, " << util::thread_pool::global().size() << " threads, "
+            << util::batch_simd() << std::endl;
+  std::cout << "  glm, one at a time:   " << scalar*1e3 << " ms" << std::endl
+            << "  batch, one thread:    " << simd*1e3 << " ms, " << scalar / simd << "x" << std::endl
+            << "  batch, all threads:   " << threads*1e3 << " ms, " << scalar / threads << "x" << std::endl
+            << "  largest difference with glm: " << simd_error << std::endl;
+
+  if (!glfwInit())
+    return 1;
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+  glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+  GLFWwindow *window = glfwCreateWindow(64, 64, "4. model", NULL, NULL);
+  if (!window){
+    std::cerr << "glfw: Failed to create the window, no mapped buffer." << std::endl;
+    glfwTerminate();
+    return 0;
+  }
+  glfwMakeContextCurrent(window);
+  glewExperimental=true;
+  if (glewInit() != GLEW_OK){
+    std::cerr << "glew error" << std::endl;
+    return 1;
+  }
+  GLuint buffer;
+  glGenBuffers(1, &buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  GLsizeiptr bytes = GLsizeiptr(sizeof(util::instance_matrices) * count);
+  glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+  double mapped = best([&]{
+    // The old contents are not needed, the driver can give new memory
+    void * p = glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if(not p) return;
+    util::batch_transform(view_projection, view, soa, static_cast<util::instance_matrices*>(p));
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  });
+  glGetBufferSubData(GL_ARRAY_BUFFER, 0, bytes, out.data());
+  float mapped_error = error(out.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDeleteBuffers(1, &buffer);
+  std::cout << "  batch into a mapped buffer: " << mapped*1e3 << " ms, " << scalar / mapped
+            << "x, largest difference " << mapped_error << " (" << glGetString(GL_RENDERER) << ")" << std::endl;
+  glfwTerminate();
+  return 0;
+}
+
+/* A scene graph of a root, 100 groups, 100 subgroups in each and 100
+ * leaves in each subgroup (a million nodes), updated after changing all of
+ * it, a group, a leaf and a thousand leaves here and there. The update is
+ * compared with recomputing every world matrix, what a scene without dirty
+ * flags would do. Prints the best of RUNS. */
+static int scene_benchmark()
+{
+  const int RUNS = 10;
+  const int FANOUT = 100;
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  auto some_transform = [&]{
+    return glm::translate(glm::vec3(unit(random), unit(random), unit(random))) *
+      glm::rotate(unit(random), glm::vec3(0.f, 1.f, 0.f));
+  };
+
+  util::scene_graph graph;
+  util::scene_graph::node root = graph.add(util::scene_graph::none);
+  std::vector<util::scene_graph::node> groups, leaves;
+  for(int g = 0; g < FANOUT; ++g){
+    groups.push_back(graph.add(root, some_transform()));
+    for(int s = 0; s < FANOUT; ++s){
+      util::scene_graph::node subgroup = graph.add(groups.back(), some_transform());
+      for(int l = 0; l < FANOUT; ++l)
+        leaves.push_back(graph.add(subgroup, some_transform()));
+    }
+  }
+  graph.update();
+  std::cout << graph.size() << " nodes, " << util::thread_pool::global().size() << " threads" << std::endl;
+
+  // Every world matrix again, parents first
+  std::vector<util::scene_graph::node> parents(graph.size());
+  std::vector<glm::mat4> locals(graph.size()), worlds(graph.size());
+  for(util::scene_graph::node n = 0; n < graph.size(); ++n){
+    parents[n] = graph.parent(n);
+    locals[n] = graph.local(n);
+  }
+
+  auto best = [&](const std::function<void()> & change){
+    double seconds = 1e30;
+    for(int run = 0; run < RUNS; ++run){
+      change();
+      auto start = std::chrono::steady_clock::now();
+      graph.update();
+      seconds = std::min(seconds, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return seconds;
+  };
+  auto print = [&](const char * what, double seconds){
+    const util::scene_graph::statistics & st = graph.stats();
+    std::cout << "  " << what << seconds*1e3 << " ms, " << st.updated << " nodes updated from "
+              << st.roots << " roots in " << st.tasks << " tasks" << std::endl;
+  };
+
+  double everything = 1e30;
+  for(int run = 0; run < RUNS; ++run){
+    auto start = std::chrono::steady_clock::now();
+    for(std::size_t n = 0; n < worlds.size(); ++n)
+      worlds[n] = parents[n] == util::scene_graph::none ? locals[n] : worlds[parents[n]] * locals[n];
+    everything = std::min(everything, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::cout << "  all the nodes, one thread: " << everything*1e3 << " ms" << std::endl;
+
+  print("root moved:         ", best([&]{ graph.set_local(root, some_transform()); }));
+  print("a group moved:      ", best([&]{ graph.set_local(groups[random() % groups.size()], some_transform()); }));
+  print("a leaf moved:       ", best([&]{ graph.set_local(leaves[random() % leaves.size()], some_transform()); }));
+  print("1000 leaves moved:  ", best([&]{
+    for(int i = 0; i < 1000; ++i)
+      graph.set_local(leaves[random() % leaves.size()], some_transform());
+  }));
+  print("nothing moved:      ", best([]{}));
+  return 0;
+}
+
+/* Reads each file like model_loader does, and shows how long it took and
+ * how much memory */
+static int load_benchmark(const std::vector<std::string> & files)
+{
+  for(const std::string & filename : files){
+    std::size_t bytes = std::size_t(std::ifstream(filename, std::ios::binary | std::ios::ate).tellg());
+    bool peak_resident = util::reset_peak_resident();
+#ifdef GLOW_COUNT_ALLOCATIONS
+    util::heap_counters & heap = util::heap();
+    util::reset_heap_peak();
+    std::size_t allocations = heap.allocations, live = heap.live_bytes;
+#endif
+
+    auto start = std::chrono::steady_clock::now();
+    obj::scene s;
+    if(!read_model(filename, s)) return 1;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << filename << ": " << s.indices.size()/3 << " triangles, "
+              << s.positions.size() << " vertices, " << seconds*1e3 << " ms, "
+              << bytes / seconds / (1 << 20) << " MB/s, "
+#ifdef GLOW_COUNT_ALLOCATIONS
+              << heap.allocations - allocations << " allocations, "
+              << "heap peak " << (heap.peak_bytes - live) / double(1 << 20) << " MB";
+#else
+              << "allocations not counted (GLOW_COUNT_ALLOCATIONS)";
+#endif
+    if(peak_resident)
+      std::cout << ", peak resident memory " << util::peak_resident_bytes() / double(1 << 20) << " MB";
+    std::cout << std::endl;
+  }
+  return 0;
+}
+
+
+/* Streams an .obj file to a binary cache (common/obj_stream.hpp) that
+ * model_loader reads back chunk by chunk. Shows how much memory it took. */
+static int convert(const std::string & filename, const std::string & output)
+{
+  try{
+    auto start = std::chrono::steady_clock::now();
+    // Chunks that cover small parts of the space, for geometry_pager
+    obj::cache_writer cache(output);
+    obj::spatial_splitter split(cache);
+    obj::stream_stats stats = obj::stream_scene(filename, split);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote '" << output << "': " << stats.vertices << " vertices, "
+              << stats.triangles << " triangles, "
+              << seconds << " s, " << stats.bytes / seconds / (1 << 20) << " MB/s read, "
+              << "peak resident memory " << stats.peak_resident_bytes / (1 << 20) << " MB"
+              << std::endl;
+  }catch(std::exception & e){
+    std::cerr << "Cannot convert '" << filename << "': " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Usage:
+ *   model [files...]                   shows the models, by default the teapot
+ *                                      (.obj, or .mesh made with --convert)
+ *   model --with-cpu [files...]        the same, keeping a copy of the meshes
+ *                                      for the CPU renderer (C) and the rays
+ *   model --cpu file.ppm [model]       draws with the CPU, no window
+ *   model --bench-raster [model]       CPU renderer against OpenGL
+ *   model --bench-load [files...]      time, allocations and memory of
+ *                                      obj::read_scene
+ *   model --bench-instances [model]    10000 and 100000 copies of a model,
+ *                                      culled by the CPU or the GPU
+ *   model --bench-prepass [model]      overlapping copies of a model, without
+ *                                      and with the depth prepass
+ *   model --bench-pick [model]         picking with the GPU and with rays
+ *   model --bench-lights [model]       the model lit by 256 to 16384 lights,
+ *                                      with and without clusters
+ *   model --bench-transform [count]    matrices of count instances with glm
+ *                                      and with SIMD, 100000 by default
+ *   model --bench-scene                updates of a scene graph of a million
+ *                                      nodes
+ *   model --instances count [model]    shows copies of a model culled by the
+ *                                      GPU, H switches the occlusion culling
+ *   model --convert file.obj file.mesh streams a model to a binary cache
+ *   model --paged budget_mb file.mesh  draws a cache through geometry_pager,
+ *                                      with that much GPU memory
+ */
+int main(int argc, char ** argv)
+{
+  std::vector<std::string> args(argv+1, argv+argc);
+  if(not args.empty() and args[0] == "--cpu"){
+    if(args.size() < 2){
+      std::cerr << "Usage: model --cpu file.ppm [model.obj]" << std::endl;
+      return 1;
+    }
+    return cpu_render(args.size() > 2 ? args[2] : "../models/teapot.obj", args[1], 1920, 1080);
+  }
+  if(not args.empty() and args[0] == "--bench-instances")
+    return instances_benchmark(args.size() > 1 ? args[1] : "../models/arrow_low.obj");
+  if(not args.empty() and args[0] == "--bench-scene")
+    return scene_benchmark();
+  if(not args.empty() and args[0] == "--bench-transform")
+    return transform_benchmark(args.size() > 1 ? std::stoul(args[1]) : 100000);
+  if(not args.empty() and args[0] == "--bench-pick")
+    return pick_benchmark(args.size() > 1 ? args[1] : "../models/teapot.obj");
+  if(not args.empty() and args[0] == "--bench-lights")
+    return lights_benchmark(args.size() > 1 ? args[1] : "../models/teapot.obj");
+  if(not args.empty() and args[0] == "--bench-prepass")
+    return prepass_benchmark(args.size() > 1 ? args[1] : "../models/teapot.obj");
+  if(not args.empty() and args[0] == "--bench-load"){
+    std::vector<std::string> files(args.begin() + 1, args.end());
+    if(files.empty()) files.push_back("../models/teapot.obj");
+    return load_benchmark(files);
+  }
+  if(not args.empty() and args[0] == "--convert"){
+    if(args.size() < 3){
+      std::cerr << "Usage: model --convert model.obj model.mesh" << std::endl;
+      return 1;
+    }
+    return convert(args[1], args[2]);
+  }
+  if(not args.empty() and args[0] == "--bench-raster")
+    return raster_benchmark(args.size() > 1 ? args[1] : "../models/teapot.obj");
+  bool with_cpu = false;
+  if(not args.empty() and args[0] == "--with-cpu"){
+    with_cpu = true;
+    args.erase(args.begin());
+  }
+  std::string paged;
+  geometry_pager::options pager_options;
+  if(not args.empty() and args[0] == "--paged"){
+    if(args.size() < 3){
+      std::cerr << "Usage: model --paged budget_mb model.mesh" << std::endl;
+      return 1;
+    }
+    pager_options.budget = std::size_t(std::stoul(args[1])) << 20;
+    paged = args[2];
+    args.clear();
+  }
+  std::size_t instance_count = 0;
+  std::string instance_model = "../models/arrow_low.obj";
+  if(not args.empty() and args[0] == "--instances"){
+    if(args.size() < 2){
+      std::cerr << "Usage: model --instances count [model.obj]" << std::endl;
+      return 1;
+    }
+    instance_count = std::stoul(args[1]);
+    if(args.size() > 2) instance_model = args[2];
+    args.clear();
+  }
+
+  scene_state state;
+  state.keep_geometry = with_cpu;
+  if (!glfwInit())
+    return 1;
+  
+  GLFWwindow *window = nullptr;
+  if(instance_count){
+    window = create_gl43_window(INITIAL_WIDTH, INITIAL_HEIGHT, true);
+  }else{
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+    glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
+    window = glfwCreateWindow(INITIAL_WIDTH, INITIAL_HEIGHT, "4. model", NULL, NULL);
+    if (!window)
+      std::cerr << "glfw: Failed to create the window." << std::endl;
+  }
+  if (!window){
+    glfwTerminate();
+    return 1;
   }  
   glfwMakeContextCurrent(window);
   glfwSwapInterval(1); 
@@ -262,6 +1568,13 @@ int main()
   GLenum err = glewInit();
   if (GLEW_OK != err){
     std::cerr << "glew error: " << glewGetErrorString(err) << std::endl;
+    glfwTerminate();
+    return 1;
+  }
+  // --instances needs instance_renderer, checked before anything is made
+  if(instance_count and not instance_renderer::supported()){
+    std::cerr << "OpenGL 4.3 is needed" << std::endl;
+    glfwTerminate();
     return 1;
   }
 
@@ -274,14 +1587,135 @@ int main()
   glfwSetMouseButtonCallback(window, mouse_button_callback);
   glfwSetCursorPosCallback(window, mouse_move_callback);
   glfwSetScrollCallback(window, scroll_callback);
+  glfwSetKeyCallback(window, key_callback);
+  glfwSetWindowRefreshCallback(window, refresh_callback);
 
   size_callback(window,INITIAL_WIDTH,INITIAL_HEIGHT);  
+
+  std::vector<std::string> files = args;
+  if(files.empty() and paged.empty() and not instance_count)
+    files.push_back("../models/teapot.obj");
+
+  std::unique_ptr<instance_scene> instances;
+  render_target instance_target;
+  if(instance_count){
+    obj::scene s;
+    if(!read_model(instance_model, s)){
+      glfwTerminate();
+      return 1;
+    }
+    instances.reset(new instance_scene(s));
+    instances->place(instance_count);
+  }
+
+  std::unique_ptr<geometry_pager> pager;
+  if(not paged.empty()){
+    try{
+      pager.reset(new geometry_pager(paged, pager_options));
+    }catch(std::exception & e){
+      std::cerr << "Cannot page '" << paged << "': " << e.what() << std::endl;
+      glfwTerminate();
+      return 1;
+    }
+  }
+  auto last_stats = std::chrono::steady_clock::now();
+
+  // The models are placed in a grid, loaded in the background into the
+  // buffers of the pool
+  geometry_pool pool;
+  model_loader loader;
+  loader.pool = &pool;
+  loader.on_parsed = [&state]{ state.scheduler.wake(); };
+  loader.keep_geometry = state.keep_geometry;
+  raster::renderer cpu_renderer;
+  raster::framebuffer cpu_framebuffer;
+  model_layout layout;
+  int columns = std::ceil(std::sqrt(float(files.size())));
+  const float spacing = 3.f;
+  for(std::size_t i = 0; i < files.size(); ++i){
+    glm::vec3 position(spacing * (i % columns - (columns-1)/2.f),
+                       spacing * ((columns-1)/2.f - int(i / columns)), 0.f);
+    layout.models.push_back(layout.graph.add(layout.root, glm::translate(position)));
+    loader.load(files[i]);
+  }
+
+  // L lights the models with many point lights that turn around them
+  const std::size_t LIGHTS = 1024;
+  const float light_extent = spacing * columns / 2.f + 1.f;
+  light_clusters lights;
+
+  // The middle button picks a model with the GPU, the answer comes a frame
+  // or two later. The rays of the CPU answer at once, for comparison.
+  picker gpu_picker;
   
+  trace::thread_name("main");
+  bool was_loading = true;
   while(not glfwWindowShouldClose(window)){
-    glfwWaitEvents();
-    render(state.projection,state.view());
-    glfwSwapBuffers(window);
+    if(not state.scheduler.wait()) continue;
+    TRACE_SCOPE("frame");
+    state.latency.frame();
+    state.apply_input();
+    bool loading;
+    bool lit = false; // By the moving lights, that need the next frame
+    if(state.turning)
+      layout.graph.set_local(layout.root, glm::rotate(float(state.scheduler.time()) * 0.5f,
+                                                      glm::vec3(0.f, 1.f, 0.f)));
+    layout.graph.update(); // Only the nodes that changed
+    if(state.cpu_backend){
+      cpu_framebuffer.resize(state.width, state.height);
+      loading = render_cpu(loader, layout, state.projection, state.view(),
+                           cpu_renderer, cpu_framebuffer);
+      present_cpu(cpu_framebuffer);
+    }else if(instances){
+      loading = render_instances(*instances, instance_target, state);
+    }else{
+      pool.reset_counters();
+      lit = state.many_lights;
+      if(lit){
+        lights.bin(moving_lights(LIGHTS, light_extent, state.scheduler.time()),
+                   state.view(), state.projection, state.width, state.height);
+        lights.upload();
+      }
+      loading = render(loader,layout,pool,pager.get(),state.projection,state.view(),
+                       state.depth_prepass, lit ? &lights : nullptr);
+      if(was_loading and not loading)
+        print_pool_stats(pool);
+      was_loading = loading;
+    }
+    if(state.picking){
+      // The CPU renderer and --instances only have the rays, which need
+      // the copies of --with-cpu
+      glm::mat4 view_projection = state.projection * state.view();
+      bool gpu = not state.cpu_backend and not instances;
+      if(not gpu or pick_models(gpu_picker, loader, layout, pool, view_projection,
+                                state.width, state.height, state.pick_x, state.pick_y)){
+        state.picking = false;
+        if(state.keep_geometry)
+          print_pick(loader, "CPU", cast_models(loader, layout, view_projection, state.width,
+                                                state.height, state.pick_x, state.pick_y));
+      }
+    }
+    picker::result picked;
+    while(gpu_picker.poll(picked))
+      print_pick(loader, "GPU", picked);
+    if((pager or instances or lit) and
+       std::chrono::steady_clock::now() - last_stats > std::chrono::seconds(1)){
+      if(pager) print_pager_stats(*pager);
+      if(instances) print_instance_stats(*instances);
+      if(lit) print_lights_stats(lights);
+      last_stats = std::chrono::steady_clock::now();
+    }
+    if(loading or lit or state.turning or state.picking or gpu_picker.pending())
+      state.scheduler.request_redraw(); // Keep uploading, moving or picking
+    {
+      TRACE_SCOPE("swap");
+      glfwSwapBuffers(window);
+    }
+    state.scheduler.presented();
+    state.latency.presented();
   }
+  state.latency.report(std::cout);
+  trace::dump("model_trace.json");
   return 0;
 }
 
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+/* Indices of things passed to the vertex shader.*/
+static const int POSITION_INDEX = 0;
+static const int NORMAL_INDEX   = 1;
+
+/* Represents an oject in the scene */
+struct model
+{
+  model()
+  {
+    vertices        = 0;
+    vertex_array    = 0;
+    position_buffer = 0;
+    normal_buffer   = 0;
+    index_buffer    = 0;
+    indices         = 0;
+    base_vertex     = 0;
+    first_index     = 0;
+    pooled          = false;
+  }
+
+  /* Part of the indices drawn with the same material (see obj::submesh) */
+  struct range
+  {
+    GLuint first;
+    GLsizei count;
+  };
+
+  glm::mat4 transform;
+  GLuint vertex_array;
+  GLuint position_buffer;
+  GLuint normal_buffer;
+  GLuint index_buffer; // 0 for models drawn with glDrawArrays
+  int vertices;
+  int indices;
+  std::vector<range> ranges;
+  // Where the model starts in its buffers, which are shared by several
+  // models if pooled (see geometry_pool.hpp). The indices count from
+  // base_vertex.
+  GLint base_vertex;
+  GLuint first_index;
+  bool pooled; // Released by its geometry_pool, not release_model
+};
+
+
+/* Creates a model with room for the given number of vertices (and indices,
+ * if any), but does not fill the buffers. Used to upload the data in pieces
+ * (see model_loader.hpp).
+ */
+static model allocate_model(int vertices, int indices = 0)
+{
+  model m;
+
+  glGenBuffers(1,&m.position_buffer);
+  glGenBuffers(1,&m.normal_buffer);
+  glGenVertexArrays(1,&m.vertex_array);
+
+  glBindVertexArray(m.vertex_array);
+
+  // Positions
+  glBindBuffer(GL_ARRAY_BUFFER, m.position_buffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * vertices,
+               nullptr, GL_STATIC_DRAW);
+  glVertexAttribPointer(POSITION_INDEX, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+  glEnableVertexAttribArray(POSITION_INDEX);
+
+  // normals
+  glBindBuffer(GL_ARRAY_BUFFER, m.normal_buffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * vertices,
+               nullptr, GL_STATIC_DRAW);
+  glVertexAttribPointer(NORMAL_INDEX, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+  glEnableVertexAttribArray(NORMAL_INDEX);
+
+  // The index buffer binding is part of the vertex array too
+  if(indices){
+    glGenBuffers(1,&m.index_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(std::uint32_t) * indices,
+                 nullptr, GL_STATIC_DRAW);
+  }
+
+  m.vertices = vertices;
+  m.indices = indices;
+
+  glBindVertexArray(0);
+  return m;
+}
+
+/* Creates a model with given coordinates and normals.
+ * Very similar to the old create_cube_model
+ */
+static model model_from_data(const std::vector<glm::vec3> & coords,
+                             const std::vector<glm::vec3> & normals)
+{
+  model m = allocate_model(std::min(coords.size(),normals.size()));
+
+  glBindBuffer(GL_ARRAY_BUFFER, m.position_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::vec3) * m.vertices,
+                  coords.data());
+  glBindBuffer(GL_ARRAY_BUFFER, m.normal_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::vec3) * m.vertices,
+                  normals.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return m;
+}
+
+/* The same with an index buffer, three indices per triangle */
+static model model_from_data(const std::vector<glm::vec3> & coords,
+                             const std::vector<glm::vec3> & normals,
+                             const std::vector<std::uint32_t> & indices)
+{
+  model m = allocate_model(std::min(coords.size(),normals.size()), indices.size());
+
+  glBindBuffer(GL_ARRAY_BUFFER, m.position_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::vec3) * m.vertices,
+                  coords.data());
+  glBindBuffer(GL_ARRAY_BUFFER, m.normal_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::vec3) * m.vertices,
+                  normals.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  // Not bound to the vertex array, binding it to GL_COPY_WRITE_BUFFER
+  // leaves that one alone
+  glBindBuffer(GL_COPY_WRITE_BUFFER, m.index_buffer);
+  glBufferSubData(GL_COPY_WRITE_BUFFER, 0, sizeof(std::uint32_t) * m.indices,
+                  indices.data());
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  return m;
+}
+
+static void release_model(model & m)
+{
+  if(m.pooled){
+    std::cerr << "Attempt to release a model of a geometry_pool" << std::endl;
+    return;
+  }
+  if(m.vertex_array) glDeleteVertexArrays(1,&m.vertex_array);
+  if(m.position_buffer) glDeleteBuffers(1,&m.position_buffer);
+  if(m.normal_buffer) glDeleteBuffers(1,&m.normal_buffer);
+  if(m.index_buffer) glDeleteBuffers(1,&m.index_buffer);
+  m = model();
+}
+
+/* This function just renders a model.
+ * The ranges of an indexed model follow each other, and they all look the
+ * same for now, so they go in a single call. */
+static void render_model(const model & m)
+{
+  if(m.vertex_array and m.position_buffer and m.vertices){
+    glBindVertexArray(m.vertex_array);
+    if(m.index_buffer)
+      glDrawElementsBaseVertex(GL_TRIANGLES,m.indices,GL_UNSIGNED_INT,
+                               (const void*)(sizeof(std::uint32_t) * m.first_index),
+                               m.base_vertex);
+    else
+      glDrawArrays(GL_TRIANGLES,0,m.vertices);
+    glBindVertexArray(0);
+  }else{
+    std::cerr << "Attempt to render an invalid model" << std::endl;
+  }
+}
@@ -0,0 +1,434 @@
+#pragma once
+
+#include "model.hpp"
+#include "geometry_pool.hpp"
+#include "common/obj.hpp"
+#include "common/obj_stream.hpp"
+#include "common/trace.hpp"
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp> // For translate
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Loads .obj models without blocking the render loop.
+ *
+ * The files are parsed by worker threads. Parsed meshes are then copied to
+ * the GPU from the render thread, a few megabytes per frame at most, through
+ * a staging buffer: we write in the staging buffer (which the driver can give
+ * us without waiting for the GPU) and ask the GPU to copy it to the real
+ * buffer. Until a model is complete its bounding box should be drawn instead.
+ *
+ * Files bigger than stream_threshold, and binary caches (.mesh, see
+ * common/obj_stream.hpp), are streamed instead: they go to the GPU in chunks
+ * of at most 65536 vertices as they are read, each chunk its own model.
+ * The worker waits while max_queued_chunks are waiting for the GPU, so the
+ * memory used does not depend on the size of the file.
+ *
+ * With a geometry_pool the models (and chunks) are ranges of its buffers
+ * instead of having their own.
+ */
+class model_loader
+{
+public:
+  struct entry
+  {
+    std::string filename;
+    model m;            // The buffers are valid once ready is true
+    obj::bounding_volume bounds; // In the coordinates of the file, valid once parsed is true
+    bool recenter = true; // Move the centroid to the origin of the transform
+    bool parsed = false;
+    bool ready  = false;
+    bool failed = false;
+    // The models of a streamed file, they use m.transform. The ones that
+    // are here can be drawn before the file is ready.
+    std::vector<model> chunks;
+    // Copy of the mesh for the CPU renderer, only with keep_geometry,
+    // never for streamed files
+    std::vector<glm::vec3> coords;
+    std::vector<glm::vec3> normals;
+    std::vector<std::uint32_t> indices;
+  };
+
+  model_loader(std::size_t frame_budget = 4 << 20) :
+    _frame_budget(frame_budget)
+  {
+    unsigned threads = std::thread::hardware_concurrency();
+    // Leave one core to the render thread
+    threads = threads > 1 ? threads - 1 : 1;
+    for(unsigned i = 0; i < threads; ++i)
+      _workers.emplace_back([this]{ work(); });
+  }
+
+  model_loader(const model_loader &) = delete;
+  model_loader & operator=(const model_loader &) = delete;
+
+  ~model_loader()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _job_ready.notify_all();
+    _chunk_room.notify_all();
+    for(std::thread & t : _workers) t.join();
+    if(_staging) glDeleteBuffers(1,&_staging);
+    for(std::unique_ptr<mesh> & pending : _uploading) release(pending->gpu);
+    for(entry & e : _entries){
+      release(e.m);
+      for(model & c : e.chunks) release(c);
+    }
+  }
+
+  /* Called from a worker thread when a mesh has been parsed, eg: to wake up
+   * the render loop. */
+  std::function<void()> on_parsed;
+
+  /* Keep the vertices in the entries once they are on the GPU */
+  bool keep_geometry = false;
+
+  /* .obj files bigger than this are streamed, in bytes */
+  std::size_t stream_threshold = std::size_t(256) << 20;
+
+  /* Chunks of streamed files parsed but not on the GPU yet, at most */
+  std::size_t max_queued_chunks = 8;
+
+  /* Where the models go, if not null. It has to outlive the loader. */
+  geometry_pool * pool = nullptr;
+
+  /* Queues a file and returns its index in entries().
+   * With recenter the centroid of the model goes where transform puts the
+   * origin: the translation is added to m.transform when the file is parsed,
+   * the vertices are not touched. */
+  std::size_t load(const std::string & filename,
+                   const glm::mat4 & transform = glm::mat4(),
+                   bool recenter = true)
+  {
+    std::size_t index = _entries.size();
+    _entries.emplace_back();
+    _entries.back().filename = filename;
+    _entries.back().m.transform = transform;
+    _entries.back().recenter = recenter;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _jobs.push_back(job{index, filename});
+      ++_parsing;
+    }
+    _job_ready.notify_one();
+    return index;
+  }
+
+  /* Copies at most frame_budget bytes to the GPU. Call it once per frame
+   * from the thread that owns the GL context.
+   * Returns true while there is work left, so the caller knows it needs
+   * another frame. */
+  bool upload()
+  {
+    TRACE_SCOPE("model_loader::upload");
+    take_parsed();
+
+    std::size_t budget = _frame_budget;
+    while(budget > 0 and not _uploading.empty()){
+      mesh & pending = *_uploading.front();
+      entry & e = _entries[pending.index];
+      if(!pending.gpu.vertex_array and not pending.coords.empty()){
+        int vertices = int(pending.coords.size()), indices = int(pending.indices.size());
+        pending.gpu = pool ? pool->allocate(vertices, indices) : allocate_model(vertices, indices);
+        pending.gpu.ranges = pending.ranges;
+      }
+
+      // Positions, normals and then indices, as if they were a single array.
+      // start is where the model begins in each buffer.
+      const model & gpu = pending.gpu;
+      const struct { const void * data; std::size_t bytes; GLuint buffer; std::size_t start; } arrays[] = {
+        { pending.coords.data(), pending.coords.size() * sizeof(glm::vec3), gpu.position_buffer,
+          gpu.base_vertex * sizeof(glm::vec3) },
+        { pending.normals.data(), pending.normals.size() * sizeof(glm::vec3), gpu.normal_buffer,
+          gpu.base_vertex * sizeof(glm::vec3) },
+        { pending.indices.data(), pending.indices.size() * sizeof(std::uint32_t), gpu.index_buffer,
+          gpu.first_index * sizeof(std::uint32_t) }
+      };
+      std::size_t offset = pending.uploaded, total = 0;
+      for(const auto & a : arrays) total += a.bytes;
+      for(const auto & a : arrays){
+        if(offset < a.bytes){
+          std::size_t bytes = std::min(budget, a.bytes - offset);
+          copy((const char*)a.data + offset, bytes, a.buffer, a.start + offset);
+          pending.uploaded += bytes;
+          budget -= bytes;
+          break;
+        }
+        offset -= a.bytes;
+      }
+      if(pending.uploaded < total) continue;
+
+      if(pending.chunk){
+        if(pending.gpu.vertex_array) e.chunks.push_back(pending.gpu);
+        if(pending.last){
+          e.ready = not e.chunks.empty();
+          e.failed = e.failed or e.chunks.empty();
+        }else{
+          std::lock_guard<std::mutex> lock(_mutex);
+          --_queued_chunks;
+          _chunk_room.notify_one();
+        }
+      }else{
+        pending.gpu.transform = e.m.transform;
+        e.m = pending.gpu;
+        e.ready = true;
+        if(keep_geometry){
+          e.coords = std::move(pending.coords);
+          e.normals = std::move(pending.normals);
+          e.indices = std::move(pending.indices);
+        }
+      }
+      _uploading.pop_front();
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _parsing > 0 or not _parsed.empty() or not _uploading.empty();
+  }
+
+  const std::vector<entry> & entries() const { return _entries; }
+  std::vector<entry> & entries() { return _entries; }
+
+private:
+  struct job
+  {
+    std::size_t index;
+    std::string filename;
+  };
+
+  struct mesh
+  {
+    std::size_t index;
+    std::vector<glm::vec3> coords;
+    std::vector<glm::vec3> normals;
+    std::vector<std::uint32_t> indices;
+    std::vector<model::range> ranges;
+    obj::bounding_volume bounds;
+    model gpu; // Where it goes
+    std::size_t uploaded = 0; // Bytes already copied to the GPU
+    bool failed = false;
+    bool chunk = false; // Part of a streamed file
+    bool last = true;   // For chunks: no geometry, marks the end of the file
+  };
+
+  void work()
+  {
+    trace::thread_name("loader");
+    std::unique_lock<std::mutex> lock(_mutex);
+    for(;;){
+      _job_ready.wait(lock, [this]{ return _stop or not _jobs.empty(); });
+      if(_stop) return;
+      job j = _jobs.front();
+      _jobs.pop_front();
+      lock.unlock();
+
+      if(streamed(j.filename))
+        stream(j);
+      else
+        deliver(parse(j));
+
+      lock.lock();
+      --_parsing;
+    }
+  }
+
+  /* Gives a mesh to the render thread */
+  void deliver(std::unique_ptr<mesh> m)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _parsed.push_back(std::move(m));
+    }
+    if(on_parsed) on_parsed();
+  }
+
+  static bool is_cache(const std::string & filename)
+  {
+    const std::string extension = ".mesh";
+    return filename.size() >= extension.size() and
+      filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+  }
+
+  bool streamed(const std::string & filename) const
+  {
+    if(is_cache(filename)) return true;
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    return in.good() and std::size_t(in.tellg()) > stream_threshold;
+  }
+
+  /* Sends the chunks of a file to the render thread as they are read */
+  class loader_sink : public obj::chunk_sink
+  {
+  public:
+    loader_sink(model_loader & loader, std::size_t index) :
+      _loader(loader), _index(index) {}
+
+    void begin(const obj::bounding_volume & b) override { _bounds = b; }
+
+    bool add(obj::chunk & c) override
+    {
+      {
+        std::unique_lock<std::mutex> lock(_loader._mutex);
+        _loader._chunk_room.wait(lock, [this]{
+          return _loader._stop or _loader._queued_chunks < _loader.max_queued_chunks;
+        });
+        if(_loader._stop) return false;
+        ++_loader._queued_chunks;
+      }
+      std::unique_ptr<mesh> m(new mesh);
+      m->index = _index;
+      m->chunk = true;
+      m->last = false;
+      m->bounds = _bounds;
+      m->coords = std::move(c.positions);
+      m->normals = std::move(c.normals);
+      m->indices = std::move(c.indices);
+      _loader.deliver(std::move(m));
+      return true;
+    }
+
+  private:
+    model_loader & _loader;
+    std::size_t _index;
+    obj::bounding_volume _bounds;
+  };
+
+  void stream(const job & j)
+  {
+    TRACE_SCOPE("model_loader::stream");
+    loader_sink sink(*this, j.index);
+    std::unique_ptr<mesh> end(new mesh);
+    end->index = j.index;
+    end->chunk = true;
+    try{
+      obj::stream_stats stats = is_cache(j.filename) ? obj::read_cache(j.filename, sink)
+                                                     : obj::stream_scene(j.filename, sink);
+      end->bounds = stats.bounds;
+      std::cout << "Streamed '" << j.filename << "', " << stats.vertices
+                << " vertices, " << stats.triangles << " triangles in "
+                << stats.chunks << " chunks, peak resident memory "
+                << stats.peak_resident_bytes / (1 << 20) << " MB" << std::endl;
+    }catch(std::exception & e){
+      std::cerr << "Cannot load '" << j.filename << "': " << e.what() << std::endl;
+      end->failed = true;
+    }
+    deliver(std::move(end));
+  }
+
+  static std::unique_ptr<mesh> parse(const job & j)
+  {
+    TRACE_SCOPE("model_loader::parse");
+    std::unique_ptr<mesh> m(new mesh);
+    m->index = j.index;
+    try{
+      // All the objects of the file go in the same buffers
+      obj::scene s = obj::read_scene(j.filename);
+      if(s.indices.empty())
+        throw std::runtime_error("no faces in file");
+      m->coords = std::move(s.positions);
+      m->normals = std::move(s.normals);
+      m->indices = std::move(s.indices);
+      for(const obj::submesh & sub : s.submeshes)
+        m->ranges.push_back(model::range{sub.first_index, GLsizei(sub.index_count)});
+      m->bounds = s.bounds;
+      std::size_t vertices = m->coords.size();
+      std::cout << "Loaded '" << j.filename << "', " << vertices
+                << " vertices, " << m->indices.size() / 3 << " triangles, "
+                << s.submeshes.size() << " parts" << std::endl;
+    }catch(std::exception & e){
+      std::cerr << "Cannot load '" << j.filename << "': " << e.what() << std::endl;
+      m->failed = true;
+    }
+    return m;
+  }
+
+  /* Moves what the workers parsed to the upload queue */
+  void take_parsed()
+  {
+    std::deque<std::unique_ptr<mesh>> parsed;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      parsed.swap(_parsed);
+    }
+    for(std::unique_ptr<mesh> & m : parsed){
+      entry & e = _entries[m->index];
+      if(not e.parsed){
+        e.parsed = true;
+        e.bounds = m->bounds;
+        if(e.recenter)
+          e.m.transform = e.m.transform * glm::translate(glm::mat4(), -m->bounds.centroid);
+      }
+      if(m->failed or (not m->chunk and m->coords.empty())){
+        e.failed = true;
+        if(not m->chunk) continue;
+      }
+      // The end of a stream goes after its chunks
+      _uploading.push_back(std::move(m));
+    }
+  }
+
+  void release(model & m)
+  {
+    if(m.pooled) pool->release(m);
+    else release_model(m);
+  }
+
+  /* Copies bytes to the buffer through the staging buffer */
+  void copy(const char * source, std::size_t bytes, GLuint target, std::size_t offset)
+  {
+    if(!_staging){
+      glGenBuffers(1,&_staging);
+      glBindBuffer(GL_COPY_READ_BUFFER, _staging);
+      glBufferData(GL_COPY_READ_BUFFER, _frame_budget, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, _staging);
+    // Invalidating gives us fresh memory if the GPU still reads the old one
+    void * mapped = glMapBufferRange(GL_COPY_READ_BUFFER, 0, bytes,
+                                     GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if(not mapped){
+      // Those bytes are not uploaded; upload() still unbinds the buffer
+      std::cerr << "Cannot map the staging buffer, error " << glGetError() << std::endl;
+      return;
+    }
+    std::memcpy(mapped, source, bytes);
+    glUnmapBuffer(GL_COPY_READ_BUFFER);
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, target);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, offset, bytes);
+  }
+
+  std::size_t _frame_budget;
+  GLuint _staging = 0;
+
+  std::vector<entry> _entries;                   // Render thread only
+  std::deque<std::unique_ptr<mesh>> _uploading;  // Render thread only
+
+  std::mutex _mutex; // Protects what follows
+  std::condition_variable _job_ready;
+  std::deque<job> _jobs;
+  std::deque<std::unique_ptr<mesh>> _parsed;
+  std::size_t _parsing = 0; // Queued or being parsed
+  std::condition_variable _chunk_room;
+  std::size_t _queued_chunks = 0; // Of streamed files, not on the GPU yet
+  bool _stop = false;
+
+  std::vector<std::thread> _workers;
+};
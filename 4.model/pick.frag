@@ -0,0 +1,13 @@
+#version 330
+
+/* For picker.hpp: the object being drawn and the triangle of the draw, the
+ * nearest one stays in the integer framebuffer */
+
+uniform uint u_object;
+
+out uvec2 id;
+
+void main()
+{
+  id = uvec2(u_object, uint(gl_PrimitiveID));
+}
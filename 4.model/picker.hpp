@@ -0,0 +1,192 @@
+#pragma once
+
+#include "common/shader.hpp"
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+/* Finds what is under a pixel with the GPU: the objects are drawn again with
+ * pick.frag, which writes the number of the object and of the triangle
+ * (gl_PrimitiveID) to an integer framebuffer, and the depth test keeps the
+ * nearest.
+ *
+ * Only one pixel is needed, so the framebuffer is 1x1 and a pick matrix
+ * stretches that pixel over it: the vertices are transformed as usual, but
+ * the rasterizer and pick.frag only work for one pixel.
+ *
+ * The pixel is not read right away, glReadPixels would wait for the GPU to
+ * finish the frame. It goes to a pixel buffer object, and a fence tells when
+ * it is there: poll() in the next frames returns it without waiting. A few
+ * picks can be on their way at once.
+ *
+ *   if(picker.begin(width, height, x, y)){
+ *     for each object: picker.object(id, mvp), then draw its positions
+ *     picker.end();
+ *   }
+ *   ...
+ *   picker::result r;
+ *   if(picker.poll(r)) ...
+ */
+class picker
+{
+public:
+  struct result
+  {
+    std::uint32_t object = 0;   // Given to object(), 0 if there was nothing
+    std::uint32_t triangle = 0; // Of the draw, gl_PrimitiveID
+    int x = 0, y = 0;
+    double latency = 0.;        // Seconds from end() to poll()
+    int polls = 0;              // poll() calls until it was ready, this one too
+  };
+
+  picker() : _program(shaders::build_program("./depth.vert","./pick.frag"))
+  {
+    _u_mvp = glGetUniformLocation(_program, "u_mvp");
+    _u_object = glGetUniformLocation(_program, "u_object");
+
+    glGenRenderbuffers(2, _renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, _renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RG32UI, 1, 1);
+    glBindRenderbuffer(GL_RENDERBUFFER, _renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, 1, 1);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _renderbuffers[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, _renderbuffers[1]);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenBuffers(SLOTS, _buffers);
+    for(GLuint b : _buffers){
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, b);
+      glBufferData(GL_PIXEL_PACK_BUFFER, 2 * sizeof(GLuint), NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  picker(const picker &) = delete;
+  picker & operator=(const picker &) = delete;
+
+  ~picker()
+  {
+    for(slot & s : _slots)
+      if(s.fence) glDeleteSync(s.fence);
+    glDeleteBuffers(SLOTS, _buffers);
+    glDeleteFramebuffers(1, &_framebuffer);
+    glDeleteRenderbuffers(2, _renderbuffers);
+    glDeleteProgram(_program);
+  }
+
+  /* Starts picking pixel (x, y) of a width x height frame, counted from the
+   * bottom left. Binds the framebuffer and the program of the picker.
+   * Returns false, and does nothing, if SLOTS picks are still on their way. */
+  bool begin(int width, int height, int x, int y)
+  {
+    slot & s = _slots[_next];
+    if(s.fence) return false;
+    s.x = x;
+    s.y = y;
+
+    // Clip coordinates scaled and moved so that the pixel covers [-1, 1]
+    float cx = 2.f * (x + 0.5f) / width - 1.f;
+    float cy = 2.f * (y + 0.5f) / height - 1.f;
+    _pick = glm::mat4(1.f);
+    _pick[0][0] = float(width);
+    _pick[1][1] = float(height);
+    _pick[3][0] = -cx * width;
+    _pick[3][1] = -cy * height;
+
+    glGetIntegerv(GL_VIEWPORT, _viewport);
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &_previous);
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    glViewport(0, 0, 1, 1);
+    const GLuint nothing[4] = { 0, 0, 0, 0 };
+    glClearBufferuiv(GL_COLOR, 0, nothing);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glUseProgram(_program);
+    return true;
+  }
+
+  /* The next draw is object id (not 0), moved by mvp. Only its positions
+   * are read, at location 0. */
+  void object(std::uint32_t id, const glm::mat4 & mvp)
+  {
+    glm::mat4 m = _pick * mvp;
+    glUniformMatrix4fv(_u_mvp, 1, GL_FALSE, &m[0][0]);
+    glUniform1ui(_u_object, id);
+  }
+
+  /* Sends the pixel to a pixel buffer and binds back the framebuffer and the
+   * viewport of before begin() */
+  void end()
+  {
+    slot & s = _slots[_next];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, _buffers[_next]);
+    glReadPixels(0, 0, 1, 1, GL_RG_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    s.start = std::chrono::steady_clock::now();
+    s.polls = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, _previous);
+    glViewport(_viewport[0], _viewport[1], _viewport[2], _viewport[3]);
+    _next = (_next + 1) % SLOTS;
+  }
+
+  /* True while a pick has not been returned by poll() */
+  bool pending() const { return _slots[_oldest].fence != 0; }
+
+  /* The oldest pick, if the GPU is done with it. Never waits. */
+  bool poll(result & r)
+  {
+    slot & s = _slots[_oldest];
+    if(not s.fence) return false;
+    ++s.polls;
+    // The first check flushes, or the fence could stay in the queue forever
+    GLenum status = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if(status != GL_ALREADY_SIGNALED and status != GL_CONDITION_SATISFIED) return false;
+
+    GLuint pixel[2] = { 0, 0 };
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, _buffers[_oldest]);
+    if(const void * p = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(pixel), GL_MAP_READ_BIT)){
+      std::copy(static_cast<const GLuint*>(p), static_cast<const GLuint*>(p) + 2, pixel);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteSync(s.fence);
+    s.fence = 0;
+
+    r.object = pixel[0];
+    r.triangle = pixel[1];
+    r.x = s.x;
+    r.y = s.y;
+    r.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - s.start).count();
+    r.polls = s.polls;
+    _oldest = (_oldest + 1) % SLOTS;
+    return true;
+  }
+
+private:
+  static const int SLOTS = 3;
+
+  struct slot
+  {
+    GLsync fence = 0;
+    int x = 0, y = 0;
+    std::chrono::steady_clock::time_point start;
+    int polls = 0;
+  };
+
+  GLuint _program;
+  GLint _u_mvp, _u_object;
+  GLuint _framebuffer = 0, _renderbuffers[2];
+  GLuint _buffers[SLOTS];
+  slot _slots[SLOTS];
+  int _next = 0, _oldest = 0;
+  glm::mat4 _pick;
+  GLint _viewport[4];
+  GLint _previous = 0;
+};
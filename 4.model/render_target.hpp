@@ -0,0 +1,78 @@
+#pragma once
+
+#include <GL/glew.h>
+
+/* A framebuffer to draw in instead of the window, with the depth in a
+ * texture that shaders can read (see depth_pyramid.hpp). present() copies
+ * the color to the window. */
+class render_target
+{
+public:
+  render_target() {}
+  render_target(const render_target &) = delete;
+  render_target & operator=(const render_target &) = delete;
+
+  ~render_target() { release(); }
+
+  void resize(int width, int height)
+  {
+    if(width == _width and height == _height) return;
+    release();
+    _width = width;
+    _height = height;
+
+    glGenRenderbuffers(1, &_color);
+    glBindRenderbuffer(GL_RENDERBUFFER, _color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenTextures(1, &_depth);
+    glBindTexture(GL_TEXTURE_2D, _depth);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, width, height, 0,
+                 GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _color);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, _depth, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  /* The next draws go here */
+  void bind()
+  {
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    glViewport(0, 0, _width, _height);
+  }
+
+  /* Copies the color to the window, of the given size, and leaves the
+   * window bound */
+  void present(int width, int height)
+  {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, _framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, _width, _height, 0, 0, width, height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  GLuint depth_texture() const { return _depth; }
+  int width() const { return _width; }
+  int height() const { return _height; }
+
+private:
+  void release()
+  {
+    if(_framebuffer) glDeleteFramebuffers(1, &_framebuffer);
+    if(_color) glDeleteRenderbuffers(1, &_color);
+    if(_depth) glDeleteTextures(1, &_depth);
+    _framebuffer = _color = _depth = 0;
+    _width = _height = 0;
+  }
+
+  GLuint _framebuffer = 0, _color = 0, _depth = 0;
+  int _width = 0, _height = 0;
+};
@@ -9,6 +9,9 @@ uniform mat3 u_normal_mat;
 out vec3 v_normal;
 out vec3 v_pos;
 
+// The same depth as depth.vert, for the color pass after a depth prepass
+invariant gl_Position;
+
 void main()
 {
   gl_Position = u_mvp*vec4(a_position,1.f);
@@ -1,4 +1,8 @@
 #include "common/shader.hpp"
+#include "common/trace.hpp"
+#include "common/frame_scheduler.hpp"
+#include "common/triple_buffer.hpp"
+#include "common/capture.hpp"
 
 #include <GL/glew.h>
 #include <GL/gl.h>
@@ -7,6 +11,11 @@
 
 #include <vector>
 #include <iostream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <string>
 
 #include "plot.hpp"
 
@@ -15,21 +24,55 @@
 const int INITIAL_WIDTH = 800;
 const int INITIAL_HEIGHT = 600;
 
-/* This function gets called in the game loop.
- * All the drawing is done here. */
-plot sinc;
+/* The samples of the curve are computed in a worker thread, as if they came
+ * from a live data feed, and handed to the render thread through a triple
+ * buffer. The worker can go faster than the screen, the render thread only
+ * uploads the latest samples and never waits for the worker. */
+struct sample_feed
+{
+  util::triple_buffer<std::vector<glm::vec2>> samples;
+  std::atomic<bool> running{true};
+  double rate = 1000.0; // Updates per second
+};
 
-static void render(float time)
+static void generate(std::vector<glm::vec2> & points, double time)
 {
-  std::vector<glm::vec2> points(1<<12);
   float anim = sin(time) * 10;
   float t = -1;
   for(auto & v : points) {
     v = glm::vec2{t, sin(t*(20+anim))/(t*(20+anim))};
     t+=40.f/points.size();
   }
+}
+
+/* Body of the worker thread. Uses the clock of the scheduler so the samples
+ * and the colors drawn by the render thread are in sync. */
+static void produce(sample_feed & feed, const util::frame_scheduler & clock)
+{
+  trace::thread_name("producer");
+  auto period = std::chrono::duration<double>(1.0/feed.rate);
+  auto next = std::chrono::steady_clock::now();
+  while(feed.running){
+    {
+      TRACE_SCOPE("generate");
+      generate(feed.samples.back(), clock.time());
+      feed.samples.publish();
+    }
+    next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+    std::this_thread::sleep_until(next);
+  }
+}
 
-  sinc.set_data(points);
+/* This function gets called in the game loop.
+ * All the drawing is done here. */
+plot sinc;
+
+static void render(sample_feed & feed, double time)
+{
+  TRACE_FUNCTION();
+  // Only upload if the worker published something since the last frame
+  if(feed.samples.update())
+    sinc.set_data(feed.samples.front());
 
   glClearColor(0.f,0.1f,0.1f,1.f);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -50,6 +93,21 @@ static void size_callback(GLFWwindow* window,int,int){
 }
 
 
+/* 1: draw every refresh, 2: cap to 30 fps, S: print the frame pacing */
+static void key_callback(GLFWwindow* window, int key, int, int action, int)
+{
+  util::frame_scheduler & scheduler =
+    *(util::frame_scheduler*)glfwGetWindowUserPointer(window);
+  if (action != GLFW_PRESS) return;
+  if (key == GLFW_KEY_1)
+    scheduler.set_mode(util::frame_scheduler::continuous);
+  else if (key == GLFW_KEY_2)
+    scheduler.set_mode(util::frame_scheduler::capped, 30.0);
+  else if (key == GLFW_KEY_S)
+    scheduler.report(std::cout);
+}
+
+
 static void debugMessage(
   GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length,
   const GLchar *message, const void *userParam)
@@ -58,10 +116,40 @@ static void debugMessage(
   // Print, log, whatever based on the enums and message
 }
 
-int main()
+static void print_capture_stats(const util::frame_capture & capture)
+{
+  util::frame_capture::statistics s = capture.stats();
+  std::cout << "Capture: " << s.written << " of " << s.captured << " frames written, "
+            << s.dropped << " dropped";
+  if(capture.output_format() == util::frame_capture::y4m)
+    std::cout << " (" << s.repeated << " written again in their place)";
+  std::cout << ", "
+            << (s.captured ? s.capture_seconds / s.captured * 1e3 : 0.) << " ms a frame on the render thread, "
+            << (s.written ? s.encode_seconds / s.written * 1e3 : 0.) << " ms a frame to encode" << std::endl;
+}
+
+/* Usage:
+ *   curves                      shows the plot
+ *   curves --capture file.y4m   and records it, as a video
+ *   curves --capture name       or as pictures: name_000000.png, ...
+ */
+int main(int argc, char ** argv)
 {  
+  std::vector<std::string> args(argv+1, argv+argc);
+  std::string capture_file;
+  if(not args.empty() and args[0] == "--capture"){
+    if(args.size() < 2){
+      std::cerr << "Usage: curves --capture file.y4m|name" << std::endl;
+      return 1;
+    }
+    capture_file = args[1];
+  }
+
+  // The plot is animated, so we draw every frame
+  util::frame_scheduler scheduler(util::frame_scheduler::continuous);
   if (!glfwInit())
     return 1;
+  scheduler.detect_refresh_rate();
   
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
@@ -88,7 +176,9 @@ int main()
 
   glDisable(GL_CULL_FACE);
     
+  glfwSetWindowUserPointer(window, &scheduler);
   glfwSetWindowSizeCallback(window, size_callback);
+  glfwSetKeyCallback(window, key_callback);
   glViewport(0,0,INITIAL_WIDTH,INITIAL_HEIGHT);
 
   GLint flags;
@@ -102,13 +192,45 @@ int main()
     glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_TRUE);    
   }
 
-  float time = 0.f;
+  trace::thread_name("main");
+  sample_feed feed;
+  feed.samples.fill(std::vector<glm::vec2>(1<<12));
+  std::thread producer(produce, std::ref(feed), std::cref(scheduler));
+
+  // Reads the frames back a few frames late and writes them in a thread,
+  // the frame pacing (S) should not change
+  std::unique_ptr<util::frame_capture> capture;
+  if(not capture_file.empty()){
+    GLFWmonitor * monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode * video_mode = monitor ? glfwGetVideoMode(monitor) : nullptr;
+    capture.reset(new util::frame_capture(capture_file, video_mode ? video_mode->refreshRate : 60.));
+  }
+
   while(not glfwWindowShouldClose(window)){
-    glfwWaitEventsTimeout(0.1);
-    render(time);
-    time += 0.1f;
-    glfwSwapBuffers(window);
+    if(not scheduler.wait()) continue;
+    TRACE_SCOPE("frame");
+    // The animation follows the clock, not the number of frames drawn
+    render(feed, scheduler.time());
+    if(capture){
+      int width, height;
+      glfwGetFramebufferSize(window, &width, &height);
+      capture->capture(width, height);
+    }
+    {
+      TRACE_SCOPE("swap");
+      glfwSwapBuffers(window);
+    }
+    scheduler.presented();
+  }
+  feed.running = false;
+  producer.join();
+  if(capture){
+    capture->finish();
+    print_capture_stats(*capture);
   }
+
+  scheduler.report(std::cout);
+  trace::dump("curves_trace.json");
   return 0;
 }
 
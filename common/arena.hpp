@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace util
+{
+  /* Hands out memory from a few big blocks, and frees all of it at once when
+   * the arena goes away. It is meant for the temporary arrays of a loader:
+   * if reserve() is told how much is needed, a whole load is one allocation
+   * instead of one per element (std::unordered_map) or a copy every time a
+   * std::vector grows.
+   *
+   * Nothing is constructed or destroyed, so only types that do not need it
+   * (plain structs, numbers) can go in.
+   */
+  class arena
+  {
+  public:
+    arena(std::size_t block_bytes = 1 << 20) : _block_bytes(block_bytes) {}
+
+    arena(const arena &) = delete;
+    arena & operator=(const arena &) = delete;
+
+    /* The next allocations, up to bytes in total, come from one block */
+    void reserve(std::size_t bytes)
+    {
+      if(std::size_t(_end - _cursor) < bytes)
+        new_block(bytes);
+    }
+
+    template <typename T>
+    T * allocate(std::size_t count)
+    {
+      static_assert(std::is_trivially_destructible<T>::value,
+                    "The arena does not call destructors");
+      std::size_t bytes = sizeof(T) * count;
+      char * p = align(_cursor, alignof(T));
+      if(p + bytes > _end){
+        new_block(bytes + alignof(T));
+        p = align(_cursor, alignof(T));
+      }
+      _cursor = p + bytes;
+      _used += bytes;
+      return reinterpret_cast<T*>(p);
+    }
+
+    std::size_t blocks() const { return _blocks.size(); }
+    std::size_t used_bytes() const { return _used; }
+    std::size_t reserved_bytes() const { return _reserved; }
+
+  private:
+    static char * align(char * p, std::size_t alignment)
+    {
+      std::uintptr_t v = reinterpret_cast<std::uintptr_t>(p);
+      return reinterpret_cast<char*>((v + alignment - 1) / alignment * alignment);
+    }
+
+    void new_block(std::size_t bytes)
+    {
+      // new char[] is aligned for any standard type
+      bytes = std::max(bytes, _block_bytes);
+      _blocks.emplace_back(new char[bytes]);
+      _cursor = _blocks.back().get();
+      _end = _cursor + bytes;
+      _reserved += bytes;
+    }
+
+    std::size_t _block_bytes;
+    std::vector<std::unique_ptr<char[]>> _blocks;
+    char * _cursor = nullptr;
+    char * _end = nullptr;
+    std::size_t _used = 0, _reserved = 0;
+  };
+}
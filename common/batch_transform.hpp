@@ -0,0 +1,294 @@
+#pragma once
+
+#include "common/thread_pool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// The AVX version is compiled for the AVX target on its own and chosen when
+// the CPU has it, like the rows of 1.julia/julia_cpu.hpp
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define BATCH_AVX 1
+#define BATCH_INLINE __attribute__((always_inline))
+#else
+#define BATCH_INLINE
+#endif
+#if defined(__SSE2__)
+#define BATCH_SSE 1
+#include <emmintrin.h>
+#endif
+
+namespace util
+{
+  /* What a draw needs of an instance, laid out like the std140 (and std430)
+   * struct { mat4 mvp; mat3 normal; }, so it can be written straight into a
+   * uniform or storage buffer. */
+  struct instance_matrices
+  {
+    glm::mat4 mvp;
+    glm::vec4 normal[3]; // Columns of the normal matrix, w is 0
+  };
+  static_assert(sizeof(instance_matrices) == 112, "Layout of mat4 and mat3 in std140");
+
+  /* The model transforms of many instances as a structure of arrays: element
+   * e (column * 4 + row) of all the matrices one after the other, then the
+   * next element. That way a SIMD register loads the same element of 4 or 8
+   * instances at once and the math is written as for one matrix.
+   * The arrays are padded with identities to a multiple of 8. */
+  class transform_array
+  {
+  public:
+    std::size_t size() const { return _size; }
+
+    void resize(std::size_t size)
+    {
+      std::size_t padded = (size + 7) / 8 * 8;
+      std::vector<float> data(16 * padded, 0.f);
+      std::size_t kept = std::min(size, _size);
+      for(std::size_t i = 0; i < kept; ++i)
+        for(int e = 0; e < 16; ++e)
+          data[e * padded + i] = _data[e * _padded + i];
+      // The new instances and the padding, also when it shrinks
+      for(std::size_t i = kept; i < padded; ++i)
+        for(int e = 0; e < 16; e += 5)
+          data[e * padded + i] = 1.f;
+      _data.swap(data);
+      _size = size;
+      _padded = padded;
+    }
+
+    void set(std::size_t i, const glm::mat4 & m)
+    {
+      for(int e = 0; e < 16; ++e)
+        _data[e * _padded + i] = m[e / 4][e % 4];
+    }
+
+    glm::mat4 get(std::size_t i) const
+    {
+      glm::mat4 m;
+      for(int e = 0; e < 16; ++e)
+        m[e / 4][e % 4] = _data[e * _padded + i];
+      return m;
+    }
+
+    /* The array of element e, with size() rounded up to 8 values */
+    const float * element(int e) const { return _data.data() + e * _padded; }
+    std::size_t padded_size() const { return _padded; }
+
+  private:
+    std::size_t _size = 0, _padded = 0;
+    std::vector<float> _data;
+  };
+
+  namespace detail
+  {
+    /* The math of batch_transform() on anything that has + - * / and a
+     * constructor from a float: float for one instance, the SIMD types
+     * below for 4 or 8. r gets the 16 values of the mvp and the 12 of the
+     * normal matrix. */
+    template <typename V>
+    BATCH_INLINE inline void transform_lanes(const V vp[16], const V view[16], const V m[16], V r[28])
+    {
+      for(int c = 0; c < 4; ++c)
+        for(int row = 0; row < 4; ++row)
+          r[c*4 + row] = vp[row] * m[c*4] + vp[4 + row] * m[c*4 + 1] +
+                         vp[8 + row] * m[c*4 + 2] + vp[12 + row] * m[c*4 + 3];
+
+      // The normal matrix is transpose(inverse(a)), with a the 3x3 part of
+      // view * m. Its columns are the cross products of the columns of a
+      // divided by the determinant.
+      V a[3][3];
+      for(int c = 0; c < 3; ++c)
+        for(int row = 0; row < 3; ++row)
+          a[c][row] = view[row] * m[c*4] + view[4 + row] * m[c*4 + 1] +
+                      view[8 + row] * m[c*4 + 2] + view[12 + row] * m[c*4 + 3];
+      for(int c = 0; c < 3; ++c){
+        const V * u = a[(c + 1) % 3];
+        const V * v = a[(c + 2) % 3];
+        r[16 + c*4]     = u[1] * v[2] - u[2] * v[1];
+        r[16 + c*4 + 1] = u[2] * v[0] - u[0] * v[2];
+        r[16 + c*4 + 2] = u[0] * v[1] - u[1] * v[0];
+        r[16 + c*4 + 3] = V(0.f);
+      }
+      V inverse_determinant = V(1.f) / (a[0][0] * r[16] + a[0][1] * r[17] + a[0][2] * r[18]);
+      for(int c = 0; c < 3; ++c)
+        for(int row = 0; row < 3; ++row)
+          r[16 + c*4 + row] = r[16 + c*4 + row] * inverse_determinant;
+    }
+
+#ifdef BATCH_SSE
+    struct sse
+    {
+      static const int LANES = 4;
+      __m128 v;
+      sse(float f) : v(_mm_set1_ps(f)) {}
+      sse(__m128 m = _mm_setzero_ps()) : v(m) {}
+      static sse load(const float * p) { return sse(_mm_loadu_ps(p)); }
+      friend sse operator+(sse a, sse b) { return sse(_mm_add_ps(a.v, b.v)); }
+      friend sse operator-(sse a, sse b) { return sse(_mm_sub_ps(a.v, b.v)); }
+      friend sse operator*(sse a, sse b) { return sse(_mm_mul_ps(a.v, b.v)); }
+      friend sse operator/(sse a, sse b) { return sse(_mm_div_ps(a.v, b.v)); }
+
+      /* Four rows of 4 lanes to 4 floats per instance, count <= 4 of them */
+      static void store(const __m128 rows[4], instance_matrices * out, int offset, int count)
+      {
+        __m128 c0 = rows[0], c1 = rows[1], c2 = rows[2], c3 = rows[3];
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+        const __m128 columns[4] = { c0, c1, c2, c3 };
+        for(int i = 0; i < count; ++i)
+          _mm_storeu_ps(reinterpret_cast<float*>(out + i) + offset, columns[i]);
+      }
+
+      static void store(const sse r[28], instance_matrices * out, int count)
+      {
+        for(int g = 0; g < 7; ++g){
+          const __m128 rows[4] = { r[4*g].v, r[4*g + 1].v, r[4*g + 2].v, r[4*g + 3].v };
+          store(rows, out, 4*g, count);
+        }
+      }
+    };
+#endif
+
+#ifdef BATCH_AVX
+    typedef float avx_lanes __attribute__((vector_size(32)));
+
+    /* With the vector extensions of GCC and not with intrinsics: everything
+     * is inlined into transform_avx(), which is compiled for AVX, so these
+     * become AVX instructions there and nothing needs AVX anywhere else */
+    struct avx
+    {
+      static const int LANES = 8;
+      avx_lanes v;
+      BATCH_INLINE avx(float f = 0.f) : v(avx_lanes{} + f) {}
+      BATCH_INLINE static avx load(const float * p)
+      {
+        avx r;
+        std::memcpy(&r.v, p, sizeof(r.v));
+        return r;
+      }
+      // By reference, a 32 byte vector passed by value without AVX warns
+      // about the ABI
+      BATCH_INLINE friend avx operator+(const avx & a, const avx & b) { avx r; r.v = a.v + b.v; return r; }
+      BATCH_INLINE friend avx operator-(const avx & a, const avx & b) { avx r; r.v = a.v - b.v; return r; }
+      BATCH_INLINE friend avx operator*(const avx & a, const avx & b) { avx r; r.v = a.v * b.v; return r; }
+      BATCH_INLINE friend avx operator/(const avx & a, const avx & b) { avx r; r.v = a.v / b.v; return r; }
+
+      /* Each half is 4 instances, stored like sse does */
+      BATCH_INLINE static void store(const avx r[28], instance_matrices * out, int count)
+      {
+        for(int g = 0; g < 7; ++g){
+          __m128 low[4], high[4];
+          for(int i = 0; i < 4; ++i){
+            float lanes[8];
+            std::memcpy(lanes, &r[4*g + i].v, sizeof(lanes));
+            low[i] = _mm_loadu_ps(lanes);
+            high[i] = _mm_loadu_ps(lanes + 4);
+          }
+          sse::store(low, out, 4*g, std::min(count, 4));
+          if(count > 4) sse::store(high, out + 4, 4*g, count - 4);
+        }
+      }
+    };
+
+    inline bool avx_supported()
+    {
+      static const bool supported = __builtin_cpu_supports("avx");
+      return supported;
+    }
+#endif
+
+    inline void transform_one(const glm::mat4 & view_projection, const glm::mat4 & view,
+                              const glm::mat4 & transform, instance_matrices & out)
+    {
+      float vp[16], v[16], m[16], r[28];
+      for(int e = 0; e < 16; ++e){
+        vp[e] = view_projection[e / 4][e % 4];
+        v[e] = view[e / 4][e % 4];
+        m[e] = transform[e / 4][e % 4];
+      }
+      transform_lanes(vp, v, m, r);
+      std::copy(r, r + 28, reinterpret_cast<float*>(&out));
+    }
+
+    /* batch_transform() with V lanes at a time while they are inside the
+     * padded arrays, returns where it stopped */
+    template <typename V>
+    BATCH_INLINE inline std::size_t transform_simd(const glm::mat4 & view_projection, const glm::mat4 & view,
+                                      const transform_array & transforms,
+                                      std::size_t begin, std::size_t end, instance_matrices * out)
+    {
+      V vp[16], v[16];
+      for(int e = 0; e < 16; ++e){
+        vp[e] = V(view_projection[e / 4][e % 4]);
+        v[e] = V(view[e / 4][e % 4]);
+      }
+      std::size_t i = begin;
+      for(; i < end and i + V::LANES <= transforms.padded_size(); i += V::LANES){
+        V m[16], r[28];
+        for(int e = 0; e < 16; ++e)
+          m[e] = V::load(transforms.element(e) + i);
+        transform_lanes(vp, v, m, r);
+        V::store(r, out + i, int(std::min(std::size_t(V::LANES), end - i)));
+      }
+      return i;
+    }
+
+#ifdef BATCH_AVX
+    __attribute__((target("avx")))
+    inline std::size_t transform_avx(const glm::mat4 & view_projection, const glm::mat4 & view,
+                                     const transform_array & transforms,
+                                     std::size_t begin, std::size_t end, instance_matrices * out)
+    {
+      return transform_simd<avx>(view_projection, view, transforms, begin, end, out);
+    }
+#endif
+  }
+
+  /* The instruction set batch_transform() uses on this CPU */
+  inline const char * batch_simd()
+  {
+#if defined(BATCH_AVX)
+    if(detail::avx_supported()) return "AVX";
+#endif
+#if defined(BATCH_SSE)
+    return "SSE";
+#else
+    return "no SIMD";
+#endif
+  }
+
+  /* For every instance i in [begin, end): out[i].mvp is view_projection
+   * times its transform, out[i].normal the normal matrix of view times it
+   * (the same as transpose(inverse(mat3(view * transform)))). out can be a
+   * mapped buffer, it is only written, in order.
+   * Uses AVX when the CPU has it, or else SSE if the compiler has it. */
+  inline void batch_transform(const glm::mat4 & view_projection, const glm::mat4 & view,
+                              const transform_array & transforms,
+                              std::size_t begin, std::size_t end, instance_matrices * out)
+  {
+    end = std::min(end, transforms.size());
+#if defined(BATCH_AVX)
+    if(detail::avx_supported())
+      begin = detail::transform_avx(view_projection, view, transforms, begin, end, out);
+#endif
+#if defined(BATCH_SSE)
+    begin = detail::transform_simd<detail::sse>(view_projection, view, transforms, begin, end, out);
+#endif
+    for(std::size_t i = begin; i < end; ++i)
+      detail::transform_one(view_projection, view, transforms.get(i), out[i]);
+  }
+
+  /* All of them, split between the threads of a pool */
+  inline void batch_transform(const glm::mat4 & view_projection, const glm::mat4 & view,
+                              const transform_array & transforms, instance_matrices * out,
+                              thread_pool & pool = thread_pool::global())
+  {
+    pool.parallel_for(transforms.size(), 4096, [&](std::size_t begin, std::size_t end, unsigned){
+      batch_transform(view_projection, view, transforms, begin, end, out);
+    });
+  }
+}
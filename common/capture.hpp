@@ -0,0 +1,506 @@
+#pragma once
+
+#include "common/thread_pool.hpp"
+#include "common/trace.hpp"
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+  /* Records what is drawn in a window, to a .y4m video or to a sequence of
+   * .png pictures, without making the frames slower.
+   *
+   * glReadPixels into memory would wait until the GPU has finished the frame.
+   * Here it copies into one of a ring of pixel buffer objects and a fence is
+   * put after it; the buffer is only mapped a few frames later, when the
+   * fence says the copy is done, so nothing waits. The pixels are copied out
+   * of the buffer and the frame goes to a thread that converts it and writes
+   * the file. The conversion of a frame is split between half of the cores,
+   * in a pool of its own so that the loops of the render thread on the global
+   * pool never wait for it.
+   *
+   * If the GPU is so late that the ring is full, or the encoder so slow that
+   * max_queued frames are waiting, the frame is dropped and counted instead
+   * of waiting. A video has a fixed frame rate, so there the frame before a
+   * dropped one is written again in its place and the timing stays right.
+   *
+   *   util::frame_capture capture("session.y4m");
+   *   while(...){
+   *     render();
+   *     capture.capture(width, height); // Reads the back buffer
+   *     glfwSwapBuffers(window);
+   *   }
+   *   capture.finish();
+   */
+  class frame_capture
+  {
+  public:
+    enum format { png, y4m };
+
+    struct statistics
+    {
+      std::size_t captured = 0; // Frames given to capture(), written or dropped
+      std::size_t written = 0;
+      std::size_t dropped = 0;
+      std::size_t repeated = 0; // Copies written in place of dropped frames, .y4m only
+      double capture_seconds = 0.; // Spent in capture(), on the render thread
+      double encode_seconds = 0.;  // Spent converting and writing, on the encoder thread
+    };
+
+    /* A .y4m filename records a video of frame_rate frames per second (all
+     * the frames must have the size of the first). Any other name is the
+     * beginning of the names of the pictures: name_000000.png and so on. */
+    explicit frame_capture(const std::string & filename, double frame_rate = 60.,
+                           std::size_t max_queued = 8) :
+      _filename(filename), _frame_rate(frame_rate), _max_queued(max_queued),
+      _pool(std::max(1u, std::thread::hardware_concurrency() / 2))
+    {
+      std::string extension = ".y4m";
+      _format = filename.size() >= extension.size() and
+        filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0 ?
+        y4m : png;
+      glGenBuffers(SLOTS, _buffers);
+      _encoder = std::thread(&frame_capture::encode, this);
+    }
+
+    frame_capture(const frame_capture &) = delete;
+    frame_capture & operator=(const frame_capture &) = delete;
+
+    ~frame_capture()
+    {
+      finish();
+      glDeleteBuffers(SLOTS, _buffers);
+    }
+
+    /* Reads a width x height frame from the read framebuffer (by default the
+     * back buffer: call it before swapping) and sends the ones whose copy is
+     * done to the encoder */
+    void capture(int width, int height)
+    {
+      TRACE_FUNCTION();
+      auto start = std::chrono::steady_clock::now();
+      collect(false);
+      slot & s = _slots[_next];
+      if(s.fence){
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_stats.dropped; // The GPU is SLOTS frames behind
+        ++_dropped_since;
+      }else{
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, _buffers[_next]);
+        if(s.width != width or s.height != height){
+          glBufferData(GL_PIXEL_PACK_BUFFER, 4 * std::size_t(width) * height, NULL, GL_STREAM_READ);
+          s.width = width;
+          s.height = height;
+        }
+        // The rows are packed one after the other, and the alignment of the
+        // program is given back after the read
+        GLint alignment = 4;
+        glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        s.dropped_before = _dropped_since;
+        _dropped_since = 0;
+        _next = (_next + 1) % SLOTS;
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      ++_stats.captured;
+      _stats.capture_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /* Waits for the frames on their way and for the encoder to write them.
+     * Nothing can be captured after it. */
+    void finish()
+    {
+      if(not _encoder.joinable()) return;
+      collect(true);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // The frames dropped after the last one that was queued
+        _dropped_at_end = _dropped_since + _dropped_unqueued;
+        _stop = true;
+      }
+      _wake.notify_one();
+      _encoder.join();
+    }
+
+    statistics stats() const
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _stats;
+    }
+
+    format output_format() const { return _format; }
+
+  private:
+    static const int SLOTS = 3;
+
+    struct slot
+    {
+      GLsync fence = 0;
+      int width = 0, height = 0;
+      std::size_t dropped_before = 0; // Frames dropped between this one and the one before
+    };
+
+    struct frame
+    {
+      int width, height;
+      std::vector<std::uint8_t> pixels; // RGBA, the first row is the bottom one
+      std::size_t dropped_before;
+    };
+
+    /* Maps the buffers whose copy is done, oldest first, and queues their
+     * frames. With wait it waits for all of them. */
+    void collect(bool wait)
+    {
+      while(_slots[_oldest].fence){
+        slot & s = _slots[_oldest];
+        GLenum status = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                         wait ? GLuint64(1000000000) : GLuint64(0));
+        // Waiting or not, the buffer is mapped after it: map would wait too
+        if(status == GL_TIMEOUT_EXPIRED and not wait) return;
+        glDeleteSync(s.fence);
+        s.fence = 0;
+
+        std::vector<std::uint8_t> pixels;
+        bool room;
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          room = _queue.size() < _max_queued;
+          // Dropped or not, the ones before it are not written yet
+          _dropped_unqueued += s.dropped_before;
+          if(not room){
+            ++_stats.dropped; // The encoder is behind
+            ++_dropped_unqueued;
+          }else if(not _free.empty()){
+            pixels.swap(_free.back());
+            _free.pop_back();
+          }
+        }
+        if(room and status != GL_WAIT_FAILED){
+          std::size_t bytes = 4 * std::size_t(s.width) * s.height;
+          pixels.resize(bytes);
+          glBindBuffer(GL_PIXEL_PACK_BUFFER, _buffers[_oldest]);
+          if(const void * p = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT)){
+            std::memcpy(pixels.data(), p, bytes);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            {
+              std::lock_guard<std::mutex> lock(_mutex);
+              _queue.push_back(frame{s.width, s.height, std::move(pixels), _dropped_unqueued});
+              _dropped_unqueued = 0;
+            }
+            _wake.notify_one();
+          }else{
+            std::lock_guard<std::mutex> lock(_mutex);
+            ++_stats.dropped;
+            ++_dropped_unqueued;
+          }
+          glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }else if(room){
+          std::lock_guard<std::mutex> lock(_mutex);
+          ++_stats.dropped; // The fence failed, the pixels may not be there
+          ++_dropped_unqueued;
+        }
+        _oldest = (_oldest + 1) % SLOTS;
+      }
+    }
+
+    /* Body of the encoder thread */
+    void encode()
+    {
+      trace::thread_name("capture");
+      std::unique_lock<std::mutex> lock(_mutex);
+      for(;;){
+        _wake.wait(lock, [this]{ return _stop or not _queue.empty(); });
+        if(_queue.empty()){
+          // Stopping, and everything is written but the last drops
+          std::size_t repeats = _format == y4m ? _dropped_at_end + _unwritten : 0;
+          lock.unlock();
+          repeats = repeat_y4m(repeats);
+          lock.lock();
+          _stats.repeated += repeats;
+          return;
+        }
+        frame f = std::move(_queue.front());
+        _queue.pop_front();
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        bool written;
+        std::size_t repeats = 0;
+        {
+          TRACE_SCOPE("encode");
+          if(_format == y4m){
+            std::size_t missing = _unwritten + f.dropped_before;
+            repeats = repeat_y4m(missing);
+            written = write_y4m(f);
+            // Nothing was before the first frame, it stands for them
+            if(written and repeats < missing)
+              repeats += repeat_y4m(missing - repeats);
+            // If it was not written either, the next one goes in its place
+            _unwritten = missing - repeats + (written ? 0 : 1);
+          }else{
+            written = write_png(f);
+          }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        if(written) ++_stats.written;
+        else ++_stats.dropped;
+        _stats.repeated += repeats;
+        _stats.encode_seconds += seconds;
+        _free.push_back(std::move(f.pixels));
+      }
+    }
+
+    /* YUV 4:2:0 with the full range of JPEG, the chroma of 2x2 pixels
+     * averaged. Any player and ffmpeg read it. */
+    bool write_y4m(const frame & f)
+    {
+      if(not _video.is_open()){
+        if(_failed) return false;
+        _video.open(_filename, std::ios::binary);
+        if(not _video){
+          std::cerr << "Cannot write '" << _filename << "'" << std::endl;
+          _failed = true;
+          return false;
+        }
+        _video_width = f.width;
+        _video_height = f.height;
+        int rate = int(_frame_rate * 1000. + 0.5);
+        _video << "YUV4MPEG2 W" << f.width << " H" << f.height << " F" << rate << ":1000"
+               << " Ip A1:1 C420jpeg\n";
+      }
+      if(f.width != _video_width or f.height != _video_height) return false;
+
+      const int w = f.width, h = f.height;
+      const int cw = (w + 1) / 2, ch = (h + 1) / 2;
+      _planes.resize(std::size_t(w) * h + 2 * std::size_t(cw) * ch);
+      std::uint8_t * y_plane = _planes.data();
+      std::uint8_t * u_plane = y_plane + std::size_t(w) * h;
+      std::uint8_t * v_plane = u_plane + std::size_t(cw) * ch;
+      // Two rows at a time, from the top (the frame has them from the bottom)
+      _pool.parallel_for(std::size_t(ch), 16, [&](std::size_t begin, std::size_t end, unsigned){
+        for(int y = int(2 * begin); y < int(2 * end); y += 2){
+          const std::uint8_t * top = &f.pixels[4 * std::size_t(h - 1 - y) * w];
+          const std::uint8_t * bottom = y + 1 < h ? top - 4 * std::size_t(w) : top;
+          std::uint8_t * luma_top = y_plane + std::size_t(y) * w;
+          std::uint8_t * luma_bottom = y + 1 < h ? luma_top + w : luma_top;
+          std::uint8_t * u = u_plane + std::size_t(y / 2) * cw;
+          std::uint8_t * v = v_plane + std::size_t(y / 2) * cw;
+          for(int x = 0; x < w; x += 2){
+            int next = x + 1 < w ? 4 : 0;
+            const std::uint8_t * p[4] = { top + 4*x, top + 4*x + next, bottom + 4*x, bottom + 4*x + next };
+            int r = 0, g = 0, b = 0;
+            for(int i = 0; i < 4; ++i){
+              r += p[i][0];
+              g += p[i][1];
+              b += p[i][2];
+            }
+            luma_top[x] = luma(p[0]);
+            luma_bottom[x] = luma(p[2]);
+            if(next){
+              luma_top[x + 1] = luma(p[1]);
+              luma_bottom[x + 1] = luma(p[3]);
+            }
+            // Sums of 4 pixels, the offset keeps them positive
+            u[x / 2] = std::uint8_t(std::min((-43 * r - 85 * g + 128 * b + (32896 << 2)) >> 10, 255));
+            v[x / 2] = std::uint8_t(std::min((128 * r - 107 * g - 21 * b + (32896 << 2)) >> 10, 255));
+          }
+        }
+      });
+      _video << "FRAME\n";
+      _video.write(reinterpret_cast<const char*>(_planes.data()), _planes.size());
+      return _video.good();
+    }
+
+    /* Writes the last frame of the video again, count times, for the frames
+     * that were dropped after it. Returns how many were written: none before
+     * the first frame. */
+    std::size_t repeat_y4m(std::size_t count)
+    {
+      if(_planes.empty() or not _video.is_open()) return 0;
+      for(std::size_t i = 0; i < count; ++i){
+        _video << "FRAME\n";
+        _video.write(reinterpret_cast<const char*>(_planes.data()), _planes.size());
+      }
+      return _video.good() ? count : 0;
+    }
+
+    static std::uint8_t luma(const std::uint8_t * p)
+    {
+      return std::uint8_t((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+    }
+
+    /* RGB, 8 bits per channel. There is no zlib here, so the pixels are
+     * stored in deflate blocks without compression: bigger files, but
+     * nothing to compute except the checksums. */
+    bool write_png(const frame & f)
+    {
+      char number[16];
+      std::snprintf(number, sizeof(number), "_%06u.png", unsigned(_pictures++));
+      std::string filename = _filename + number;
+      std::ofstream out(filename, std::ios::binary);
+      if(not out){
+        std::cerr << "Cannot write '" << filename << "'" << std::endl;
+        return false;
+      }
+
+      // The rows, from the top, each after its filter byte (0, none)
+      const std::size_t row = 1 + 3 * std::size_t(f.width);
+      _planes.resize(row * f.height);
+      _pool.parallel_for(std::size_t(f.height), 16, [&](std::size_t begin, std::size_t end, unsigned){
+        for(std::size_t y = begin; y < end; ++y){
+          std::uint8_t * d = &_planes[row * y];
+          const std::uint8_t * s = &f.pixels[4 * (f.height - 1 - y) * f.width];
+          *d++ = 0;
+          for(int x = 0; x < f.width; ++x, s += 4, d += 3){
+            d[0] = s[0];
+            d[1] = s[1];
+            d[2] = s[2];
+          }
+        }
+      });
+
+      // zlib stream of stored blocks of up to 65535 bytes
+      const std::size_t BLOCK = 65535;
+      std::size_t blocks = std::max<std::size_t>((_planes.size() + BLOCK - 1) / BLOCK, 1);
+      _chunk.clear();
+      _chunk.reserve(4 + 2 + 5 * blocks + _planes.size() + 4);
+      append(_chunk, "IDAT", 4);
+      _chunk.push_back(0x78);
+      _chunk.push_back(0x01);
+      for(std::size_t b = 0; b < blocks; ++b){
+        std::size_t begin = b * BLOCK, size = std::min(BLOCK, _planes.size() - begin);
+        _chunk.push_back(b + 1 == blocks ? 1 : 0);
+        _chunk.push_back(std::uint8_t(size));
+        _chunk.push_back(std::uint8_t(size >> 8));
+        _chunk.push_back(std::uint8_t(~size));
+        _chunk.push_back(std::uint8_t(~size >> 8));
+        append(_chunk, _planes.data() + begin, size);
+      }
+      push_big_endian(_chunk, adler32(_planes.data(), _planes.size()));
+
+      std::vector<std::uint8_t> header;
+      append(header, "IHDR", 4);
+      push_big_endian(header, std::uint32_t(f.width));
+      push_big_endian(header, std::uint32_t(f.height));
+      const std::uint8_t format[5] = { 8, 2, 0, 0, 0 }; // 8 bits, RGB, no interlace
+      append(header, format, 5);
+
+      out.write("\x89PNG\r\n\x1a\n", 8);
+      write_chunk(out, header);
+      write_chunk(out, _chunk);
+      write_chunk(out, std::vector<std::uint8_t>{ 'I', 'E', 'N', 'D' });
+      return out.good();
+    }
+
+    template <typename T>
+    static void append(std::vector<std::uint8_t> & v, const T * data, std::size_t size)
+    {
+      const std::uint8_t * p = reinterpret_cast<const std::uint8_t*>(data);
+      v.insert(v.end(), p, p + size);
+    }
+
+    static void push_big_endian(std::vector<std::uint8_t> & v, std::uint32_t value)
+    {
+      for(int shift = 24; shift >= 0; shift -= 8)
+        v.push_back(std::uint8_t(value >> shift));
+    }
+
+    /* Length, type and data (chunk starts with the type) and CRC */
+    static void write_chunk(std::ostream & out, const std::vector<std::uint8_t> & chunk)
+    {
+      std::vector<std::uint8_t> number;
+      push_big_endian(number, std::uint32_t(chunk.size() - 4));
+      push_big_endian(number, crc32(chunk.data(), chunk.size()));
+      out.write(reinterpret_cast<const char*>(number.data()), 4);
+      out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+      out.write(reinterpret_cast<const char*>(number.data() + 4), 4);
+    }
+
+    static std::uint32_t crc32(const std::uint8_t * data, std::size_t size)
+    {
+      static const std::vector<std::uint32_t> table = []{
+        std::vector<std::uint32_t> t(256);
+        for(std::uint32_t n = 0; n < 256; ++n){
+          std::uint32_t c = n;
+          for(int k = 0; k < 8; ++k)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+          t[n] = c;
+        }
+        return t;
+      }();
+      std::uint32_t c = 0xffffffffu;
+      for(std::size_t i = 0; i < size; ++i)
+        c = table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+      return c ^ 0xffffffffu;
+    }
+
+    static std::uint32_t adler32(const std::uint8_t * data, std::size_t size)
+    {
+      std::uint32_t a = 1, b = 0;
+      while(size){
+        // The sums do not overflow in 5552 bytes
+        std::size_t n = std::min<std::size_t>(size, 5552);
+        for(std::size_t i = 0; i < n; ++i){
+          a += data[i];
+          b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        size -= n;
+      }
+      return (b << 16) | a;
+    }
+
+    std::string _filename;
+    format _format;
+    double _frame_rate;
+    std::size_t _max_queued;
+    thread_pool _pool;
+
+    // Render thread
+    GLuint _buffers[SLOTS];
+    slot _slots[SLOTS];
+    int _next = 0, _oldest = 0;
+    std::size_t _dropped_since = 0; // By capture(), since the last slot was filled
+
+    // Shared, under _mutex
+    mutable std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<frame> _queue;
+    std::vector<std::vector<std::uint8_t>> _free; // Pixels to reuse
+    bool _stop = false;
+    statistics _stats;
+    std::size_t _dropped_unqueued = 0; // Since the last frame that was queued
+    std::size_t _dropped_at_end = 0;   // After the last one, set by finish()
+
+    // Encoder thread
+    std::thread _encoder;
+    std::ofstream _video;
+    int _video_width = 0, _video_height = 0;
+    bool _failed = false;
+    std::size_t _unwritten = 0; // Dropped, and not repeated yet because nothing was written
+    std::size_t _pictures = 0;
+    std::vector<std::uint8_t> _planes, _chunk;
+  };
+}
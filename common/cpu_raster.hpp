@@ -0,0 +1,543 @@
+#pragma once
+
+#include "common/thread_pool.hpp"
+#include "common/trace.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#define RASTER_SSE 1
+#include <emmintrin.h>
+#endif
+
+/* A software version of what shade.vert and shade.frag do on the GPU, for
+ * machines without one. It is much simpler than a general purpose software
+ * OpenGL: one kind of vertex (position and normal), one kind of shading.
+ *
+ * A frame goes like this:
+ *
+ * 1. draw() runs the vertex shader for every vertex of the model, clips the
+ *    triangles against the near plane, culls the back faces and sorts the
+ *    rest into bins: every TILE x TILE block of the screen gets the list of
+ *    triangles that touch it. Each thread fills its own bins, no locks.
+ *
+ * 2. finish() processes the tiles in parallel. For each tile, the triangles
+ *    are rasterized in the order they were drawn, 4 pixels at a time: the
+ *    three edge functions (positive inside the triangle) and the depth test
+ *    are evaluated with SSE. This pass only remembers which triangle is seen
+ *    in each pixel. Then the visible pixels are shaded once each, so the
+ *    expensive part (the lighting) is not wasted on hidden surfaces.
+ *
+ * A tile is small enough that its depth buffer stays in the cache, and no two
+ * threads write to the same pixels.
+ */
+namespace raster
+{
+  /* The lighting constants of shade.frag. The defaults are the ones used
+   * in 4.model, 2.shade has a different light and a colored highlight. */
+  struct material
+  {
+    glm::vec3 object_color   = glm::vec3(0.4f, 0.4f, 0.9f);
+    glm::vec3 light_color    = glm::vec3(0.8f, 0.8f, 0.8f);
+    glm::vec3 light_source   = glm::vec3(-2.f, 1.5f, 3.f);
+    glm::vec3 camera         = glm::vec3(0.f, 4.f, 4.f);
+    float ambient  = 0.02f;
+    float diffuse  = 0.9f;
+    float specular = 1.f;
+    glm::vec3 specular_color = glm::vec3(1.f, 1.f, 1.f);
+    float specular_power = 64.f;
+  };
+
+  /* RGBA8 pixels, first row is the top */
+  struct framebuffer
+  {
+    int width = 0;
+    int height = 0;
+    std::vector<std::uint32_t> color;
+
+    void resize(int w, int h)
+    {
+      width = w;
+      height = h;
+      color.resize(std::size_t(w) * h);
+    }
+  };
+
+  /* Writes the picture as a binary .ppm */
+  inline bool write_ppm(const std::string & filename, const framebuffer & fb)
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out << "P6\n" << fb.width << " " << fb.height << "\n255\n";
+    for(std::uint32_t c : fb.color){
+      char rgb[3] = { char(c & 0xff), char((c >> 8) & 0xff), char((c >> 16) & 0xff) };
+      out.write(rgb, 3);
+    }
+    return out.good();
+  }
+
+  class renderer
+  {
+  public:
+    enum { TILE = 64 };
+
+    struct stats
+    {
+      std::size_t triangles = 0; // Given to draw()
+      std::size_t binned = 0;    // After clipping and culling
+      std::size_t bin_entries = 0;
+    };
+
+    explicit renderer(util::thread_pool & pool = util::thread_pool::global()) :
+      _pool(pool), _bins(pool.size()), _setup(pool.size())
+    {
+      for(int i = 0; i < GAMMA_STEPS; ++i)
+        _gamma[i] = std::uint8_t(std::lround(std::pow(float(i) / (GAMMA_STEPS-1), 1.f/2.2f) * 255.f));
+    }
+
+    /* Starts a frame. Nothing is drawn to fb until finish(). */
+    void begin(framebuffer & fb, const glm::vec3 & clear_color)
+    {
+      _fb = &fb;
+      _clear = pack(glm::vec3(clear_color));
+      _tiles_x = (fb.width  + TILE - 1) / TILE;
+      _tiles_y = (fb.height + TILE - 1) / TILE;
+      for(std::vector<std::vector<std::uint32_t>> & bins : _bins){
+        bins.resize(std::size_t(_tiles_x) * _tiles_y);
+        for(std::vector<std::uint32_t> & bin : bins) bin.clear();
+      }
+      for(std::vector<triangle> & setup : _setup) setup.clear();
+      _materials.clear();
+      _stats = stats();
+    }
+
+    /* Like rendering a model with shade.vert and shade.frag:
+     * GL_TRIANGLES, counter-clockwise front faces, back faces culled.
+     * mvp and normal_mat are the values of u_mvp and u_normal_mat. */
+    void draw(const std::vector<glm::vec3> & positions,
+              const std::vector<glm::vec3> & normals,
+              const glm::mat4 & mvp, const glm::mat3 & normal_mat,
+              const material & m = material())
+    {
+      TRACE_SCOPE("raster::draw");
+      std::size_t vertices = std::min(positions.size(), normals.size());
+      shade_vertices(positions, normals, vertices, mvp, normal_mat);
+      bin(vertices / 3, m, [](std::size_t corner){ return corner; });
+    }
+
+    /* The same with glDrawElements: every three indices are a triangle */
+    void draw(const std::vector<glm::vec3> & positions,
+              const std::vector<glm::vec3> & normals,
+              const std::vector<std::uint32_t> & indices,
+              const glm::mat4 & mvp, const glm::mat3 & normal_mat,
+              const material & m = material())
+    {
+      TRACE_SCOPE("raster::draw");
+      std::size_t vertices = std::min(positions.size(), normals.size());
+      shade_vertices(positions, normals, vertices, mvp, normal_mat);
+      const std::uint32_t * index = indices.data();
+      bin(indices.size() / 3, m, [index](std::size_t corner){ return index[corner]; });
+    }
+
+    /* Rasterizes and shades everything drawn since begin() */
+    void finish()
+    {
+      TRACE_SCOPE("raster::finish");
+      for(const std::vector<triangle> & setup : _setup)
+        _stats.binned += setup.size();
+      for(const std::vector<std::vector<std::uint32_t>> & bins : _bins)
+        for(const std::vector<std::uint32_t> & bin : bins)
+          _stats.bin_entries += bin.size();
+
+      _pool.parallel_for(std::size_t(_tiles_x) * _tiles_y, 1,
+                         [&](std::size_t begin, std::size_t end, unsigned){
+        tile_buffers buffers;
+        for(std::size_t tile = begin; tile < end; ++tile)
+          render_tile(int(tile), buffers);
+      });
+    }
+
+    const stats & last_stats() const { return _stats; }
+
+  private:
+    enum { GAMMA_STEPS = 1 << 14 };
+    enum { THREAD_SHIFT = 26 }; // Bin entries are thread << THREAD_SHIFT | index
+
+    struct vertex
+    {
+      glm::vec4 clip;
+      glm::vec3 pos;    // v_pos of shade.vert
+      glm::vec3 normal; // v_normal
+    };
+
+    /* A triangle ready to be rasterized, in screen coordinates (pixels,
+     * y goes down) */
+    struct triangle
+    {
+      // Edge functions A*x + B*y + C, edge i is opposite to vertex i
+      float a[3], b[3], c[3];
+      bool top_left[3];
+      // Depth (normalized device z) is a plane in screen space
+      float za, zb, zc;
+      // Perspective correct interpolation: attributes are divided by w
+      float inv_w[3];
+      glm::vec3 pos_w[3];
+      glm::vec3 normal_w[3];
+      float inv_area;
+      int min_x, min_y, max_x, max_y;
+      std::uint32_t order; // Position in the draw order
+      std::uint32_t material;
+    };
+
+    struct tile_buffers
+    {
+      float depth[TILE * TILE];
+      std::int32_t seen[TILE * TILE];      // Index in `list`, -1 if none
+      std::vector<std::pair<std::uint32_t, const triangle*>> list;
+    };
+
+    static std::uint32_t pack(glm::vec3 c)
+    {
+      c = glm::clamp(c, 0.f, 1.f);
+      return std::uint32_t(std::lround(c.x * 255.f)) |
+        std::uint32_t(std::lround(c.y * 255.f)) << 8 |
+        std::uint32_t(std::lround(c.z * 255.f)) << 16 | 0xff000000u;
+    }
+
+    /* Vertex shader, for each vertex once */
+    void shade_vertices(const std::vector<glm::vec3> & positions,
+                        const std::vector<glm::vec3> & normals, std::size_t vertices,
+                        const glm::mat4 & mvp, const glm::mat3 & normal_mat)
+    {
+      _vertices.resize(vertices);
+      _pool.parallel_for(vertices, 4096, [&](std::size_t begin, std::size_t end, unsigned){
+        for(std::size_t i = begin; i < end; ++i){
+          vertex & v = _vertices[i];
+          v.clip = mvp * glm::vec4(positions[i], 1.f);
+          v.pos = glm::vec3(v.clip.x, v.clip.y, v.clip.z) / v.clip.w;
+          v.normal = normal_mat * normals[i];
+        }
+      });
+    }
+
+    /* Clipping, culling and binning of the triangles of the current draw.
+     * vertex_of gives the vertex of each corner. */
+    template <typename VertexOf>
+    void bin(std::size_t triangles, const material & m, VertexOf vertex_of)
+    {
+      std::uint32_t material_index = std::uint32_t(_materials.size());
+      _materials.push_back(m);
+      std::size_t first = _stats.triangles;
+      _stats.triangles += triangles;
+      _pool.parallel_for(triangles, 256, [&](std::size_t begin, std::size_t end, unsigned t){
+        for(std::size_t i = begin; i < end; ++i)
+          clip_and_bin(_vertices[vertex_of(3*i)], _vertices[vertex_of(3*i+1)],
+                       _vertices[vertex_of(3*i+2)],
+                       std::uint32_t(2*(first + i)), material_index, t);
+      });
+    }
+
+    static vertex lerp(const vertex & a, const vertex & b, float t)
+    {
+      // Clipping interpolates the outputs of the vertex shader
+      vertex v;
+      v.clip = a.clip + (b.clip - a.clip) * t;
+      v.pos = a.pos + (b.pos - a.pos) * t;
+      v.normal = a.normal + (b.normal - a.normal) * t;
+      return v;
+    }
+
+    /* Cuts the part in front of the near plane (z < -w) and bins the rest */
+    void clip_and_bin(const vertex & v0, const vertex & v1, const vertex & v2,
+                      std::uint32_t order, std::uint32_t material, unsigned t)
+    {
+      const vertex * v[3] = { &v0, &v1, &v2 };
+      // Entirely outside one of the side planes?
+      for(int axis = 0; axis < 2; ++axis){
+        if(v[0]->clip[axis] >  v[0]->clip.w and v[1]->clip[axis] >  v[1]->clip.w and
+           v[2]->clip[axis] >  v[2]->clip.w) return;
+        if(v[0]->clip[axis] < -v[0]->clip.w and v[1]->clip[axis] < -v[1]->clip.w and
+           v[2]->clip[axis] < -v[2]->clip.w) return;
+      }
+      float d[3];
+      int inside = 0;
+      for(int i = 0; i < 3; ++i){
+        d[i] = v[i]->clip.z + v[i]->clip.w;
+        inside += d[i] >= 0.f;
+      }
+      if(inside == 3){
+        setup(v0, v1, v2, order, material, t);
+        return;
+      }
+      if(inside == 0) return;
+
+      // Sutherland-Hodgman against a single plane gives 3 or 4 vertices
+      vertex polygon[4];
+      int n = 0;
+      for(int i = 0; i < 3; ++i){
+        int j = (i + 1) % 3;
+        if(d[i] >= 0.f) polygon[n++] = *v[i];
+        if((d[i] >= 0.f) != (d[j] >= 0.f))
+          polygon[n++] = lerp(*v[i], *v[j], d[i] / (d[i] - d[j]));
+      }
+      setup(polygon[0], polygon[1], polygon[2], order, material, t);
+      if(n == 4)
+        setup(polygon[0], polygon[2], polygon[3], order + 1, material, t);
+    }
+
+    void setup(const vertex & v0, const vertex & v1, const vertex & v2,
+               std::uint32_t order, std::uint32_t material, unsigned t)
+    {
+      const vertex * v[3] = { &v0, &v1, &v2 };
+      float x[3], y[3], z[3], inv_w[3];
+      for(int i = 0; i < 3; ++i){
+        inv_w[i] = 1.f / v[i]->clip.w;
+        x[i] = (v[i]->clip.x * inv_w[i] * 0.5f + 0.5f) * _fb->width;
+        y[i] = (0.5f - v[i]->clip.y * inv_w[i] * 0.5f) * _fb->height;
+        z[i] = v[i]->clip.z * inv_w[i];
+      }
+
+      // Twice the signed area. With y going down, counter-clockwise (front)
+      // triangles have a negative area.
+      float area = (x[1]-x[0])*(y[2]-y[0]) - (y[1]-y[0])*(x[2]-x[0]);
+      if(not (area < 0.f)) return; // Back face, or degenerate
+      // Swap two vertices so the edge functions are positive inside
+      std::swap(v[1], v[2]);
+      std::swap(x[1], x[2]); std::swap(y[1], y[2]);
+      std::swap(z[1], z[2]); std::swap(inv_w[1], inv_w[2]);
+      area = -area;
+
+      triangle tri;
+      tri.min_x = std::max(0, int(std::floor(std::min({x[0], x[1], x[2]}))));
+      tri.min_y = std::max(0, int(std::floor(std::min({y[0], y[1], y[2]}))));
+      tri.max_x = std::min(_fb->width  - 1, int(std::ceil(std::max({x[0], x[1], x[2]}))));
+      tri.max_y = std::min(_fb->height - 1, int(std::ceil(std::max({y[0], y[1], y[2]}))));
+      if(tri.min_x > tri.max_x or tri.min_y > tri.max_y) return;
+
+      for(int i = 0; i < 3; ++i){
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+        // Edge from j to k, positive on the side of i. Swapping j and k
+        // negates the three coefficients exactly, so two triangles sharing an
+        // edge agree on which pixels are on it.
+        tri.a[i] = y[j] - y[k];
+        tri.b[i] = x[k] - x[j];
+        tri.c[i] = x[j]*y[k] - y[j]*x[k];
+        // Pixels exactly on an edge belong to the triangle only if it is a
+        // top or a left edge, so they are not drawn twice
+        tri.top_left[i] = tri.a[i] > 0.f or (tri.a[i] == 0.f and tri.b[i] > 0.f);
+      }
+      tri.inv_area = 1.f / area;
+      // z = sum of the barycentric coordinates times the z of each vertex
+      tri.za = (tri.a[0]*z[0] + tri.a[1]*z[1] + tri.a[2]*z[2]) * tri.inv_area;
+      tri.zb = (tri.b[0]*z[0] + tri.b[1]*z[1] + tri.b[2]*z[2]) * tri.inv_area;
+      tri.zc = (tri.c[0]*z[0] + tri.c[1]*z[1] + tri.c[2]*z[2]) * tri.inv_area;
+      for(int i = 0; i < 3; ++i){
+        tri.inv_w[i] = inv_w[i];
+        tri.pos_w[i] = v[i]->pos * inv_w[i];
+        tri.normal_w[i] = v[i]->normal * inv_w[i];
+      }
+      tri.order = order;
+      tri.material = material;
+
+      std::vector<triangle> & setup = _setup[t];
+      std::uint32_t entry = std::uint32_t(t) << THREAD_SHIFT | std::uint32_t(setup.size());
+      setup.push_back(tri);
+      std::vector<std::vector<std::uint32_t>> & bins = _bins[t];
+      for(int ty = tri.min_y / TILE; ty <= tri.max_y / TILE; ++ty)
+        for(int tx = tri.min_x / TILE; tx <= tri.max_x / TILE; ++tx)
+          bins[std::size_t(ty) * _tiles_x + tx].push_back(entry);
+    }
+
+    void render_tile(int tile, tile_buffers & buffers)
+    {
+      const int tile_x = (tile % _tiles_x) * TILE;
+      const int tile_y = (tile / _tiles_x) * TILE;
+      const int width  = std::min(int(TILE), _fb->width  - tile_x);
+      const int height = std::min(int(TILE), _fb->height - tile_y);
+
+      // Triangles of every thread's bin, in draw order
+      buffers.list.clear();
+      for(std::size_t t = 0; t < _bins.size(); ++t)
+        for(std::uint32_t entry : _bins[t][tile]){
+          const triangle & tri =
+            _setup[entry >> THREAD_SHIFT][entry & ((1u << THREAD_SHIFT) - 1)];
+          buffers.list.emplace_back(tri.order, &tri);
+        }
+      std::sort(buffers.list.begin(), buffers.list.end(),
+                [](const std::pair<std::uint32_t, const triangle*> & a,
+                   const std::pair<std::uint32_t, const triangle*> & b){
+                  return a.first < b.first; });
+
+      // Pixels outside the screen never pass the depth test
+      for(int y = 0; y < TILE; ++y)
+        for(int x = 0; x < TILE; ++x){
+          bool outside = x >= width or y >= height;
+          buffers.depth[y*TILE + x] = outside ? -std::numeric_limits<float>::infinity() : 1.f;
+          buffers.seen[y*TILE + x] = -1;
+        }
+
+      for(std::size_t i = 0; i < buffers.list.size(); ++i)
+        rasterize(*buffers.list[i].second, std::int32_t(i), tile_x, tile_y, buffers);
+
+      shade(tile_x, tile_y, width, height, buffers);
+    }
+
+    /* Depth only pass: finds which triangle is seen in each pixel */
+    void rasterize(const triangle & tri, std::int32_t index, int tile_x, int tile_y,
+                   tile_buffers & buffers) const
+    {
+      int x0 = std::max(tri.min_x, tile_x) - tile_x;
+      int x1 = std::min(tri.max_x, tile_x + TILE - 1) - tile_x;
+      int y0 = std::max(tri.min_y, tile_y) - tile_y;
+      int y1 = std::min(tri.max_y, tile_y + TILE - 1) - tile_y;
+      x0 &= ~3; // Groups of 4 pixels
+
+      // Values at the center of the first pixel of the tile. Computed in
+      // double, the steps inside the tile are small and exact in float.
+      double cx = tile_x + 0.5, cy = tile_y + 0.5;
+      float e[3];
+      for(int i = 0; i < 3; ++i)
+        e[i] = float(double(tri.a[i])*cx + double(tri.b[i])*cy + double(tri.c[i]));
+      float z = float(double(tri.za)*cx + double(tri.zb)*cy + double(tri.zc));
+
+#ifdef RASTER_SSE
+      const __m128 steps = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+      const __m128 zero = _mm_setzero_ps();
+      __m128 a[3], row_e[3], top_left[3];
+      for(int i = 0; i < 3; ++i){
+        a[i] = _mm_set1_ps(tri.a[i]);
+        top_left[i] = _mm_castsi128_ps(_mm_set1_epi32(tri.top_left[i] ? -1 : 0));
+      }
+      const __m128 za = _mm_set1_ps(tri.za);
+      const __m128i id = _mm_set1_epi32(index);
+
+      for(int y = y0; y <= y1; ++y){
+        for(int i = 0; i < 3; ++i)
+          row_e[i] = _mm_set1_ps(e[i] + tri.b[i]*float(y));
+        __m128 row_z = _mm_set1_ps(z + tri.zb*float(y));
+        for(int x = x0; x <= x1; x += 4){
+          __m128 fx = _mm_add_ps(_mm_set1_ps(float(x)), steps);
+          __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+          for(int i = 0; i < 3; ++i){
+            __m128 ei = _mm_add_ps(row_e[i], _mm_mul_ps(a[i], fx));
+            __m128 in = _mm_or_ps(_mm_cmpgt_ps(ei, zero),
+                                  _mm_and_ps(_mm_cmpeq_ps(ei, zero), top_left[i]));
+            mask = _mm_and_ps(mask, in);
+          }
+          if(_mm_movemask_ps(mask) == 0) continue;
+
+          float * depth = &buffers.depth[y*TILE + x];
+          std::int32_t * seen = &buffers.seen[y*TILE + x];
+          __m128 zv = _mm_add_ps(row_z, _mm_mul_ps(za, fx));
+          __m128 old = _mm_loadu_ps(depth);
+          mask = _mm_and_ps(mask, _mm_cmplt_ps(zv, old));
+          // Near plane, anything further than far already fails against 1
+          mask = _mm_and_ps(mask, _mm_cmpge_ps(zv, _mm_set1_ps(-1.f)));
+          _mm_storeu_ps(depth, _mm_or_ps(_mm_and_ps(mask, zv), _mm_andnot_ps(mask, old)));
+          __m128i m = _mm_castps_si128(mask);
+          __m128i s = _mm_loadu_si128((const __m128i*)seen);
+          _mm_storeu_si128((__m128i*)seen,
+                           _mm_or_si128(_mm_and_si128(m, id), _mm_andnot_si128(m, s)));
+        }
+      }
+#else
+      for(int y = y0; y <= y1; ++y)
+        for(int x = x0; x <= x1; ++x){
+          bool in = true;
+          for(int i = 0; i < 3; ++i){
+            float ei = e[i] + tri.b[i]*float(y) + tri.a[i]*float(x);
+            in = in and (ei > 0.f or (ei == 0.f and tri.top_left[i]));
+          }
+          float zv = z + tri.zb*float(y) + tri.za*float(x);
+          float & depth = buffers.depth[y*TILE + x];
+          if(in and zv < depth and zv >= -1.f){
+            depth = zv;
+            buffers.seen[y*TILE + x] = index;
+          }
+        }
+#endif
+    }
+
+    /* shade.frag for every pixel where a triangle is seen */
+    void shade(int tile_x, int tile_y, int width, int height,
+               const tile_buffers & buffers) const
+    {
+      for(int y = 0; y < height; ++y){
+        std::uint32_t * out = &_fb->color[std::size_t(tile_y + y) * _fb->width + tile_x];
+        for(int x = 0; x < width; ++x){
+          std::int32_t index = buffers.seen[y*TILE + x];
+          if(index < 0){
+            out[x] = _clear;
+            continue;
+          }
+          const triangle & tri = *buffers.list[index].second;
+          float px = tile_x + x + 0.5f, py = tile_y + y + 0.5f;
+          float l[3];
+          float inv_w = 0.f;
+          for(int i = 0; i < 3; ++i){
+            l[i] = (tri.a[i]*px + tri.b[i]*py + tri.c[i]) * tri.inv_area;
+            inv_w += l[i] * tri.inv_w[i];
+          }
+          float w = 1.f / inv_w;
+          glm::vec3 pos = (tri.pos_w[0]*l[0] + tri.pos_w[1]*l[1] + tri.pos_w[2]*l[2]) * w;
+          glm::vec3 normal = (tri.normal_w[0]*l[0] + tri.normal_w[1]*l[1] + tri.normal_w[2]*l[2]) * w;
+          out[x] = light(_materials[tri.material], pos, normal);
+        }
+      }
+    }
+
+    /* std::pow is most of the cost of the lighting, and the usual exponents
+     * are small integers, which only need a few multiplications */
+    static float power(float x, float p)
+    {
+      int n = int(p);
+      if(float(n) != p or n < 0 or n > 256) return std::pow(x, p);
+      float result = 1.f;
+      for(; n; n >>= 1, x *= x)
+        if(n & 1) result *= x;
+      return result;
+    }
+
+    /* The same as shade.frag, with the gamma correction from a table */
+    std::uint32_t light(const material & m, const glm::vec3 & pos,
+                        const glm::vec3 & normal) const
+    {
+      glm::vec3 to_light = m.light_source - pos;
+      glm::vec3 light_direction = glm::normalize(to_light);
+      glm::vec3 halfway_vector = glm::normalize(to_light + (m.camera - pos));
+      glm::vec3 color = m.object_color * m.light_color;
+
+      glm::vec3 linear = m.ambient * color;
+      linear += m.diffuse * color * std::max(glm::dot(normal, light_direction), 0.f);
+      float h = glm::dot(normal, halfway_vector);
+      if(h > 0.f)
+        linear += m.specular * m.specular_color * power(h, m.specular_power);
+
+      std::uint32_t rgba = 0xff000000u;
+      for(int i = 0; i < 3; ++i){
+        float c = std::min(std::max(linear[i], 0.f), 1.f);
+        rgba |= std::uint32_t(_gamma[int(c * (GAMMA_STEPS-1) + 0.5f)]) << (8*i);
+      }
+      return rgba;
+    }
+
+    util::thread_pool & _pool;
+    framebuffer * _fb = nullptr;
+    std::uint32_t _clear = 0;
+    int _tiles_x = 0, _tiles_y = 0;
+
+    std::vector<vertex> _vertices;  // Of the current draw
+    std::vector<material> _materials;
+    std::vector<std::vector<std::vector<std::uint32_t>>> _bins; // [thread][tile]
+    std::vector<std::vector<triangle>> _setup;                  // [thread]
+    std::uint8_t _gamma[GAMMA_STEPS];
+    stats _stats;
+  };
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <GLFW/glfw3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <ostream>
+#include <vector>
+
+namespace util
+{
+  /* Decides when the main loop draws a frame.
+   *
+   * - on_demand:  sleeps in glfwWaitEvents until someone calls request_redraw()
+   *               (usually an event callback). An idle window costs no CPU.
+   * - continuous: draws all the time, the speed is limited by glfwSwapInterval.
+   * - capped:     draws at a target rate, sleeping between frames. The deadlines
+   *               are absolute so the rate does not drift with the event load.
+   *
+   * The loop looks like:
+   *
+   *   while(not glfwWindowShouldClose(window)){
+   *     if(not scheduler.wait()) continue;
+   *     render(scheduler.time());
+   *     glfwSwapBuffers(window);
+   *     scheduler.presented();
+   *   }
+   *
+   * Animations should use time(), which comes from a real clock, instead of
+   * counting frames.
+   */
+  class frame_scheduler
+  {
+  public:
+    enum mode { on_demand, continuous, capped };
+
+    typedef std::chrono::steady_clock clock;
+
+    frame_scheduler(mode m = on_demand, double target_fps = 60.0) :
+      _mode(m),
+      _period(1.0/target_fps),
+      _refresh_period(1.0/60.0),
+      _dirty(true), // The first frame is always drawn
+      _start(clock::now()),
+      _next_deadline(0.0),
+      _last_present(-1.0),
+      _intervals(STATS_FRAMES, 0.0)
+    {}
+
+    void set_mode(mode m, double target_fps = 0.0)
+    {
+      _mode = m;
+      if(target_fps > 0.0) _period = 1.0/target_fps;
+      _next_deadline = time();
+      _last_present = -1.0;
+      _dirty = true;
+    }
+
+    mode get_mode() const { return _mode; }
+
+    /* Reads the refresh rate of the primary monitor, used to count missed
+     * vsyncs. Call it after glfwInit. */
+    void detect_refresh_rate()
+    {
+      GLFWmonitor * monitor = glfwGetPrimaryMonitor();
+      const GLFWvidmode * video_mode = monitor ? glfwGetVideoMode(monitor) : nullptr;
+      if(video_mode and video_mode->refreshRate > 0)
+        _refresh_period = 1.0/video_mode->refreshRate;
+    }
+
+    /* Asks for a new frame. Only from the thread running the loop. */
+    void request_redraw()
+    {
+      _dirty.store(true, std::memory_order_relaxed);
+    }
+
+    /* Same as request_redraw, but callable from any thread: it also wakes up
+     * the loop if it is sleeping in glfwWaitEvents. */
+    void wake()
+    {
+      _dirty.store(true, std::memory_order_relaxed);
+      glfwPostEmptyEvent();
+    }
+
+    /* Processes the pending events and blocks until the next frame is due.
+     * Returns false if the loop should go on without drawing (eg: the window
+     * was closed or the wake up did not need a redraw). */
+    bool wait()
+    {
+      switch(_mode){
+      case on_demand:
+        if(not _dirty.load(std::memory_order_relaxed))
+          glfwWaitEvents();
+        else
+          glfwPollEvents();
+        return _dirty.exchange(false, std::memory_order_relaxed);
+
+      case continuous:
+        glfwPollEvents();
+        _dirty = false;
+        return true;
+
+      case capped:
+        {
+          double now = time();
+          if(now < _next_deadline){
+            glfwWaitEventsTimeout(_next_deadline - now);
+            // Woken up early by an event, go on waiting in the next call
+            if(time() < _next_deadline) return false;
+          }
+          else glfwPollEvents();
+          // If we fell behind do not try to catch up with a burst of frames
+          _next_deadline = std::max(_next_deadline + _period, time());
+          _dirty = false;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /* Call right after glfwSwapBuffers. Collects the frame pacing statistics. */
+    void presented()
+    {
+      double now = time();
+      // In on_demand mode frames are not periodic, pacing makes no sense there
+      if(_last_present >= 0.0 and _mode != on_demand){
+        _intervals[_frames % STATS_FRAMES] = now - _last_present;
+        ++_frames;
+      }
+      _last_present = now;
+    }
+
+    /* Seconds since the scheduler was created */
+    double time() const
+    {
+      return std::chrono::duration<double>(clock::now() - _start).count();
+    }
+
+    struct stats
+    {
+      std::size_t frames;   // Number of intervals in the window
+      double mean_interval; // Seconds
+      double jitter;        // Standard deviation of the interval, seconds
+      std::size_t missed_vsyncs;
+    };
+
+    /* Pacing over the last STATS_FRAMES frames */
+    stats pacing() const
+    {
+      stats s = {std::min<std::size_t>(_frames, STATS_FRAMES), 0.0, 0.0, 0};
+      if(s.frames == 0) return s;
+
+      // Expected interval: the target period rounded up to whole refreshes
+      double expected = _refresh_period;
+      if(_mode == capped)
+        expected = _refresh_period * std::max(1.0, std::ceil(_period/_refresh_period - 0.01));
+
+      for(std::size_t i = 0; i < s.frames; ++i)
+        s.mean_interval += _intervals[i];
+      s.mean_interval /= s.frames;
+      for(std::size_t i = 0; i < s.frames; ++i){
+        double d = _intervals[i] - s.mean_interval;
+        s.jitter += d*d;
+        if(_intervals[i] > expected + 0.5*_refresh_period)
+          ++s.missed_vsyncs;
+      }
+      s.jitter = std::sqrt(s.jitter / s.frames);
+      return s;
+    }
+
+    void report(std::ostream & out) const
+    {
+      stats s = pacing();
+      out << "Frame pacing over " << s.frames << " frames: "
+          << 1000.0*s.mean_interval << " ms/frame, jitter "
+          << 1000.0*s.jitter << " ms, " << s.missed_vsyncs
+          << " missed vsyncs" << std::endl;
+    }
+
+  private:
+    enum { STATS_FRAMES = 240 };
+
+    mode _mode;
+    double _period;
+    double _refresh_period;
+    std::atomic<bool> _dirty;
+    clock::time_point _start;
+    double _next_deadline;
+    double _last_present;
+    std::size_t _frames = 0;
+    std::vector<double> _intervals;
+  };
+}
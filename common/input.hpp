@@ -0,0 +1,144 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+namespace util
+{
+  /* The cursor events of a frame folded into one.
+   *
+   * A mouse can send several events per frame (1000 per second is common),
+   * and drawing only shows where the cursor ended up. The callback calls
+   * move() with every position, which only stores it; once per frame, before
+   * drawing, whoever follows the cursor (the trackball, the camera) is moved
+   * to position() or by delta() once, and clear() starts the next frame.
+   */
+  class cursor_accumulator
+  {
+  public:
+    void move(glm::vec2 position)
+    {
+      _to = position;
+      ++_events;
+    }
+
+    /* There were events since the last clear() */
+    bool moved() const { return _events != 0; }
+
+    /* Where the cursor is now */
+    glm::vec2 position() const { return _to; }
+
+    /* From where it was at the last clear() */
+    glm::vec2 delta() const { return _to - _from; }
+
+    std::size_t events() const { return _events; }
+
+    void clear()
+    {
+      if(_events){
+        _total_events += _events;
+        ++_updates;
+      }
+      _from = _to;
+      _events = 0;
+    }
+
+    /* Events per update since the beginning, how many moves were saved */
+    double events_per_update() const
+    {
+      return _updates ? double(_total_events) / _updates : 0.;
+    }
+
+  private:
+    glm::vec2 _from = glm::vec2(0.f), _to = glm::vec2(0.f);
+    std::size_t _events = 0;
+    std::size_t _total_events = 0, _updates = 0;
+  };
+
+  /* Time from an input event to the end of glfwSwapBuffers of the first
+   * frame that shows it.
+   *
+   *   callback:           latency.event();    (only for events that are drawn)
+   *   before drawing:     latency.frame();    (the events so far are in it)
+   *   after swapping:     latency.presented();
+   *
+   * The events are stamped when GLFW hands them to the callback, not when the
+   * system received them, and the frame reaches the screen at the next
+   * refresh after the swap, so the real input to photon latency is a bit
+   * longer: this is the part the program can do something about. The last
+   * SAMPLES events are kept for the percentiles.
+   */
+  class input_latency
+  {
+  public:
+    typedef std::chrono::steady_clock clock;
+
+    struct statistics
+    {
+      std::size_t events = 0; // Measured, in the last SAMPLES
+      double p50 = 0., p90 = 0., p99 = 0., max = 0.; // Seconds
+    };
+
+    input_latency() { _samples.reserve(SAMPLES); }
+
+    void event()
+    {
+      // Without frames the events would pile up, only the oldest matter
+      if(_pending.size() < SAMPLES) _pending.push_back(clock::now());
+    }
+
+    void frame()
+    {
+      _in_frame.insert(_in_frame.end(), _pending.begin(), _pending.end());
+      _pending.clear();
+    }
+
+    void presented()
+    {
+      clock::time_point now = clock::now();
+      for(clock::time_point t : _in_frame){
+        double seconds = std::chrono::duration<double>(now - t).count();
+        if(_samples.size() < SAMPLES) _samples.push_back(seconds);
+        else _samples[_next] = seconds;
+        _next = (_next + 1) % SAMPLES;
+      }
+      _in_frame.clear();
+    }
+
+    statistics stats() const
+    {
+      statistics s;
+      s.events = _samples.size();
+      if(_samples.empty()) return s;
+      std::vector<double> sorted(_samples);
+      std::sort(sorted.begin(), sorted.end());
+      auto percentile = [&](double p){ return sorted[std::size_t(p * (sorted.size() - 1) + 0.5)]; };
+      s.p50 = percentile(0.5);
+      s.p90 = percentile(0.9);
+      s.p99 = percentile(0.99);
+      s.max = sorted.back();
+      return s;
+    }
+
+    void report(std::ostream & out) const
+    {
+      statistics s = stats();
+      out << "Input latency over " << s.events << " events: " << s.p50*1e3 << " ms median, "
+          << s.p90*1e3 << " ms p90, " << s.p99*1e3 << " ms p99, " << s.max*1e3 << " ms max"
+          << std::endl;
+    }
+
+  private:
+    enum { SAMPLES = 4096 };
+
+    std::vector<clock::time_point> _pending;  // Not drawn yet
+    std::vector<clock::time_point> _in_frame; // In the frame being drawn
+    std::vector<double> _samples;
+    std::size_t _next = 0;
+  };
+}
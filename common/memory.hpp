@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+namespace util
+{
+  namespace detail
+  {
+    /* A "Name:   1234 kB" line of /proc/self/status, in bytes */
+    inline std::size_t proc_status_bytes(const std::string & name)
+    {
+      std::ifstream status("/proc/self/status");
+      std::string line;
+      while(std::getline(status, line))
+        if(line.compare(0, name.size(), name) == 0 and line.size() > name.size() and
+           line[name.size()] == ':')
+          return std::size_t(std::stoull(line.substr(name.size() + 1))) * 1024;
+      return 0;
+    }
+  }
+
+  /* Memory of the process that is in RAM right now, in bytes. 0 where we do
+   * not know how to ask (only Linux for now). */
+  inline std::size_t resident_bytes()
+  {
+    return detail::proc_status_bytes("VmRSS");
+  }
+
+  /* The highest resident_bytes() since the process started (the high water
+   * mark), 0 where we do not know how to ask. */
+  inline std::size_t peak_resident_bytes()
+  {
+    return detail::proc_status_bytes("VmHWM");
+  }
+
+  /* Makes peak_resident_bytes() start again from resident_bytes(), to
+   * measure one part of a program. Returns false if it cannot (Linux before
+   * 4.0, or not Linux). */
+  inline bool reset_peak_resident()
+  {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+    clear_refs.flush();
+    return clear_refs.good();
+  }
+
+
+  /* What is on the heap, for programs that replace the global operator new
+   * and delete with counted_allocate() and counted_free() (4.model does with
+   * GLOW_COUNT_ALLOCATIONS, for its load benchmark). Everything stays 0 in the others. */
+  struct heap_counters
+  {
+    std::atomic<std::size_t> allocations{0}; // Since the program started
+    std::atomic<std::size_t> live_bytes{0};
+    std::atomic<std::size_t> peak_bytes{0};  // Highest live_bytes
+  };
+
+  inline heap_counters & heap()
+  {
+    static heap_counters counters;
+    return counters;
+  }
+
+  /* Makes heap().peak_bytes start again from heap().live_bytes */
+  inline void reset_heap_peak()
+  {
+    heap().peak_bytes = heap().live_bytes.load();
+  }
+
+  namespace detail
+  {
+    // Before each block, where its size is kept. As big as the alignment of
+    // malloc, so the blocks stay aligned the same way.
+    const std::size_t heap_header = 16;
+  }
+
+  /* malloc with counts in heap(), nullptr if there is no memory */
+  inline void * counted_allocate(std::size_t bytes)
+  {
+    char * p = static_cast<char*>(std::malloc(bytes + detail::heap_header));
+    if(not p) return nullptr;
+    *reinterpret_cast<std::size_t*>(p) = bytes;
+    heap_counters & h = heap();
+    ++h.allocations;
+    std::size_t live = h.live_bytes += bytes;
+    std::size_t peak = h.peak_bytes.load(std::memory_order_relaxed);
+    while(live > peak and not h.peak_bytes.compare_exchange_weak(peak, live)) {}
+    return p + detail::heap_header;
+  }
+
+  /* free for what counted_allocate gave */
+  inline void counted_free(void * block)
+  {
+    if(not block) return;
+    char * p = static_cast<char*>(block) - detail::heap_header;
+    heap().live_bytes -= *reinterpret_cast<std::size_t*>(p);
+    std::free(p);
+  }
+}
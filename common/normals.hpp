@@ -0,0 +1,292 @@
+#pragma once
+
+#include "common/thread_pool.hpp"
+#include "common/trace.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/* Normals and tangents for meshes that come without them.
+ *
+ * The meshes are indexed: a list of positions and, for each triangle, the
+ * index of the position of each of its three corners. The normals are
+ * indexed too, a list of normals and the index of the normal of each corner,
+ * the same way .obj files do it. A position gets one normal per smooth
+ * region around it, so sharp edges stay sharp.
+ *
+ * Everything runs in parallel on a util::thread_pool without atomics: the
+ * threads either write to separate places or count into their own partial
+ * arrays, which are added up afterwards.
+ */
+namespace geometry
+{
+  enum weighting
+  {
+    area_weighted,  // Big triangles count more, cheap and usually fine
+    angle_weighted  // Each triangle counts by its angle at the corner, does
+                    // not change when a triangle is split in thinner ones
+  };
+
+  namespace detail
+  {
+    /* Angle of the triangle at corner a */
+    inline float corner_angle(const glm::vec3 & a, const glm::vec3 & b, const glm::vec3 & c)
+    {
+      glm::vec3 u = b - a, v = c - a;
+      float lu = glm::length(u), lv = glm::length(v);
+      if(lu == 0.f or lv == 0.f) return 0.f;
+      return std::acos(std::min(std::max(glm::dot(u, v) / (lu * lv), -1.f), 1.f));
+    }
+
+    /* The corners around every vertex, in compressed rows: the corners of
+     * vertex v are corners[offsets[v]] to corners[offsets[v+1]-1], in the
+     * order of the triangles.
+     *
+     * The corners are cut in one block per thread. Each block counts the
+     * corners of every vertex in its own array, so the blocks never write to
+     * the same place. The counts then become the place where each block
+     * writes the corners of each vertex. */
+    struct vertex_corners
+    {
+      std::vector<std::uint32_t> offsets;
+      std::vector<std::uint32_t> corners;
+    };
+
+    inline void corners_by_vertex(std::size_t vertices, const std::uint32_t * indices,
+                                  std::size_t corners, vertex_corners & out,
+                                  util::thread_pool & pool)
+    {
+      TRACE_SCOPE("geometry::corners_by_vertex");
+      const std::size_t blocks =
+        std::max<std::size_t>(1, std::min<std::size_t>(pool.size(), corners / 4096));
+      auto block_begin = [&](std::size_t b){ return corners * b / blocks; };
+
+      std::vector<std::vector<std::uint32_t>> counts(blocks);
+      pool.parallel_for(blocks, 1, [&](std::size_t begin, std::size_t end, unsigned){
+        for(std::size_t b = begin; b < end; ++b){
+          counts[b].assign(vertices, 0);
+          for(std::size_t c = block_begin(b); c < block_begin(b+1); ++c)
+            ++counts[b][indices[c]];
+        }
+      });
+
+      // Total per vertex, then where each vertex starts
+      out.offsets.assign(vertices + 1, 0);
+      pool.parallel_for(vertices, 4096, [&](std::size_t begin, std::size_t end, unsigned){
+        for(std::size_t v = begin; v < end; ++v){
+          std::uint32_t total = 0;
+          for(std::size_t b = 0; b < blocks; ++b) total += counts[b][v];
+          out.offsets[v+1] = total;
+        }
+      });
+      for(std::size_t v = 0; v < vertices; ++v)
+        out.offsets[v+1] += out.offsets[v];
+
+      // The count of each block becomes its first free place
+      pool.parallel_for(vertices, 4096, [&](std::size_t begin, std::size_t end, unsigned){
+        for(std::size_t v = begin; v < end; ++v){
+          std::uint32_t place = out.offsets[v];
+          for(std::size_t b = 0; b < blocks; ++b){
+            std::uint32_t count = counts[b][v];
+            counts[b][v] = place;
+            place += count;
+          }
+        }
+      });
+
+      out.corners.resize(corners);
+      pool.parallel_for(blocks, 1, [&](std::size_t begin, std::size_t end, unsigned){
+        for(std::size_t b = begin; b < end; ++b)
+          for(std::size_t c = block_begin(b); c < block_begin(b+1); ++c)
+            out.corners[counts[b][indices[c]]++] = std::uint32_t(c);
+      });
+    }
+  }
+
+  /* Smooth normals for an indexed triangle mesh.
+   *
+   * The normal of a corner is the weighted average of the normals of the
+   * triangles around its vertex that are within crease_angle (radians) of
+   * its own triangle. Corners of a vertex that end up with the same normal
+   * share it.
+   *
+   * indices has 3 entries per triangle, counter-clockwise. The output is
+   * the list of normals and the index in it of each corner.
+   */
+  inline void smooth_normals(const std::vector<glm::vec3> & positions,
+                             const std::vector<std::uint32_t> & indices,
+                             std::vector<glm::vec3> & normals,
+                             std::vector<std::uint32_t> & normal_indices,
+                             float crease_angle = 1.0471976f, // 60 degrees
+                             weighting w = angle_weighted,
+                             util::thread_pool & pool = util::thread_pool::global())
+  {
+    TRACE_SCOPE("geometry::smooth_normals");
+    const std::size_t triangles = indices.size() / 3;
+    const std::size_t corners = triangles * 3;
+
+    // Normal of each triangle and the weight of each corner
+    std::vector<glm::vec3> face_normals(triangles);
+    std::vector<float> weights(corners);
+    pool.parallel_for(triangles, 1024, [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t t = begin; t < end; ++t){
+        const glm::vec3 & a = positions[indices[3*t]];
+        const glm::vec3 & b = positions[indices[3*t+1]];
+        const glm::vec3 & c = positions[indices[3*t+2]];
+        glm::vec3 n = glm::cross(b - a, c - a);
+        float length = glm::length(n); // Twice the area
+        face_normals[t] = length > 0.f ? n / length : glm::vec3(0.f);
+        if(w == area_weighted){
+          weights[3*t] = weights[3*t+1] = weights[3*t+2] = length;
+        }else{
+          weights[3*t]   = detail::corner_angle(a, b, c);
+          weights[3*t+1] = detail::corner_angle(b, c, a);
+          weights[3*t+2] = detail::corner_angle(c, a, b);
+        }
+      }
+    });
+
+    detail::vertex_corners around;
+    detail::corners_by_vertex(positions.size(), indices.data(), corners, around, pool);
+
+    // Normal of each corner. Corners with the same neighbours add the same
+    // terms in the same order, so they get exactly the same normal.
+    const float min_cos = std::cos(crease_angle);
+    std::vector<glm::vec3> corner_normals(corners);
+    const std::size_t vertices = positions.size();
+    pool.parallel_for(vertices, 1024, [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t v = begin; v < end; ++v)
+        for(std::uint32_t i = around.offsets[v]; i < around.offsets[v+1]; ++i){
+          std::uint32_t c = around.corners[i];
+          const glm::vec3 & own = face_normals[c / 3];
+          glm::vec3 sum(0.f);
+          for(std::uint32_t j = around.offsets[v]; j < around.offsets[v+1]; ++j){
+            std::uint32_t other = around.corners[j];
+            const glm::vec3 & n = face_normals[other / 3];
+            if(glm::dot(own, n) >= min_cos)
+              sum += n * weights[other];
+          }
+          float length = glm::length(sum);
+          corner_normals[c] = length > 0.f ? sum / length : own;
+        }
+    });
+
+    // Equal normals of a vertex are stored once. First the number of
+    // different ones per vertex, then where they go.
+    std::vector<std::uint32_t> first(vertices + 1, 0);
+    normal_indices.resize(corners);
+    pool.parallel_for(vertices, 1024, [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t v = begin; v < end; ++v){
+        std::uint32_t unique = 0;
+        for(std::uint32_t i = around.offsets[v]; i < around.offsets[v+1]; ++i){
+          std::uint32_t c = around.corners[i];
+          std::uint32_t j = around.offsets[v];
+          while(j < i and corner_normals[around.corners[j]] != corner_normals[c]) ++j;
+          normal_indices[c] = j == i ? unique++ : normal_indices[around.corners[j]];
+        }
+        first[v+1] = unique;
+      }
+    });
+    for(std::size_t v = 0; v < vertices; ++v)
+      first[v+1] += first[v];
+
+    normals.resize(first[vertices]);
+    pool.parallel_for(vertices, 1024, [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t v = begin; v < end; ++v){
+        std::uint32_t next = 0; // New normals appear in order
+        for(std::uint32_t i = around.offsets[v]; i < around.offsets[v+1]; ++i){
+          std::uint32_t c = around.corners[i];
+          if(normal_indices[c] == next){
+            normals[first[v] + next] = corner_normals[c];
+            ++next;
+          }
+          normal_indices[c] += first[v];
+        }
+      }
+    });
+  }
+
+  /* Tangents for normal mapping, one per corner, following the conventions
+   * of MikkTSpace (used by Blender and most bakers), so normal maps baked
+   * there look right:
+   *
+   * - The tangent of a triangle points where u grows, the bitangent where v
+   *   grows. xyz is the tangent made perpendicular to the normal of the
+   *   corner and w is +1 or -1, the bitangent is w * cross(normal, tangent).
+   * - The tangents of the triangles around a vertex are averaged, weighted
+   *   by the angle at the corner, among the corners that share the normal,
+   *   the texture coordinate and the sign of w.
+   *
+   * All the index arrays have 3 entries per triangle.
+   */
+  inline void tangents(const std::vector<glm::vec3> & positions,
+                       const std::vector<std::uint32_t> & position_indices,
+                       const std::vector<glm::vec3> & normals,
+                       const std::vector<std::uint32_t> & normal_indices,
+                       const std::vector<glm::vec2> & tex_coords,
+                       const std::vector<std::uint32_t> & tex_indices,
+                       std::vector<glm::vec4> & tangents,
+                       util::thread_pool & pool = util::thread_pool::global())
+  {
+    TRACE_SCOPE("geometry::tangents");
+    const std::size_t triangles = position_indices.size() / 3;
+    const std::size_t corners = triangles * 3;
+
+    // Tangent of each corner before averaging, with its weight and sign
+    std::vector<glm::vec3> corner_tangents(corners);
+    std::vector<float> weights(corners);
+    std::vector<float> signs(corners);
+    pool.parallel_for(triangles, 1024, [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t t = begin; t < end; ++t){
+        glm::vec3 p[3];
+        glm::vec2 uv[3];
+        for(int k = 0; k < 3; ++k){
+          p[k] = positions[position_indices[3*t+k]];
+          uv[k] = tex_coords[tex_indices[3*t+k]];
+        }
+        glm::vec3 e1 = p[1] - p[0], e2 = p[2] - p[0];
+        glm::vec2 d1 = uv[1] - uv[0], d2 = uv[2] - uv[0];
+        float r = d1.x * d2.y - d2.x * d1.y;
+        // Degenerate mapping: any direction along the triangle will do
+        float s = r != 0.f ? 1.f / r : 0.f;
+        glm::vec3 tangent = r != 0.f ? (e1 * d2.y - e2 * d1.y) * s : e1;
+        glm::vec3 bitangent = r != 0.f ? (e2 * d1.x - e1 * d2.x) * s : glm::vec3(0.f);
+
+        for(int k = 0; k < 3; ++k){
+          std::size_t c = 3*t + k;
+          const glm::vec3 & n = normals[normal_indices[c]];
+          glm::vec3 projected = tangent - n * glm::dot(n, tangent);
+          float length = glm::length(projected);
+          projected = length > 0.f ? projected / length : glm::vec3(0.f);
+          corner_tangents[c] = projected;
+          signs[c] = glm::dot(glm::cross(n, projected), bitangent) < 0.f ? -1.f : 1.f;
+          weights[c] = detail::corner_angle(p[k], p[(k+1)%3], p[(k+2)%3]);
+        }
+      }
+    });
+
+    detail::vertex_corners around;
+    detail::corners_by_vertex(positions.size(), position_indices.data(), corners, around, pool);
+
+    tangents.resize(corners);
+    pool.parallel_for(positions.size(), 1024, [&](std::size_t begin, std::size_t end, unsigned){
+      for(std::size_t v = begin; v < end; ++v)
+        for(std::uint32_t i = around.offsets[v]; i < around.offsets[v+1]; ++i){
+          std::uint32_t c = around.corners[i];
+          glm::vec3 sum(0.f);
+          for(std::uint32_t j = around.offsets[v]; j < around.offsets[v+1]; ++j){
+            std::uint32_t other = around.corners[j];
+            if(normal_indices[other] == normal_indices[c] and
+               tex_indices[other] == tex_indices[c] and signs[other] == signs[c])
+              sum += corner_tangents[other] * weights[other];
+          }
+          float length = glm::length(sum);
+          tangents[c] = glm::vec4(length > 0.f ? sum / length : corner_tangents[c], signs[c]);
+        }
+    });
+  }
+}
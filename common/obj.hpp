@@ -8,166 +8,556 @@
 // It is plain text, you can open it and try to figure it out
 
 
+#include "common/arena.hpp"
+#include "common/trace.hpp"
+#include "common/normals.hpp"
+
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <memory>
 #include <vector>
-#include <unordered_map>
 #include <string>
 #include <fstream>
-#include <sstream>
-#include <algorithm>
-
-#include <iostream>
+#include <stdexcept>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
 
 
 namespace obj
 {
-  static std::string  rtrim(std::string s) {
-    auto first = std::find_if(s.rbegin(), s.rend(),
-                              [](auto ch){return !std::isspace(ch);});
-    s.erase(first.base(), s.end());
-    return s;
-  }
+  /* A range of scene::indices with the same object, group and material
+   * (the names of the last o, g and usemtl lines before the faces) */
+  struct submesh
+  {
+    std::string object;
+    std::string group;
+    std::string material;
+    std::uint32_t first_index = 0;
+    std::uint32_t index_count = 0;
+  };
 
-  static std::string ltrim(std::string s) {
-    auto last =  std::find_if(s.begin(), s.end(),
-                              [](auto ch){return !std::isspace(ch);});
-    s.erase(s.begin(),last);
-    return s;
-  }
+  /* Sizes of a mesh, from its v lines */
+  struct bounding_volume
+  {
+    glm::vec3 min = glm::vec3(0.f); // Axis aligned box
+    glm::vec3 max = glm::vec3(0.f);
+    glm::vec3 sphere_center = glm::vec3(0.f);
+    float sphere_radius = 0.f;
+    glm::vec3 centroid = glm::vec3(0.f); // Average of the positions
+  };
 
-  static std::string trim(std::string s) {
-    return ltrim(rtrim(s));
-  }
+  /* Everything in a file, in one vertex buffer and one index buffer (three
+   * indices per triangle). The submeshes follow each other in the indices,
+   * so the whole scene can also be drawn with a single call. */
+  struct scene
+  {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> tex_coords;       // Empty if some face has none
+    std::vector<glm::vec4> tangents;         // Only if asked for, and with tex_coords
+    std::vector<std::uint32_t> indices;
+    std::vector<submesh> submeshes;
+    std::vector<std::string> material_libraries; // mtllib lines, not read
+    bounding_volume bounds;
+  };
 
+  struct read_options
+  {
+    // Make a tangent per vertex (see geometry::tangents)
+    bool tangents = false;
+    // Used to make normals when the file has none (see geometry::smooth_normals)
+    float crease_angle = 1.0471976f;
+  };
 
-  class obj_file
+  namespace detail
   {
-  public:
-    obj_file(const std::string & filename)
-      : _in_file(filename)
-    {    
-      std::string line;
-      _good = _in_file.good();
-      while(std::getline(_in_file,line)){
-        if (line[0] == 'o'){
-          _offsets.emplace(trim(line.substr(2)),_in_file.tellg());
+    const std::uint32_t NONE = 0xffffffffu;
+
+    /* Indices of a face corner in the v, vt and vn lists */
+    struct corner
+    {
+      std::uint32_t v, vt, vn;
+    };
+
+    inline const char * skip_spaces(const char * s)
+    {
+      while(*s == ' ' or *s == '\t') ++s;
+      return s;
+    }
+
+    /* The rest of the line without the spaces around */
+    inline std::string name(const char * s)
+    {
+      s = skip_spaces(s);
+      const char * e = s + std::strlen(s);
+      while(e > s and std::isspace((unsigned char)e[-1])) --e;
+      return std::string(s, e);
+    }
+
+    /* Reads up to n floats, the missing ones are left as they are */
+    inline void floats(const char * s, float * out, int n)
+    {
+      for(int i = 0; i < n; ++i){
+        char * e;
+        float f = std::strtof(s, &e);
+        if(e == s) return;
+        out[i] = f;
+        s = e;
+      }
+    }
+
+    /* An index of a corner, 1 based, negative ones count from the end */
+    inline std::uint32_t index(const char * & s, std::size_t count)
+    {
+      // strtol would skip spaces and read the next corner in "1/ 2"
+      if(not std::isdigit((unsigned char)*s) and *s != '-') return NONE;
+      char * e;
+      long i = std::strtol(s, &e, 10);
+      if(e == s) return NONE;
+      s = e;
+      long resolved = i < 0 ? long(count) + i : i - 1;
+      if(i == 0 or resolved < 0 or resolved >= long(count))
+        throw std::runtime_error("Index out of range in face");
+      return std::uint32_t(resolved);
+    }
+
+    /* v, v/vt, v//vn or v/vt/vn. Returns false at the end of the line. */
+    inline bool read_corner(const char * & s, corner & c,
+                            std::size_t positions, std::size_t tex_coords, std::size_t normals)
+    {
+      s = skip_spaces(s);
+      if(*s == '\0' or *s == '\r' or *s == '\n' or *s == '#') return false;
+      c.v = index(s, positions);
+      if(c.v == NONE) throw std::runtime_error("Expected coordinates");
+      c.vt = c.vn = NONE;
+      if(*s == '/'){
+        ++s;
+        if(*s != '/') c.vt = index(s, tex_coords);
+        if(*s == '/'){
+          ++s;
+          c.vn = index(s, normals);
+        }
+      }
+      return true;
+    }
+
+    inline float cross_2d(glm::vec2 a, glm::vec2 b)
+    {
+      return a.x * b.y - a.y * b.x;
+    }
+
+    /* Memory reused from one polygon to the next */
+    struct polygon_scratch
+    {
+      std::vector<corner> polygon;
+      std::vector<corner> triangles;
+      std::vector<glm::vec2> projected;
+      std::vector<std::size_t> left;
+    };
+
+    /* Puts the triangles of scratch.polygon in scratch.triangles, with the
+     * same winding.
+     *
+     * Quads and bigger polygons are cut with ear clipping: the polygon is
+     * projected to the plane its (Newell) normal is closest to, and we keep
+     * cutting a corner (an "ear") that turns the same way as the polygon and
+     * has no other corner inside, until there are three left. Polygons that
+     * are not simple have no ears at some point, then the rest goes as a fan.
+     */
+    inline void triangulate(const std::vector<glm::vec3> & positions, polygon_scratch & scratch)
+    {
+      const std::vector<corner> & polygon = scratch.polygon;
+      std::vector<corner> & out = scratch.triangles;
+      out.clear();
+      std::size_t n = polygon.size();
+      if(n < 3) return;
+      if(n == 3){
+        out.insert(out.end(), polygon.begin(), polygon.end());
+        return;
+      }
+
+      glm::vec3 normal(0.f);
+      for(std::size_t i = 0; i < n; ++i){
+        const glm::vec3 & a = positions[polygon[i].v];
+        const glm::vec3 & b = positions[polygon[(i+1) % n].v];
+        normal += glm::vec3((a.y - b.y) * (a.z + b.z),
+                            (a.z - b.z) * (a.x + b.x),
+                            (a.x - b.x) * (a.y + b.y));
+      }
+      glm::vec3 size = glm::abs(normal);
+      int drop = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+      int u = (drop + 1) % 3, w = (drop + 2) % 3;
+      // Counter-clockwise in the projection, seen from the normal
+      float turn = normal[drop] < 0.f ? -1.f : 1.f;
+
+      std::vector<glm::vec2> & p = scratch.projected;
+      std::vector<std::size_t> & left = scratch.left;
+      p.resize(n);
+      left.resize(n);
+      for(std::size_t i = 0; i < n; ++i){
+        const glm::vec3 & q = positions[polygon[i].v];
+        p[i] = glm::vec2(q[u], q[w]);
+        left[i] = i;
+      }
+
+      auto is_ear = [&](std::size_t k){
+        std::size_t m = left.size();
+        std::size_t a = left[(k + m - 1) % m], b = left[k], c = left[(k + 1) % m];
+        if(turn * cross_2d(p[b] - p[a], p[c] - p[b]) <= 0.f) return false;
+        for(std::size_t j : left){
+          if(j == a or j == b or j == c) continue;
+          if(turn * cross_2d(p[b] - p[a], p[j] - p[a]) >= 0.f and
+             turn * cross_2d(p[c] - p[b], p[j] - p[b]) >= 0.f and
+             turn * cross_2d(p[a] - p[c], p[j] - p[c]) >= 0.f)
+            return false;
+        }
+        return true;
+      };
+
+      std::size_t k = 0, tried = 0;
+      while(left.size() > 3 and tried < left.size()){
+        if(is_ear(k)){
+          std::size_t m = left.size();
+          out.push_back(polygon[left[(k + m - 1) % m]]);
+          out.push_back(polygon[left[k]]);
+          out.push_back(polygon[left[(k + 1) % m]]);
+          left.erase(left.begin() + k);
+          if(k == left.size()) k = 0;
+          tried = 0;
+        }else{
+          k = (k + 1) % left.size();
+          ++tried;
         }
       }
-    }    
-  
-    
-    void get_object(const std::string & name,
-                    std::vector<glm::vec3> & coords,
-                    std::vector<glm::vec3> & normals,
-                    std::vector<glm::vec2> & tex_coords)
-    {
-      const auto offset_it = _offsets.find(name);
-      if (offset_it != end(_offsets)){
-        _in_file.clear();
-        _in_file.seekg(offset_it->second);
-        read_object(coords,normals,tex_coords);
-      }
-      else throw std::runtime_error("Object " + name + "not present in .obj file");
+      for(std::size_t i = 1; i + 1 < left.size(); ++i){
+        out.push_back(polygon[left[0]]);
+        out.push_back(polygon[left[i]]);
+        out.push_back(polygon[left[i+1]]);
+      }
     }
-    
-    
-    
-    std::vector<std::string> objects() const
-    {
-      std::vector<std::string> o(_offsets.size());
-      std::transform(begin(_offsets),end(_offsets), begin(o),
-                     [](auto it){return it.first;});
-      return o;
+
+    /* Reads the corners of a face line into scratch.polygon and triangulates
+     * them, with the counts of v, vt and vn lines seen so far */
+    inline void read_face(const char * p, const std::vector<glm::vec3> & positions,
+                          std::size_t v, std::size_t vt, std::size_t vn,
+                          polygon_scratch & scratch)
+    {
+      scratch.polygon.clear();
+      corner c;
+      while(read_corner(p, c, v, vt, vn))
+        scratch.polygon.push_back(c);
+      triangulate(positions, scratch);
     }
-    
-    bool good() const
+
+    /* Grows the bounds with the positions one at a time, so they are ready
+     * when the last v line is read. The sphere is Ritter's: when a point is
+     * outside, the sphere grows just enough to hold the old sphere and the
+     * point. It is not the smallest one, but within a few percent. */
+    struct bounds_builder
+    {
+      bounding_volume b;
+      glm::dvec3 sum = glm::dvec3(0.0); // Doubles, the files can be big
+      std::size_t count = 0;
+
+      void add(const glm::vec3 & p)
+      {
+        if(count == 0){
+          b.min = b.max = b.sphere_center = p;
+        }else{
+          b.min = glm::min(b.min, p);
+          b.max = glm::max(b.max, p);
+          glm::vec3 d = p - b.sphere_center;
+          float distance = glm::length(d);
+          if(distance > b.sphere_radius){
+            float radius = (b.sphere_radius + distance) / 2.f;
+            b.sphere_center += d * ((radius - b.sphere_radius) / distance);
+            b.sphere_radius = radius;
+          }
+        }
+        sum += glm::dvec3(p);
+        ++count;
+      }
+
+      bounding_volume done()
+      {
+        if(count) b.centroid = glm::vec3(sum / double(count));
+        return b;
+      }
+    };
+
+    /* A vertex of the output is a different combination of these */
+    struct vertex_key
+    {
+      std::uint32_t v, vt, vn, sign;
+      bool operator==(const vertex_key & o) const
+      {
+        return v == o.v and vt == o.vt and vn == o.vn and sign == o.sign;
+      }
+    };
+
+    inline std::uint64_t hash(const vertex_key & key)
     {
-      return _good;
+      std::uint64_t h = key.v * 0x9e3779b97f4a7c15ull;
+      h ^= (h >> 29) + key.vt * 0xbf58476d1ce4e5b9ull;
+      h ^= (h >> 31) + key.vn * 0x94d049bb133111ebull;
+      return h ^ (h >> 32) ^ key.sign;
     }
 
-    
-  private:
-    void read_object(std::vector<glm::vec3> & coords,
-                     std::vector<glm::vec3> & normals,
-                     std::vector<glm::vec2> & tex_coords) 
-    {
-      std::vector<glm::vec3> unordered_coords;
-      std::vector<glm::vec2> unordered_tex_coords;
-      std::vector<glm::vec3> unordered_normals;
-      
-      std::string tag;
-      std::string line = "";
-      glm::vec3 v3,center,coord;
-      glm::vec2 v2;
-
-      int coord_idx = 0;
-      int tex_idx = 0;
-      int norm_idx = 0;
-      center = glm::vec3(0,0,0);
-    
-      while (std::getline(_in_file, line)){
-        if (line.size() > 3){
-          std::istringstream reader(line);
-          std::getline(reader,tag,' ');
-          if(tag == "v"){
-            reader >> v3[0]; reader >> v3[1]; reader >> v3[2];
-            unordered_coords.push_back(v3);
-          }else if(tag == "vt"){
-            reader >> v2[0]; reader >> v2[1];
-            unordered_tex_coords.push_back(v2);
-          }else if(tag == "vn"){
-            reader >> v3[0]; reader >> v3[1]; reader >> v3[2];
-            unordered_normals.push_back(v3);          
-          }else if(tag == "f"){
-            std::string str_indices;
-            for(int i = 1; i <= 3; ++i){
-              std::getline(reader,str_indices,' ');
-              std::replace(begin(str_indices),end(str_indices),'/',' ');
-              std::istringstream reader_indices(str_indices);
-              if(! (reader_indices >> coord_idx))
-                throw std::runtime_error("Expected coordinates");
-              tex_idx = norm_idx = 0;
-              if(reader_indices >> tex_idx){
-                if(!(reader_indices >> norm_idx)){
-                  norm_idx = tex_idx;
-                  tex_idx = 0;
-                }
-              }
-              if(coord_idx){
-                if (coord_idx < 0)
-                  coord_idx = unordered_coords.size() + coord_idx;
-                else
-                  --coord_idx;
-                coord = unordered_coords.at(coord_idx);
-                coords.push_back(coord);
-                center += coord;
-              }
-              if(norm_idx){
-                if (norm_idx < 0)
-                  norm_idx = unordered_normals.size() + norm_idx;
-                else
-                  --norm_idx;
-                normals.push_back(unordered_normals.at(norm_idx));
-              }
-              if(tex_idx){
-                if (tex_idx < 0)
-                  tex_idx = unordered_tex_coords.size() + tex_idx;
-                else
-                  --tex_idx;
-                tex_coords.push_back(unordered_tex_coords.at(tex_idx));
-              }
-                                         
-            }
+    /* From vertex_key to the number of the vertex. The slots are one array in
+     * the arena, and a key that is not in its slot is in one of the next ones
+     * (linear probing). The slots only have the vertex, the key of a vertex
+     * is found with key_of(vertex): 4 bytes a slot instead of 20. */
+    class vertex_table
+    {
+    public:
+      /* For at most keys keys, with a quarter of the slots always free */
+      vertex_table(util::arena & memory, std::size_t keys)
+        : _mask(slots(keys) - 1), _slots(memory.allocate<std::uint32_t>(_mask + 1))
+      {
+        std::fill(_slots, _slots + _mask + 1, NONE);
+      }
+
+      /* The vertex of key. If it is not in the table it gets next. */
+      template <typename KeyOf>
+      std::uint32_t find_or_add(const vertex_key & key, std::uint32_t next,
+                                KeyOf key_of, bool & added)
+      {
+        for(std::size_t i = std::size_t(hash(key)) & _mask;; i = (i + 1) & _mask){
+          std::uint32_t & vertex = _slots[i];
+          if(vertex == NONE){
+            vertex = next;
+            added = true;
+            return next;
+          }
+          if(key_of(vertex) == key){
+            added = false;
+            return vertex;
+          }
+        }
+      }
+
+      static std::size_t bytes(std::size_t keys)
+      {
+        return slots(keys) * sizeof(std::uint32_t);
+      }
+
+    private:
+      static std::size_t slots(std::size_t keys)
+      {
+        std::size_t n = 16;
+        while(n < keys + keys / 3) n *= 2;
+        return n;
+      }
+
+      std::size_t _mask;
+      std::uint32_t * _slots;
+    };
+
+    /* What a file has, to allocate everything once */
+    struct file_counts
+    {
+      std::size_t positions = 0, tex_coords = 0, normals = 0;
+      std::size_t corners = 0;     // Of the triangles, after triangulating
+      std::size_t max_polygon = 0; // Corners of the biggest face
+    };
+
+    /* Cuts text (size bytes and a '\0' after them) in lines, with '\0'
+     * in place of the ends of line, and counts what is in them.
+     * The lines are then stepped with strlen, here and in read_scene, so a
+     * '\0' inside a line ends it for both. */
+    inline file_counts split_lines(char * text, std::size_t size)
+    {
+      TRACE_SCOPE("obj::split_lines");
+      file_counts counts;
+      char * end = text + size;
+      for(char * line = text; line < end;){
+        char * newline = (char*)std::memchr(line, '\n', end - line);
+        char * line_end = newline ? newline : end;
+        *line_end = '\0';
+        if(line_end > line and line_end[-1] == '\r') line_end[-1] = '\0';
+        line = line_end + 1;
+      }
+      for(char * line = text; line < end; line += std::strlen(line) + 1){
+        const char * p = skip_spaces(line);
+        if(p[0] == 'v' and p[1] == ' ') ++counts.positions;
+        else if(p[0] == 'v' and p[1] == 't' and p[2] == ' ') ++counts.tex_coords;
+        else if(p[0] == 'v' and p[1] == 'n' and p[2] == ' ') ++counts.normals;
+        else if(p[0] == 'f' and p[1] == ' '){
+          std::size_t n = 0;
+          for(p = skip_spaces(p + 2); *p and *p != '#'; p = skip_spaces(p)){
+            ++n;
+            while(*p and *p != ' ' and *p != '\t') ++p;
           }
+          if(n >= 3) counts.corners += 3 * (n - 2);
+          counts.max_polygon = std::max(counts.max_polygon, n);
         }
       }
-      center=center / float(coords.size());
-      std::transform(begin(coords),end(coords),begin(coords),
-                     [&center](auto v){return v - center;});
+      return counts;
     }
-        
-    bool _good;
-    std::ifstream _in_file;
-    std::unordered_map<std::string, std::streamoff> _offsets;
-  };
+  }
+
+
+  /* Reads every object, group and material range of a file.
+   *
+   * The file is read in one block, and a first look at it counts the
+   * coordinates and the faces, so that every array is allocated once with
+   * the right size instead of growing one push_back at a time. The
+   * temporary arrays of the loader come from a util::arena.
+   *
+   * The faces are triangulated (see detail::triangulate) and the corners that
+   * share position, texture coordinate and normal become a single vertex.
+   * If some face has no normals, the normals of the whole file are made with
+   * geometry::smooth_normals.
+   * The positions are left as they are in the file, scene::bounds has the
+   * center to move them to the origin with the model transform.
+   * Throws std::runtime_error if the file cannot be read or is wrong.
+   */
+  inline scene read_scene(const std::string & filename,
+                          const read_options & options = read_options())
+  {
+    TRACE_SCOPE("obj::read_scene");
+    // The whole file in one block, cut in lines and counted first
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if(not in.good())
+      throw std::runtime_error("Cannot open " + filename);
+    std::size_t size = std::size_t(in.tellg());
+    std::unique_ptr<char[]> text(new char[size + 1]);
+    in.seekg(0);
+    if(not in.read(text.get(), std::streamsize(size)))
+      throw std::runtime_error("Cannot read " + filename);
+    text[size] = '\0';
+    const detail::file_counts counts = detail::split_lines(text.get(), size);
+
+    std::vector<glm::vec3> file_positions, file_normals;
+    std::vector<glm::vec2> file_tex_coords;
+    file_positions.reserve(counts.positions);
+    file_normals.reserve(counts.normals);
+    file_tex_coords.reserve(counts.tex_coords);
+    // Corner indices, the way geometry:: wants them
+    const std::size_t counted = counts.corners;
+    std::vector<std::uint32_t> corner_positions(counted), corner_normals(counted),
+      corner_tex_coords(counted);
+    std::size_t corners = 0;
+    bool all_normals = true, all_tex_coords = true;
+    detail::polygon_scratch scratch;
+    scratch.polygon.reserve(counts.max_polygon);
+    scratch.triangles.reserve(3 * counts.max_polygon);
+    scratch.projected.reserve(counts.max_polygon);
+    scratch.left.reserve(counts.max_polygon);
+
+    scene s;
+    detail::bounds_builder bounds;
+    submesh current;
+    auto close_submesh = [&]{
+      std::uint32_t end = std::uint32_t(corners);
+      current.index_count = end - current.first_index;
+      if(current.index_count)
+        s.submeshes.push_back(current);
+      current.first_index = end;
+    };
+
+    for(char * line = text.get(); line < text.get() + size; line += std::strlen(line) + 1){
+      const char * p = detail::skip_spaces(line);
+      if(p[0] == 'v' and p[1] == ' '){
+        glm::vec3 v(0.f);
+        detail::floats(p + 2, &v[0], 3);
+        file_positions.push_back(v);
+        bounds.add(v);
+      }else if(p[0] == 'v' and p[1] == 't' and p[2] == ' '){
+        glm::vec2 v(0.f);
+        detail::floats(p + 3, &v[0], 2);
+        file_tex_coords.push_back(v);
+      }else if(p[0] == 'v' and p[1] == 'n' and p[2] == ' '){
+        glm::vec3 v(0.f);
+        detail::floats(p + 3, &v[0], 3);
+        file_normals.push_back(v);
+      }else if(p[0] == 'f' and p[1] == ' '){
+        detail::read_face(p + 2, file_positions, file_positions.size(),
+                          file_tex_coords.size(), file_normals.size(), scratch);
+        // The count is by words, a word like 1-2 can be read as two corners
+        if(corners + scratch.triangles.size() > counted)
+          throw std::runtime_error("Malformed face in " + filename);
+        for(const detail::corner & c : scratch.triangles){
+          corner_positions[corners] = c.v;
+          corner_normals[corners] = c.vn;
+          corner_tex_coords[corners] = c.vt;
+          all_normals = all_normals and c.vn != detail::NONE;
+          all_tex_coords = all_tex_coords and c.vt != detail::NONE;
+          ++corners;
+        }
+      }else if(p[0] == 'o' and p[1] == ' '){
+        close_submesh();
+        current.object = detail::name(p + 2);
+        current.group.clear();
+      }else if(p[0] == 'g' and (p[1] == ' ' or p[1] == '\0')){
+        close_submesh();
+        current.group = detail::name(p + 1);
+      }else if(std::strncmp(p, "usemtl ", 7) == 0){
+        close_submesh();
+        current.material = detail::name(p + 7);
+      }else if(std::strncmp(p, "mtllib ", 7) == 0){
+        s.material_libraries.push_back(detail::name(p + 7));
+      }
+      // Comments, smoothing groups (s), lines and points are ignored
+    }
+    close_submesh();
+    s.bounds = bounds.done();
+    text.reset();
+
+    // And a word like 3#comment as fewer, the rest of the arrays is unused
+    const std::size_t n = corners;
+    corner_positions.resize(n);
+    corner_normals.resize(n);
+    corner_tex_coords.resize(n);
+
+    if(not all_normals)
+      geometry::smooth_normals(file_positions, corner_positions, file_normals,
+                               corner_normals, options.crease_angle);
+
+    // Faces with the same vt and vn on a vertex can still disagree on the
+    // direction of the tangent, the sign keeps them apart
+    std::vector<glm::vec4> corner_tangents;
+    bool tangents = options.tangents and all_tex_coords and n > 0;
+    if(tangents)
+      geometry::tangents(file_positions, corner_positions, file_normals, corner_normals,
+                         file_tex_coords, corner_tex_coords, corner_tangents);
+
+    // One vertex per different corner. First the indices and the corner
+    // where each vertex is first seen, then the vertices, allocated once.
+    TRACE_SCOPE("obj::read_scene vertices");
+    util::arena memory(detail::vertex_table::bytes(n) + sizeof(std::uint32_t) * (n + 1));
+    detail::vertex_table table(memory, n);
+    std::uint32_t * first_corner = memory.allocate<std::uint32_t>(n);
+    std::uint32_t vertices = 0;
+    s.indices.resize(n);
+    auto key_of = [&](std::size_t c){
+      return detail::vertex_key{ corner_positions[c],
+                                 all_tex_coords ? corner_tex_coords[c] : detail::NONE,
+                                 corner_normals[c],
+                                 tangents and corner_tangents[c].w < 0.f };
+    };
+    for(std::size_t i = 0; i < n; ++i){
+      bool added;
+      s.indices[i] = table.find_or_add(key_of(i), vertices,
+                                       [&](std::uint32_t v){ return key_of(first_corner[v]); },
+                                       added);
+      if(added) first_corner[vertices++] = std::uint32_t(i);
+    }
+
+    s.positions.resize(vertices);
+    s.normals.resize(vertices);
+    if(all_tex_coords) s.tex_coords.resize(vertices);
+    if(tangents) s.tangents.resize(vertices);
+    for(std::uint32_t v = 0; v < vertices; ++v){
+      std::uint32_t c = first_corner[v];
+      s.positions[v] = file_positions[corner_positions[c]];
+      s.normals[v] = file_normals[corner_normals[c]];
+      if(all_tex_coords) s.tex_coords[v] = file_tex_coords[corner_tex_coords[c]];
+      if(tangents) s.tangents[v] = corner_tangents[c];
+    }
+    return s;
+  }
 }
@@ -0,0 +1,549 @@
+#pragma once
+
+// Reads .obj files that are too big for obj::read_scene, which keeps the
+// whole file and the whole result in memory at the same time.
+
+#include "common/obj.hpp"
+#include "common/memory.hpp"
+#include "common/trace.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace obj
+{
+  /* A piece of a mesh that can be drawn on its own: at most
+   * stream_options::chunk_vertices vertices and chunk_indices indices,
+   * which are local to the chunk */
+  struct chunk
+  {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<std::uint32_t> indices;
+    glm::vec3 box_min = glm::vec3(0.f), box_max = glm::vec3(0.f);
+
+    void compute_box()
+    {
+      box_min = box_max = positions.empty() ? glm::vec3(0.f) : positions.front();
+      for(const glm::vec3 & p : positions){
+        box_min = glm::min(box_min, p);
+        box_max = glm::max(box_max, p);
+      }
+    }
+
+    void clear()
+    {
+      positions.clear();
+      normals.clear();
+      indices.clear();
+    }
+  };
+
+  /* Where the chunks go. begin() is called once the bounds are known, before
+   * the first chunk. add() may take the vectors of the chunk, and returns
+   * false to stop reading. */
+  class chunk_sink
+  {
+  public:
+    virtual ~chunk_sink() {}
+    virtual void begin(const bounding_volume &) {}
+    virtual bool add(chunk & c) = 0;
+    virtual void end() {}
+  };
+
+  struct stream_options
+  {
+    std::size_t window_bytes = 4 << 20;   // Read from the file at a time
+    std::size_t chunk_vertices = 1 << 16; // Vertices per chunk at most
+    std::size_t chunk_indices = 6 << 16;  // Indices per chunk at most
+  };
+
+  struct stream_stats
+  {
+    std::size_t bytes = 0; // Read from the file, both passes
+    std::size_t triangles = 0;
+    std::size_t vertices = 0; // In all the chunks
+    std::size_t chunks = 0;
+    std::size_t peak_resident_bytes = 0; // Of the whole process, see util::peak_resident_bytes
+    bounding_volume bounds;
+  };
+
+  namespace detail
+  {
+    /* Gives the lines of a file one at a time, reading it in windows of a
+     * fixed size. No line is copied to a string: they point into the window,
+     * with the end of line replaced by '\0'. */
+    class line_reader
+    {
+    public:
+      line_reader(const std::string & filename, std::size_t window_bytes)
+        : _in(filename, std::ios::binary), _window(window_bytes + 1)
+      {
+        if(not _in.good())
+          throw std::runtime_error("Cannot open " + filename);
+      }
+
+      /* The next line, valid until the next call. nullptr at the end. */
+      char * next()
+      {
+        for(;;){
+          char * begin = _window.data() + _begin;
+          char * end = _window.data() + _end;
+          char * newline = (char*)std::memchr(begin, '\n', end - begin);
+          if(newline or (_eof and begin != end)){
+            char * line_end = newline ? newline : end;
+            if(line_end > begin and line_end[-1] == '\r') --line_end;
+            *line_end = '\0';
+            _begin = newline ? newline + 1 - _window.data() : _end;
+            return begin;
+          }
+          if(_eof) return nullptr;
+          refill();
+        }
+      }
+
+      void rewind()
+      {
+        _in.clear();
+        _in.seekg(0);
+        _begin = _end = 0;
+        _eof = false;
+      }
+
+      std::size_t bytes_read() const { return _bytes; }
+
+    private:
+      /* Keeps the incomplete line at the start of the window and reads after
+       * it. A line longer than the window makes it grow. */
+      void refill()
+      {
+        std::size_t left = _end - _begin;
+        std::memmove(_window.data(), _window.data() + _begin, left);
+        _begin = 0;
+        _end = left;
+        if(_end == _window.size() - 1)
+          _window.resize(2 * _window.size() - 1);
+        _in.read(_window.data() + _end, std::streamsize(_window.size() - 1 - _end));
+        std::size_t got = std::size_t(_in.gcount());
+        _end += got;
+        _bytes += got;
+        if(got == 0) _eof = true;
+      }
+
+      std::ifstream _in;
+      std::vector<char> _window; // One more byte for the '\0' of the last line
+      std::size_t _begin = 0, _end = 0;
+      std::size_t _bytes = 0;
+      bool _eof = false;
+    };
+  }
+
+  /* Reads a file in two passes without holding it, or the result, in memory.
+   *
+   * 1. The v and vn lines are kept (faces can point to any of them), and the
+   *    faces are used to add up a normal per position, weighted by area, for
+   *    the corners that have none in the file.
+   * 2. The faces are triangulated like read_scene does and sent to the sink
+   *    in chunks, the corners with the same v and vn in a chunk share a
+   *    vertex.
+   *
+   * So the memory used is the positions and normals of the file, one window
+   * and one chunk, instead of several times the size of the mesh. Texture
+   * coordinates are skipped, and the normals that are made have no creases
+   * (read_scene uses geometry::smooth_normals, which needs all the faces).
+   * Throws std::runtime_error if the file cannot be read or is wrong.
+   */
+  inline stream_stats stream_scene(const std::string & filename, chunk_sink & sink,
+                                   const stream_options & options = stream_options())
+  {
+    TRACE_SCOPE("obj::stream_scene");
+    detail::line_reader lines(filename, options.window_bytes);
+    std::vector<glm::vec3> positions, normals, vertex_normals;
+    detail::polygon_scratch scratch;
+    const std::vector<detail::corner> & triangles = scratch.triangles;
+    std::size_t tex_coords = 0;
+    detail::bounds_builder bounds;
+    stream_stats stats;
+
+    // Reads the corners of a face line into triangles, with the counts of
+    // v, vt and vn lines seen so far
+    auto read_face = [&](const char * p, std::size_t v, std::size_t vt, std::size_t vn){
+      detail::read_face(p, positions, v, vt, vn, scratch);
+    };
+
+    {
+      TRACE_SCOPE("obj::stream_scene attributes");
+      while(const char * line = lines.next()){
+        const char * p = detail::skip_spaces(line);
+        if(p[0] == 'v' and p[1] == ' '){
+          glm::vec3 v(0.f);
+          detail::floats(p + 2, &v[0], 3);
+          positions.push_back(v);
+          bounds.add(v);
+        }else if(p[0] == 'v' and p[1] == 'n' and p[2] == ' '){
+          glm::vec3 v(0.f);
+          detail::floats(p + 3, &v[0], 3);
+          normals.push_back(v);
+        }else if(p[0] == 'v' and p[1] == 't' and p[2] == ' '){
+          ++tex_coords;
+        }else if(p[0] == 'f' and p[1] == ' '){
+          read_face(p + 2, positions.size(), tex_coords, normals.size());
+          for(std::size_t t = 0; t < triangles.size(); t += 3){
+            const glm::vec3 & a = positions[triangles[t].v];
+            const glm::vec3 & b = positions[triangles[t+1].v];
+            const glm::vec3 & c = positions[triangles[t+2].v];
+            glm::vec3 n = glm::cross(b - a, c - a); // As long as twice the area
+            for(int i = 0; i < 3; ++i)
+              if(triangles[t+i].vn == detail::NONE){
+                // Only files without normals pay for these
+                if(vertex_normals.size() < positions.size())
+                  vertex_normals.resize(positions.size(), glm::vec3(0.f));
+                vertex_normals[triangles[t+i].v] += n;
+              }
+          }
+        }
+      }
+      for(glm::vec3 & n : vertex_normals){
+        float length = glm::length(n);
+        n = length > 0.f ? n / length : glm::vec3(0.f, 0.f, 1.f);
+      }
+    }
+    stats.bounds = bounds.done();
+    sink.begin(stats.bounds);
+
+    TRACE_SCOPE("obj::stream_scene faces");
+    chunk current;
+    current.positions.reserve(options.chunk_vertices);
+    current.normals.reserve(options.chunk_vertices);
+    std::unordered_map<std::uint64_t, std::uint32_t> local; // (v, vn) -> vertex
+    local.reserve(options.chunk_vertices);
+    bool stopped = false;
+    auto flush = [&]{
+      if(current.indices.empty()) return;
+      stats.vertices += current.positions.size();
+      ++stats.chunks;
+      current.compute_box();
+      stopped = not sink.add(current);
+      current.clear();
+      local.clear();
+    };
+
+    lines.rewind();
+    std::size_t v = 0, vt = 0, vn = 0;
+    while(const char * line = lines.next()){
+      const char * p = detail::skip_spaces(line);
+      if(p[0] == 'v' and p[1] == ' ') ++v;
+      else if(p[0] == 'v' and p[1] == 't' and p[2] == ' ') ++vt;
+      else if(p[0] == 'v' and p[1] == 'n' and p[2] == ' ') ++vn;
+      else if(p[0] == 'f' and p[1] == ' '){
+        read_face(p + 2, v, vt, vn);
+        for(std::size_t t = 0; t < triangles.size(); t += 3){
+          if(current.positions.size() + 3 > options.chunk_vertices or
+             current.indices.size() + 3 > options.chunk_indices){
+            flush();
+            if(stopped) break;
+          }
+          for(int i = 0; i < 3; ++i){
+            const detail::corner & c = triangles[t+i];
+            std::uint64_t key = std::uint64_t(c.v) << 32 | c.vn;
+            auto inserted = local.emplace(key, std::uint32_t(current.positions.size()));
+            if(inserted.second){
+              current.positions.push_back(positions[c.v]);
+              current.normals.push_back(c.vn == detail::NONE ? vertex_normals[c.v] : normals[c.vn]);
+            }
+            current.indices.push_back(inserted.first->second);
+          }
+          ++stats.triangles;
+        }
+        if(stopped) break;
+      }
+    }
+    if(not stopped) flush();
+    sink.end();
+
+    stats.bytes = lines.bytes_read();
+    stats.peak_resident_bytes = util::peak_resident_bytes();
+    return stats;
+  }
+
+
+  /* Sorts the triangles it is given into a grid of cells over the bounds
+   * of the mesh and sends them on as one chunk per cell (or more, when a cell
+   * has more than a chunk), so every chunk covers a small part of the space.
+   * That is what geometry_pager in 4.model needs to load only what the
+   * camera sees.
+   *
+   * The cells keep their triangles until they are full. If all the cells
+   * together hold more than max_vertices, the fullest one is sent early, so
+   * the memory stays bounded even for huge meshes.
+   */
+  class spatial_splitter : public chunk_sink
+  {
+  public:
+    spatial_splitter(chunk_sink & next, int cells = 16,
+                     const stream_options & options = stream_options(),
+                     std::size_t max_vertices = 1 << 22)
+      : _next(next), _cells(cells), _options(options), _max_vertices(max_vertices) {}
+
+    void begin(const bounding_volume & b) override
+    {
+      _min = b.min;
+      glm::vec3 size = glm::max(b.max - b.min, glm::vec3(1e-6f));
+      _cell_size = std::max(size.x, std::max(size.y, size.z)) / _cells;
+      for(int axis = 0; axis < 3; ++axis)
+        _grid[axis] = std::max(1, std::min(_cells, int(std::ceil(size[axis] / _cell_size))));
+      _next.begin(b);
+    }
+
+    bool add(chunk & c) override
+    {
+      ++_input;
+      for(std::size_t t = 0; t + 2 < c.indices.size(); t += 3){
+        const std::uint32_t * corners = &c.indices[t];
+        glm::vec3 center = (c.positions[corners[0]] + c.positions[corners[1]] +
+                            c.positions[corners[2]]) / 3.f;
+        cell & target = cell_of(center);
+        if(target.part.positions.size() + 3 > _options.chunk_vertices or
+           target.part.indices.size() + 3 > _options.chunk_indices)
+          if(not send(target)) return false;
+        for(int i = 0; i < 3; ++i){
+          // Vertices are shared inside a chunk of the input, and stay shared
+          std::uint64_t key = std::uint64_t(_input) << 32 | corners[i];
+          auto inserted = target.local.emplace(key, std::uint32_t(target.part.positions.size()));
+          if(inserted.second){
+            target.part.positions.push_back(c.positions[corners[i]]);
+            target.part.normals.push_back(c.normals[corners[i]]);
+            ++_buffered;
+          }
+          target.part.indices.push_back(inserted.first->second);
+        }
+      }
+      // Too much in memory, the fullest cell goes now
+      while(_buffered > _max_vertices){
+        auto fullest = std::max_element(_cell_map.begin(), _cell_map.end(),
+          [](const std::pair<const int, cell> & a, const std::pair<const int, cell> & b){
+            return a.second.part.positions.size() < b.second.part.positions.size();
+          });
+        if(not send(fullest->second)) return false;
+      }
+      return true;
+    }
+
+    void end() override
+    {
+      for(auto & c : _cell_map)
+        if(not send(c.second)) break;
+      _cell_map.clear();
+      _next.end();
+    }
+
+  private:
+    struct cell
+    {
+      chunk part;
+      std::unordered_map<std::uint64_t, std::uint32_t> local;
+    };
+
+    cell & cell_of(const glm::vec3 & p)
+    {
+      int id = 0;
+      for(int axis = 2; axis >= 0; --axis){
+        int i = int((p[axis] - _min[axis]) / _cell_size);
+        id = id * _grid[axis] + std::max(0, std::min(_grid[axis] - 1, i));
+      }
+      return _cell_map[id];
+    }
+
+    bool send(cell & c)
+    {
+      if(c.part.indices.empty()) return true;
+      _buffered -= c.part.positions.size();
+      c.part.compute_box();
+      bool more = _next.add(c.part);
+      c.part.clear();
+      c.local.clear();
+      return more;
+    }
+
+    chunk_sink & _next;
+    int _cells;
+    stream_options _options;
+    std::size_t _max_vertices;
+    glm::vec3 _min = glm::vec3(0.f);
+    float _cell_size = 1.f;
+    int _grid[3] = {1, 1, 1};
+    std::unordered_map<int, cell> _cell_map;
+    std::size_t _buffered = 0; // Vertices in all the cells
+    std::uint32_t _input = 0;  // Chunks received
+  };
+
+
+  /* The binary cache: the chunks as they are in memory, so a file that was
+   * read once can be loaded again without parsing, in the same bounded
+   * memory. It is only meant for this machine (native byte order).
+   *
+   *   "GLOWMSH2", bounding_volume
+   *   for each chunk: uint32 vertices, uint32 indices, box min, box max,
+   *                   positions, normals, indices
+   *
+   * The header of every chunk says where the next one is, so read_cache_index
+   * can list them (with their boxes) without reading the geometry, and
+   * read_cache_chunk can load any one of them later.
+   */
+  namespace detail
+  {
+    const char CACHE_MAGIC[8] = { 'G','L','O','W','M','S','H','2' };
+
+    struct cache_chunk_header
+    {
+      std::uint32_t vertices, indices;
+      glm::vec3 box_min, box_max;
+    };
+  }
+
+  /* Where a chunk is in a cache file */
+  struct cache_entry
+  {
+    std::uint64_t offset; // Of the geometry, after the header
+    std::uint32_t vertices, indices;
+    glm::vec3 box_min, box_max;
+
+    std::size_t bytes() const
+    {
+      return 2 * sizeof(glm::vec3) * std::size_t(vertices) + sizeof(std::uint32_t) * std::size_t(indices);
+    }
+  };
+
+  struct cache_index
+  {
+    bounding_volume bounds;
+    std::vector<cache_entry> chunks;
+  };
+
+  class cache_writer : public chunk_sink
+  {
+  public:
+    cache_writer(const std::string & filename)
+      : _out(filename, std::ios::binary), _filename(filename)
+    {
+      if(not _out.good())
+        throw std::runtime_error("Cannot write " + filename);
+    }
+
+    void begin(const bounding_volume & b) override
+    {
+      _out.write(detail::CACHE_MAGIC, sizeof(detail::CACHE_MAGIC));
+      _out.write((const char*)&b, sizeof(b));
+    }
+
+    bool add(chunk & c) override
+    {
+      detail::cache_chunk_header header{ std::uint32_t(c.positions.size()),
+                                         std::uint32_t(c.indices.size()),
+                                         c.box_min, c.box_max };
+      _out.write((const char*)&header, sizeof(header));
+      _out.write((const char*)c.positions.data(), sizeof(glm::vec3) * header.vertices);
+      _out.write((const char*)c.normals.data(), sizeof(glm::vec3) * header.vertices);
+      _out.write((const char*)c.indices.data(), sizeof(std::uint32_t) * header.indices);
+      return _out.good();
+    }
+
+    void end() override
+    {
+      _out.flush();
+      if(not _out.good())
+        throw std::runtime_error("Cannot write " + _filename);
+    }
+
+  private:
+    std::ofstream _out;
+    std::string _filename;
+  };
+
+  namespace detail
+  {
+    inline bounding_volume read_cache_header(std::ifstream & in, const std::string & filename)
+    {
+      char magic[sizeof(CACHE_MAGIC)];
+      bounding_volume b;
+      if(not in.read(magic, sizeof(magic)) or
+         std::memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 or
+         not in.read((char*)&b, sizeof(b)))
+        throw std::runtime_error(filename + " is not a mesh cache");
+      return b;
+    }
+  }
+
+  /* Reads the geometry of one chunk of an open cache file */
+  inline void read_cache_chunk(std::ifstream & in, const cache_entry & e, chunk & c)
+  {
+    c.positions.resize(e.vertices);
+    c.normals.resize(e.vertices);
+    c.indices.resize(e.indices);
+    c.box_min = e.box_min;
+    c.box_max = e.box_max;
+    in.clear();
+    in.seekg(std::streamoff(e.offset));
+    in.read((char*)c.positions.data(), sizeof(glm::vec3) * e.vertices);
+    in.read((char*)c.normals.data(), sizeof(glm::vec3) * e.vertices);
+    in.read((char*)c.indices.data(), sizeof(std::uint32_t) * e.indices);
+    if(not in)
+      throw std::runtime_error("Mesh cache cut short");
+    for(std::uint32_t i : c.indices)
+      if(i >= e.vertices)
+        throw std::runtime_error("Mesh cache has a wrong index");
+  }
+
+  /* Lists the chunks of a cache file, reading only their headers */
+  inline cache_index read_cache_index(const std::string & filename)
+  {
+    TRACE_SCOPE("obj::read_cache_index");
+    std::ifstream in(filename, std::ios::binary);
+    cache_index index;
+    index.bounds = detail::read_cache_header(in, filename);
+    detail::cache_chunk_header header;
+    while(in.read((char*)&header, sizeof(header))){
+      cache_entry e{ std::uint64_t(in.tellg()), header.vertices, header.indices,
+                     header.box_min, header.box_max };
+      index.chunks.push_back(e);
+      in.seekg(std::streamoff(e.bytes()), std::ios::cur);
+    }
+    return index;
+  }
+
+  /* Sends every chunk of a cache file to the sink. Throws
+   * std::runtime_error if the file cannot be read or is not a cache. */
+  inline stream_stats read_cache(const std::string & filename, chunk_sink & sink)
+  {
+    TRACE_SCOPE("obj::read_cache");
+    std::ifstream in(filename, std::ios::binary);
+    stream_stats stats;
+    stats.bounds = detail::read_cache_header(in, filename);
+    sink.begin(stats.bounds);
+
+    chunk c;
+    detail::cache_chunk_header header;
+    while(in.read((char*)&header, sizeof(header))){
+      cache_entry e{ std::uint64_t(in.tellg()), header.vertices, header.indices,
+                     header.box_min, header.box_max };
+      read_cache_chunk(in, e, c);
+      stats.vertices += e.vertices;
+      stats.triangles += e.indices / 3;
+      ++stats.chunks;
+      stats.bytes += sizeof(header) + e.bytes();
+      if(not sink.add(c)) break;
+    }
+    sink.end();
+    stats.peak_resident_bytes = util::peak_resident_bytes();
+    return stats;
+  }
+}
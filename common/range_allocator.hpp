@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <map>
+
+namespace util
+{
+  /* Hands out ranges of [0, capacity), eg: of elements of a big GPU buffer
+   * that many meshes share. It only does the bookkeeping, the memory is
+   * somewhere else.
+   *
+   * The free ranges are kept sorted by offset. allocate() takes the first one
+   * that is big enough (first fit) and free() merges the range with the free
+   * neighbours, so the free space is never in more pieces than needed.
+   */
+  class range_allocator
+  {
+  public:
+    explicit range_allocator(std::size_t capacity = 0) : _capacity(capacity)
+    {
+      if(capacity) _free[0] = capacity;
+    }
+
+    /* Finds size free elements. Returns false if there is no free range that
+     * big, even if there is that much free space in several pieces. */
+    bool allocate(std::size_t size, std::size_t & offset)
+    {
+      for(auto i = _free.begin(); i != _free.end(); ++i){
+        if(i->second < size) continue;
+        offset = i->first;
+        std::size_t left = i->second - size;
+        _free.erase(i);
+        if(left) _free[offset + size] = left;
+        _used += size;
+        return true;
+      }
+      return false;
+    }
+
+    /* Gives back a range that allocate() returned */
+    void free(std::size_t offset, std::size_t size)
+    {
+      if(size == 0) return;
+      _used -= size;
+      auto next = _free.lower_bound(offset);
+      if(next != _free.end() and offset + size == next->first){
+        size += next->second;
+        next = _free.erase(next);
+      }
+      if(next != _free.begin()){
+        auto previous = std::prev(next);
+        if(previous->first + previous->second == offset){
+          previous->second += size;
+          return;
+        }
+      }
+      _free[offset] = size;
+    }
+
+    std::size_t capacity() const { return _capacity; }
+    std::size_t used() const { return _used; }
+    std::size_t free_ranges() const { return _free.size(); }
+
+    std::size_t largest_free() const
+    {
+      std::size_t largest = 0;
+      for(const auto & r : _free) largest = std::max(largest, r.second);
+      return largest;
+    }
+
+    /* 0 when all the free space is in one piece, close to 1 when it is in
+     * many small ones: the part of the free space that is not in the largest
+     * free range. */
+    double fragmentation() const
+    {
+      std::size_t free = _capacity - _used;
+      return free ? 1.0 - double(largest_free()) / free : 0.0;
+    }
+
+  private:
+    std::size_t _capacity;
+    std::size_t _used = 0;
+    std::map<std::size_t, std::size_t> _free; // Offset to size
+  };
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "common/thread_pool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace util
+{
+  /* The segment of a pixel from the near plane to the far plane, in the
+   * coordinates of a model: origin + t * direction, t from 0 to 1. The same
+   * t is the same point of the segment for every model, so hits on
+   * different models compare by their t. */
+  struct ray
+  {
+    glm::vec3 origin;
+    glm::vec3 direction;
+  };
+
+  /* The ray of the center of pixel (x, y) of a width x height frame, counted
+   * from the bottom left like OpenGL, for a model drawn with mvp */
+  inline ray pixel_ray(const glm::mat4 & mvp, int x, int y, int width, int height)
+  {
+    glm::mat4 inverse = glm::inverse(mvp);
+    float nx = 2.f * (x + 0.5f) / width - 1.f;
+    float ny = 2.f * (y + 0.5f) / height - 1.f;
+    glm::vec4 near = inverse * glm::vec4(nx, ny, -1.f, 1.f);
+    glm::vec4 far = inverse * glm::vec4(nx, ny, 1.f, 1.f);
+    glm::vec3 a(near.x / near.w, near.y / near.w, near.z / near.w);
+    glm::vec3 b(far.x / far.w, far.y / far.w, far.z / far.w);
+    return ray{a, b - a};
+  }
+
+  struct ray_hit
+  {
+    float t = 2.f;              // Beyond the far plane if nothing was hit
+    std::uint32_t triangle = 0; // In the index buffer, like gl_PrimitiveID
+
+    bool hit() const { return t <= 1.f; }
+  };
+
+  /* The nearest front facing triangle (counter clockwise, as OpenGL culls
+   * the back faces) that the ray goes through. Möller-Trumbore on every
+   * triangle, split between the threads of the pool. */
+  inline ray_hit cast(const ray & r, const std::vector<glm::vec3> & positions,
+                      const std::vector<std::uint32_t> & indices,
+                      thread_pool & pool = thread_pool::global())
+  {
+    std::vector<ray_hit> best(pool.size());
+    pool.parallel_for(indices.size() / 3, 16384, [&](std::size_t begin, std::size_t end, unsigned thread){
+      ray_hit & b = best[thread];
+      for(std::size_t i = begin; i < end; ++i){
+        const glm::vec3 & v0 = positions[indices[3*i]];
+        glm::vec3 e1 = positions[indices[3*i + 1]] - v0;
+        glm::vec3 e2 = positions[indices[3*i + 2]] - v0;
+        glm::vec3 p = glm::cross(r.direction, e2);
+        float determinant = glm::dot(e1, p);
+        if(determinant <= 1e-12f) continue; // Back facing or parallel
+        glm::vec3 s = r.origin - v0;
+        float u = glm::dot(s, p);
+        if(u < 0.f or u > determinant) continue;
+        glm::vec3 q = glm::cross(s, e1);
+        float v = glm::dot(r.direction, q);
+        if(v < 0.f or u + v > determinant) continue;
+        float t = glm::dot(e2, q) / determinant;
+        if(t >= 0.f and t < b.t){
+          b.t = t;
+          b.triangle = std::uint32_t(i);
+        }
+      }
+    });
+    ray_hit nearest;
+    for(const ray_hit & b : best)
+      if(b.t < nearest.t) nearest = b;
+    return nearest;
+  }
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include "common/thread_pool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace util
+{
+  /* A hierarchy of transforms: the world matrix of a node is the world
+   * matrix of its parent times its own local matrix.
+   *
+   * There are no node objects, only arrays: parents, local and world
+   * matrices, one after the other in depth first order (every node is
+   * followed by its whole subtree, so a subtree is a range of the arrays
+   * and parents come before their children). Nodes are known by the handle
+   * add() returns, which does not change when the arrays are reordered.
+   *
+   * set_local() only marks the node as dirty. update() sorts the dirty nodes,
+   * drops the ones inside the subtree of another one and recomputes the
+   * ranges of the rest, and nothing else. The subtrees are independent, so
+   * they are split between the threads of the pool; a big one is cut into
+   * the subtrees of its children, after computing its root.
+   *
+   * world() is valid after update(). Adding nodes out of depth first order
+   * (a child to a node that is not the last one) reorders the arrays in the
+   * next update(), which touches them all once.
+   */
+  class scene_graph
+  {
+  public:
+    typedef std::uint32_t node;
+    static const node none = 0xffffffffu; // Parent of the roots
+
+    struct statistics
+    {
+      std::size_t nodes = 0;
+      std::size_t dirty = 0;   // Marked by set_local() or add()
+      std::size_t roots = 0;   // Of the subtrees that were recomputed
+      std::size_t updated = 0; // Nodes recomputed
+      std::size_t tasks = 0;   // Ranges given to the threads
+      bool reordered = false;
+    };
+
+    explicit scene_graph(thread_pool & pool = thread_pool::global()) : _pool(pool) {}
+
+    /* A new node under parent (none for a root) */
+    node add(node parent, const glm::mat4 & local = glm::mat4())
+    {
+      node n = node(_position.size());
+      std::uint32_t p = std::uint32_t(_handle.size());
+      std::uint32_t parent_position = parent == none ? node(none) : _position[parent];
+      // Still depth first if the parent is the last node or one of its
+      // ancestors: the new node only makes their subtrees longer
+      if(parent_position != none and not _reorder){
+        for(std::uint32_t a = std::uint32_t(_handle.size()) - 1; a != parent_position; a = _parent[a])
+          if(_parent[a] == none){ _reorder = true; break; }
+      }
+      _position.push_back(p);
+      _handle.push_back(n);
+      _parent.push_back(parent_position);
+      _end.push_back(p + 1);
+      _local.push_back(local);
+      _world.push_back(local);
+      _dirty.push_back(0);
+      if(not _reorder)
+        for(std::uint32_t a = parent_position; a != none; a = _parent[a])
+          _end[a] = p + 1;
+      mark(n);
+      return n;
+    }
+
+    void set_local(node n, const glm::mat4 & local)
+    {
+      _local[_position[n]] = local;
+      mark(n);
+    }
+
+    const glm::mat4 & local(node n) const { return _local[_position[n]]; }
+    const glm::mat4 & world(node n) const { return _world[_position[n]]; }
+
+    node parent(node n) const
+    {
+      std::uint32_t p = _parent[_position[n]];
+      return p == none ? node(none) : _handle[p];
+    }
+
+    std::size_t size() const { return _handle.size(); }
+
+    /* Recomputes the world matrices of the dirty nodes and their subtrees */
+    void update()
+    {
+      _stats = statistics();
+      _stats.nodes = size();
+      _stats.dirty = _dirty_nodes.size();
+      if(_reorder){
+        reorder();
+        _stats.reordered = true;
+      }
+
+      // The dirty nodes that are not under another one
+      _roots.clear();
+      for(node n : _dirty_nodes){
+        _dirty[n] = 0;
+        _roots.push_back(_position[n]);
+      }
+      _dirty_nodes.clear();
+      std::sort(_roots.begin(), _roots.end());
+      _tasks.clear();
+      std::uint32_t covered = 0;
+      for(std::uint32_t p : _roots){
+        if(p < covered) continue;
+        _tasks.push_back(range{p, _end[p]});
+        covered = _end[p];
+        _stats.updated += _end[p] - p;
+        ++_stats.roots;
+      }
+
+      // Cuts the big subtrees in the subtrees of their children until there
+      // is enough work for every thread
+      std::size_t target = std::max<std::size_t>(_stats.updated / (4 * _pool.size()), 256);
+      for(std::size_t t = 0; t < _tasks.size(); ++t){
+        range r = _tasks[t];
+        if(r.end - r.begin <= target or r.end - r.begin == 1) continue;
+        compute(r.begin);
+        _tasks[t] = range{r.begin + 1, _end[r.begin + 1]};
+        for(std::uint32_t c = _end[r.begin + 1]; c < r.end; c = _end[c])
+          _tasks.push_back(range{c, _end[c]});
+        --t; // The first child may need cutting too
+      }
+      _stats.tasks = _tasks.size();
+
+      _pool.parallel_for(_tasks.size(), 1, [this](std::size_t begin, std::size_t end, unsigned){
+        for(std::size_t t = begin; t < end; ++t)
+          for(std::uint32_t p = _tasks[t].begin; p < _tasks[t].end; ++p)
+            compute(p);
+      });
+    }
+
+    /* Of the last update() */
+    const statistics & stats() const { return _stats; }
+
+  private:
+    struct range { std::uint32_t begin, end; };
+
+    void mark(node n)
+    {
+      if(_dirty[n]) return;
+      _dirty[n] = 1;
+      _dirty_nodes.push_back(n);
+    }
+
+    /* The parent of p is up to date */
+    void compute(std::uint32_t p)
+    {
+      std::uint32_t parent = _parent[p];
+      _world[p] = parent == none ? _local[p] : _world[parent] * _local[p];
+    }
+
+    /* Puts the arrays back in depth first order, the roots and the children
+     * of every node in the order they were added */
+    void reorder()
+    {
+      const std::uint32_t count = std::uint32_t(_handle.size());
+      // Children of every node by handle, as one array
+      std::vector<std::uint32_t> first(count + 1, 0), children(count);
+      std::vector<node> roots;
+      for(node n = 0; n < count; ++n){
+        std::uint32_t p = _parent[_position[n]];
+        if(p == none) roots.push_back(n);
+        else ++first[_handle[p] + 1];
+      }
+      for(std::uint32_t n = 0; n < count; ++n) first[n + 1] += first[n];
+      std::vector<std::uint32_t> cursor(first.begin(), first.end() - 1);
+      for(node n = 0; n < count; ++n){
+        std::uint32_t p = _parent[_position[n]];
+        if(p != none) children[cursor[_handle[p]]++] = n;
+      }
+
+      std::vector<std::uint32_t> position(count), parent(count), end(count);
+      std::vector<node> handle(count);
+      std::vector<glm::mat4> local(count), world(count);
+      std::uint32_t next = 0;
+      std::vector<std::uint32_t> stack; // Positions whose subtree is not done
+      std::vector<std::uint32_t> child_cursor(first.begin(), first.end() - 1);
+      for(node root : roots){
+        auto visit = [&](node n, std::uint32_t parent_position){
+          std::uint32_t p = next++;
+          position[n] = p;
+          handle[p] = n;
+          parent[p] = parent_position;
+          local[p] = _local[_position[n]];
+          world[p] = _world[_position[n]];
+          stack.push_back(p);
+        };
+        visit(root, none);
+        while(not stack.empty()){
+          std::uint32_t p = stack.back();
+          node n = handle[p];
+          if(child_cursor[n] < first[n + 1]){
+            visit(children[child_cursor[n]++], p);
+          }else{
+            end[p] = next;
+            stack.pop_back();
+          }
+        }
+      }
+      _position.swap(position);
+      _handle.swap(handle);
+      _parent.swap(parent);
+      _end.swap(end);
+      _local.swap(local);
+      _world.swap(world);
+      _reorder = false;
+    }
+
+    thread_pool & _pool;
+    // By handle
+    std::vector<std::uint32_t> _position;
+    std::vector<std::uint8_t> _dirty;
+    std::vector<node> _dirty_nodes;
+    // By position, depth first
+    std::vector<node> _handle;
+    std::vector<std::uint32_t> _parent; // Position of the parent
+    std::vector<std::uint32_t> _end;    // One past the subtree
+    std::vector<glm::mat4> _local, _world;
+    bool _reorder = false;
+
+    std::vector<std::uint32_t> _roots;
+    std::vector<range> _tasks;
+    statistics _stats;
+  };
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "common/trace.hpp"
+
 #include <GL/glew.h>
 #include <GL/gl.h>
 
@@ -66,6 +68,7 @@ namespace shaders
    * error.*/
   GLuint link_program(const std::vector<GLuint> & shaders)
   {
+    TRACE_FUNCTION();
     typedef std::vector<GLuint>::const_iterator shaders_it;
 
     GLuint program = 0;
@@ -94,6 +97,7 @@ namespace shaders
    * with the details of the error as the .what() field*/
   GLuint compile_shader(const std::string & file, GLenum shader_type)
   {
+    TRACE_FUNCTION();
     std::stringstream error;
     std::string code = read_text_file(file);
     const char * c_code = code.c_str();
@@ -126,4 +130,14 @@ namespace shaders
     return link_program(shaders);
   }
 
+  /* A program with a single compute shader (needs OpenGL 4.3) */
+  GLuint build_compute_program(const std::string & compute_shader_file)
+  {
+    std::vector<GLuint> shaders(1);
+    shaders[0] = compile_shader(compute_shader_file, GL_COMPUTE_SHADER);
+    GLuint program = link_program(shaders);
+    glDeleteShader(shaders[0]);
+    return program;
+  }
+
 }
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+  /* A fixed set of threads that run parallel loops.
+   *
+   * parallel_for splits [0,count) in chunks of `grain` items and gives every
+   * thread a contiguous run of chunks. A thread that runs out of work steals
+   * half of what is left to another one, so loops where some chunks are much
+   * more expensive than others (eg: tiles of a fractal) stay balanced.
+   *
+   * The calling thread takes part in the loop as thread 0. The function gets
+   * the range of items to process and the index of the thread running it,
+   * handy to accumulate into per-thread partial results without atomics.
+   *
+   * A parallel_for called from inside another one runs serially.
+   */
+  class thread_pool
+  {
+  public:
+    typedef std::function<void(std::size_t, std::size_t, unsigned)> range_function;
+
+    explicit thread_pool(unsigned threads = 0)
+    {
+      if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+      _size = threads;
+      _ranges.reset(new range[threads]);
+      for(unsigned i = 1; i < threads; ++i)
+        _workers.emplace_back([this,i]{ work(i); });
+    }
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool & operator=(const thread_pool &) = delete;
+
+    ~thread_pool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+      }
+      _start.notify_all();
+      for(std::thread & t : _workers) t.join();
+    }
+
+    /* Number of threads, counting the caller */
+    unsigned size() const { return _size; }
+
+    /* Shared by everyone who does not need a pool of their own */
+    static thread_pool & global()
+    {
+      static thread_pool pool;
+      return pool;
+    }
+
+    /* Calls f(begin, end, thread) over [0,count) and returns when all of it
+     * is done. At most max_threads threads are used (0 means all of them).
+     * f must not throw. */
+    void parallel_for(std::size_t count, std::size_t grain,
+                      const range_function & f, unsigned max_threads = 0)
+    {
+      if(count == 0) return;
+      grain = std::max<std::size_t>(grain, 1);
+      std::size_t chunks = (count + grain - 1) / grain;
+      unsigned threads = max_threads ? std::min(max_threads, _size) : _size;
+      threads = unsigned(std::min<std::size_t>(threads, chunks));
+      if(threads <= 1 or inside_pool()){
+        f(0, count, 0);
+        return;
+      }
+
+      std::lock_guard<std::mutex> one_at_a_time(_run_mutex);
+      for(unsigned t = 0; t < _size; ++t){
+        std::uint64_t begin = t < threads ? chunks * t / threads : 0;
+        std::uint64_t end   = t < threads ? chunks * (t+1) / threads : 0;
+        _ranges[t].chunks.store(pack(begin, end), std::memory_order_relaxed);
+      }
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _job = job{&f, count, grain, threads};
+        _running = threads - 1;
+        ++_generation;
+      }
+      _start.notify_all();
+
+      inside_pool() = true;
+      run(0);
+      inside_pool() = false;
+
+      std::unique_lock<std::mutex> lock(_mutex);
+      _done.wait(lock, [this]{ return _running == 0; });
+    }
+
+  private:
+    struct job
+    {
+      const range_function * f;
+      std::size_t count;
+      std::size_t grain;
+      unsigned threads;
+    };
+
+    // Chunks [begin,end) still to be done by a thread, packed in 64 bits so
+    // the owner and the thieves can update it with a single CAS.
+    struct range
+    {
+      std::atomic<std::uint64_t> chunks{0};
+      char padding[64 - sizeof(std::atomic<std::uint64_t>)]; // No false sharing
+    };
+
+    static std::uint64_t pack(std::uint64_t begin, std::uint64_t end)
+    {
+      return (begin << 32) | end;
+    }
+    static std::uint64_t begin_of(std::uint64_t r) { return r >> 32; }
+    static std::uint64_t end_of(std::uint64_t r) { return r & 0xffffffffu; }
+
+    static bool & inside_pool()
+    {
+      static thread_local bool inside = false;
+      return inside;
+    }
+
+    /* Takes the first chunk of the own range */
+    bool pop(unsigned t, std::uint64_t & chunk)
+    {
+      std::atomic<std::uint64_t> & r = _ranges[t].chunks;
+      std::uint64_t current = r.load(std::memory_order_acquire);
+      while(begin_of(current) < end_of(current)){
+        if(r.compare_exchange_weak(current, pack(begin_of(current)+1, end_of(current)),
+                                   std::memory_order_acq_rel)){
+          chunk = begin_of(current);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /* Moves the second half of someone else's range to the own range */
+    bool steal(unsigned t, unsigned threads)
+    {
+      for(unsigned i = 1; i < threads; ++i){
+        std::atomic<std::uint64_t> & victim = _ranges[(t+i) % threads].chunks;
+        std::uint64_t current = victim.load(std::memory_order_acquire);
+        while(begin_of(current) < end_of(current)){
+          std::uint64_t b = begin_of(current), e = end_of(current);
+          std::uint64_t middle = e - (e - b + 1) / 2;
+          if(victim.compare_exchange_weak(current, pack(b, middle),
+                                          std::memory_order_acq_rel)){
+            // Our range is empty, nobody steals from it, a store is enough
+            _ranges[t].chunks.store(pack(middle, e), std::memory_order_release);
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    void run(unsigned t)
+    {
+      const job j = _job;
+      std::uint64_t chunk;
+      do{
+        while(pop(t, chunk)){
+          std::size_t begin = chunk * j.grain;
+          (*j.f)(begin, std::min(begin + j.grain, j.count), t);
+        }
+      }while(steal(t, j.threads));
+    }
+
+    void work(unsigned t)
+    {
+      inside_pool() = true;
+      std::uint64_t seen = 0;
+      std::unique_lock<std::mutex> lock(_mutex);
+      for(;;){
+        _start.wait(lock, [&]{ return _stop or _generation != seen; });
+        if(_stop) return;
+        seen = _generation;
+        if(t >= _job.threads) continue; // Not needed this time
+        lock.unlock();
+
+        run(t);
+
+        lock.lock();
+        if(--_running == 0) _done.notify_one();
+      }
+    }
+
+    unsigned _size;
+    std::unique_ptr<range[]> _ranges;
+    std::vector<std::thread> _workers;
+
+    std::mutex _run_mutex; // One parallel_for at a time
+    std::mutex _mutex;     // Protects what follows
+    std::condition_variable _start;
+    std::condition_variable _done;
+    job _job = job{nullptr, 0, 0, 0};
+    unsigned _running = 0;
+    std::uint64_t _generation = 0;
+    bool _stop = false;
+  };
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+/* A small CPU trace recorder.
+ *
+ * Put TRACE_SCOPE("name") at the beginning of a block and the time spent until
+ * the end of the block is recorded. Call trace::dump("trace.json") and open the
+ * file in chrome://tracing or https://ui.perfetto.dev to see a timeline.
+ *
+ * Every thread writes into its own ring buffer, so recording an event does not
+ * lock nor touch memory shared with other threads. When a ring is full the
+ * oldest events are overwritten.
+ *
+ * Everything is compiled out unless GLOW_TRACE is defined (cmake -DGLOW_TRACE=ON),
+ * the macros expand to nothing and dump() does nothing.
+ */
+
+#include <string>
+
+#ifdef GLOW_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <iostream>
+
+namespace trace
+{
+  namespace detail
+  {
+    inline std::int64_t now_ns()
+    {
+      using namespace std::chrono;
+      return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct event
+    {
+      const char * name; // Must be a string literal, it is stored as a pointer
+      std::int64_t begin;
+      std::int64_t end;
+    };
+
+    /* Single producer ring. Only the owner thread pushes, the dump reads the
+     * last CAPACITY events and then drops the ones the owner reached while
+     * copying, and the one it may be writing right now, which can be torn. */
+    class thread_buffer
+    {
+    public:
+      static const std::uint64_t CAPACITY = 1 << 15; // Power of two
+
+      thread_buffer(int tid) : _tid(tid), _head(0), _events(CAPACITY) {}
+
+      void push(const char * name, std::int64_t begin, std::int64_t end)
+      {
+        std::uint64_t h = _head.load(std::memory_order_relaxed);
+        _events[h & (CAPACITY-1)] = event{name, begin, end};
+        _head.store(h+1, std::memory_order_release);
+      }
+
+      std::vector<event> snapshot() const
+      {
+        std::uint64_t head  = _head.load(std::memory_order_acquire);
+        std::uint64_t first = head > CAPACITY ? head - CAPACITY : 0;
+        std::vector<event> copy;
+        copy.reserve(head - first);
+        for(std::uint64_t i = first; i < head; ++i)
+          copy.push_back(_events[i & (CAPACITY-1)]);
+        // The owner may have kept writing while we copied, drop what it
+        // reached, and the slot of after too: it can be half written
+        std::uint64_t after = _head.load(std::memory_order_acquire);
+        std::uint64_t safe_first = after + 1 > CAPACITY ? after + 1 - CAPACITY : 0;
+        if(safe_first > first)
+          copy.erase(copy.begin(),
+                     copy.begin() + std::min<std::uint64_t>(safe_first - first, copy.size()));
+        return copy;
+      }
+
+      int tid() const { return _tid; }
+      std::string name;
+
+    private:
+      int _tid;
+      std::atomic<std::uint64_t> _head;
+      std::vector<event> _events;
+    };
+
+    /* Owns the buffers of every thread that recorded something. Only touched
+     * once per thread (first event) and when dumping. */
+    struct registry
+    {
+      std::mutex mutex;
+      std::vector<std::unique_ptr<thread_buffer>> buffers;
+      std::int64_t start = now_ns();
+
+      static registry & get()
+      {
+        static registry r;
+        return r;
+      }
+
+      thread_buffer * create()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffers.emplace_back(new thread_buffer(int(buffers.size())+1));
+        return buffers.back().get();
+      }
+    };
+
+    inline thread_buffer & local_buffer()
+    {
+      static thread_local thread_buffer * buffer = registry::get().create();
+      return *buffer;
+    }
+
+    inline void write_json_string(std::ostream & out, const std::string & s)
+    {
+      out << '"';
+      for(char ch : s){
+        if(ch == '"' or ch == '\\') out << '\\';
+        out << ch;
+      }
+      out << '"';
+    }
+  }
+
+  /* Records the time between its construction and its destruction. */
+  class scope
+  {
+  public:
+    scope(const char * name) : _name(name), _begin(detail::now_ns()) {}
+    ~scope()
+    {
+      detail::local_buffer().push(_name, _begin, detail::now_ns());
+    }
+    scope(const scope &) = delete;
+    scope & operator=(const scope &) = delete;
+  private:
+    const char * _name;
+    std::int64_t _begin;
+  };
+
+  /* Name shown for the calling thread in the trace viewer. */
+  inline void thread_name(const std::string & name)
+  {
+    detail::thread_buffer & buffer = detail::local_buffer();
+    std::lock_guard<std::mutex> lock(detail::registry::get().mutex);
+    buffer.name = name;
+  }
+
+  /* Writes every recorded event in Chrome's trace event format.
+   * Can be called at any moment, threads keep recording while it runs. */
+  inline std::size_t dump(const std::string & filename)
+  {
+    detail::registry & r = detail::registry::get();
+    std::ofstream out(filename);
+    if(!out.good()){
+      std::cerr << "trace: cannot write '" << filename << "'" << std::endl;
+      return 0;
+    }
+
+    std::size_t count = 0;
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for(const auto & buffer : r.buffers){
+      if(!buffer->name.empty()){
+        out << (count++ ? ",\n" : "\n")
+            << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"
+            << buffer->tid() << ",\"args\":{\"name\":";
+        detail::write_json_string(out, buffer->name);
+        out << "}}";
+      }
+      for(const detail::event & e : buffer->snapshot()){
+        // Chrome expects microseconds, fractions are allowed
+        out << (count++ ? ",\n" : "\n") << "{\"ph\":\"X\",\"name\":";
+        detail::write_json_string(out, e.name);
+        out << ",\"pid\":1,\"tid\":" << buffer->tid()
+            << ",\"ts\":"  << (e.begin - r.start) / 1000.0
+            << ",\"dur\":" << (e.end - e.begin) / 1000.0 << "}";
+      }
+    }
+    out << "\n]}\n";
+    std::cout << "trace: " << count << " events written to '"
+              << filename << "'" << std::endl;
+    return count;
+  }
+}
+
+#define TRACE_CONCAT_IMPL(a,b) a##b
+#define TRACE_CONCAT(a,b) TRACE_CONCAT_IMPL(a,b)
+#define TRACE_SCOPE(name) ::trace::scope TRACE_CONCAT(_trace_scope_,__LINE__)(name)
+#define TRACE_FUNCTION()  TRACE_SCOPE(__func__)
+
+#else // GLOW_TRACE
+
+namespace trace
+{
+  inline void thread_name(const std::string &) {}
+  inline std::size_t dump(const std::string &) { return 0; }
+}
+
+#define TRACE_SCOPE(name)
+#define TRACE_FUNCTION()
+
+#endif // GLOW_TRACE
@@ -72,6 +72,8 @@ namespace util
     {
       glm::vec3 current_point = detail::point_to_sphere(point, _radius, _center);
       glm::vec3 rotation_axis = glm::cross(_previous_point, current_point);
+      // No rotation, and no axis to normalize
+      if(glm::length(rotation_axis) == 0.f) return;
       float angle = _speed*asin(glm::clamp(glm::length(rotation_axis),-1.f,1.f));
       glm::quat q = glm::angleAxis(angle, glm::normalize(rotation_axis));
       q = glm::normalize(q);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace util
+{
+  /* Passes snapshots from one producer thread to one consumer thread without
+   * locks nor waits.
+   *
+   * There are three copies of T: the producer writes in the back one, the
+   * consumer reads the front one, and the third is the last complete snapshot
+   * waiting to be picked up. Publishing and picking up just swap indices.
+   * If the producer is faster than the consumer the intermediate snapshots
+   * are dropped, the consumer always gets the latest one.
+   */
+  template <typename T>
+  class triple_buffer
+  {
+  public:
+    triple_buffer() : _middle(1), _back(2), _front(0) {}
+
+    /* Initializes the three copies, eg: to preallocate them. Not thread safe,
+     * call it before starting the threads. */
+    void fill(const T & value)
+    {
+      for(T & slot : _slots) slot = value;
+    }
+
+    // Producer side
+
+    /* The snapshot being written, only the producer can touch it */
+    T & back() { return _slots[_back]; }
+
+    /* Makes back() visible to the consumer and gives the producer a new one */
+    void publish()
+    {
+      _back = _middle.exchange(_back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    // Consumer side
+
+    /* Picks the latest published snapshot, if there is a new one.
+     * Returns true if front() changed. */
+    bool update()
+    {
+      if(not (_middle.load(std::memory_order_relaxed) & FRESH))
+        return false;
+      _front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX;
+      return true;
+    }
+
+    /* The snapshot being read, only the consumer can touch it */
+    const T & front() const { return _slots[_front]; }
+
+  private:
+    static const std::uint8_t INDEX = 0x3;
+    static const std::uint8_t FRESH = 0x4; // Set when the middle slot has not been read
+
+    T _slots[3];
+    std::atomic<std::uint8_t> _middle;
+    std::uint8_t _back;  // Only used by the producer
+    std::uint8_t _front; // Only used by the consumer
+  };
+}